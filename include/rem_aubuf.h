@@ -6,14 +6,41 @@
 
 struct aubuf;
 
+/** Audio buffer statistics */
+struct aubuf_stats {
+	uint64_t overrun;   /**< Number of overruns (samples dropped)   */
+	uint64_t underrun;  /**< Number of underruns (silence inserted) */
+	uint64_t late;      /**< Number of packets after their playout  */
+	uint64_t dup;       /**< Number of duplicate packets            */
+	uint64_t lost;      /**< Number of blocks lost in a ts gap      */
+	uint64_t pool_miss; /**< Number of writes that allocated memory */
+};
+
+/** Contiguous spans of buffered audio, from aubuf_peek() */
+struct aubuf_span {
+	const uint8_t *p[2];  /**< Start of each span              */
+	size_t sz[2];         /**< Size of each span in [bytes]    */
+};
+
 int  aubuf_alloc(struct aubuf **abp, size_t min_sz, size_t max_sz);
+int  aubuf_alloc_ring(struct aubuf **abp, size_t min_sz, size_t max_sz);
+void aubuf_set_adaptive(struct aubuf *ab, bool enable);
+void aubuf_set_stretch(struct aubuf *ab, unsigned ch);
+int  aubuf_set_plc(struct aubuf *ab, uint32_t srate, unsigned ch);
 int  aubuf_append(struct aubuf *ab, struct mbuf *mb);
+int  aubuf_put_ts(struct aubuf *ab, uint32_t ts, struct mbuf *mb);
+int  aubuf_set_ts_unit(struct aubuf *ab, size_t unit);
 int  aubuf_write(struct aubuf *ab, const uint8_t *p, size_t sz);
 void aubuf_read(struct aubuf *ab, uint8_t *p, size_t sz);
+int  aubuf_read_batch(struct aubuf **abv, int16_t **outv, size_t n,
+		      size_t sz);
+int  aubuf_peek(struct aubuf *ab, size_t sz, struct aubuf_span *span);
+void aubuf_consume(struct aubuf *ab, size_t sz);
 int  aubuf_get(struct aubuf *ab, uint32_t ptime, uint8_t *p, size_t sz);
 void aubuf_flush(struct aubuf *ab);
 int  aubuf_debug(struct re_printf *pf, const struct aubuf *ab);
 size_t aubuf_cur_size(const struct aubuf *ab);
+void aubuf_stats_get(const struct aubuf *ab, struct aubuf_stats *stats);
 
 
 static inline int aubuf_write_samp(struct aubuf *ab, const int16_t *sampv,
@@ -9,3 +9,19 @@ void auconv_from_s16(enum aufmt dst_fmt, void *dst_sampv,
 		     const int16_t *src_sampv, size_t sampc);
 void auconv_to_s16(int16_t *dst_sampv, enum aufmt src_fmt,
 		   void *src_sampv, size_t sampc);
+
+
+enum {
+	AUCONV_CH_MAX = 8,  /**< Maximum number of channels for remixing */
+};
+
+/** Defines the layout of an audio buffer */
+struct auconv_layout {
+	enum aufmt fmt;  /**< Sample format (S16LE, FLOAT or S24_3LE) */
+	unsigned ch;     /**< Number of channels, 1 to AUCONV_CH_MAX   */
+	bool planar;     /**< One buffer per channel, else interleaved */
+};
+
+int auconv_remix(void * const *dstv, const struct auconv_layout *dst,
+		 const void * const *srcv, const struct auconv_layout *src,
+		 size_t frames);
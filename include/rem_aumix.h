@@ -6,6 +6,24 @@
 
 struct aumix;
 struct aumix_source;
+struct aumix_engine;
+struct aubuf_stats;
+
+enum {
+	AUMIX_STATS_HIST = 16,
+};
+
+/** Audio mixer statistics */
+struct aumix_stats {
+	uint64_t ticks;    /**< Number of mixed frames                    */
+	uint64_t late;     /**< Ticks started more than one ptime late    */
+	uint64_t overrun;  /**< Ticks that took longer than one ptime     */
+	uint32_t mixed;    /**< Number of sources mixed in the last tick  */
+
+	/** Tick duration histogram, bucket N counts [2^N, 2^(N+1)) us,
+	 *  the first and last buckets also count shorter/longer ticks */
+	uint64_t hist[AUMIX_STATS_HIST];
+};
 
 /**
  * Audio mixer frame handler
@@ -16,13 +34,52 @@ struct aumix_source;
  */
 typedef void (aumix_frame_h)(const int16_t *sampv, size_t sampc, void *arg);
 
+/**
+ * Audio mixer frame handler for float mixers
+ *
+ * @param sampv Buffer with float audio samples
+ * @param sampc Number of samples
+ * @param arg   Handler argument
+ */
+typedef void (aumix_float_h)(const float *sampv, size_t sampc, void *arg);
+
 int aumix_alloc(struct aumix **mixp, uint32_t srate,
 		uint8_t ch, uint32_t ptime);
+int aumix_alloc_shared(struct aumix **mixp, struct aumix_engine *engine,
+		       uint32_t srate, uint8_t ch, uint32_t ptime);
+int aumix_alloc_fmt(struct aumix **mixp, struct aumix_engine *engine,
+		    uint32_t srate, uint8_t ch, uint32_t ptime,
+		    enum aufmt fmt);
+void aumix_set_speakers(struct aumix *mix, unsigned speakers);
+void aumix_set_lockfree(struct aumix *mix, bool enable);
+int aumix_stats_get(const struct aumix *mix, struct aumix_stats *stats);
 int aumix_playfile(struct aumix *mix, const char *filepath);
+void aumix_prompt_flush(void);
 uint32_t aumix_source_count(const struct aumix *mix);
 int aumix_source_alloc(struct aumix_source **srcp, struct aumix *mix,
 		       aumix_frame_h *fh, void *arg);
+int aumix_source_alloc_fmt(struct aumix_source **srcp, struct aumix *mix,
+			   uint32_t srate, uint8_t ch,
+			   aumix_frame_h *fh, void *arg);
+int aumix_source_alloc_float(struct aumix_source **srcp, struct aumix *mix,
+			     uint32_t srate, uint8_t ch,
+			     aumix_float_h *fh, void *arg);
 void aumix_source_enable(struct aumix_source *src, bool enable);
+void aumix_source_set_gain(struct aumix_source *src, float gain);
+void aumix_source_mute(struct aumix_source *src, bool mute);
+void aumix_source_set_agc(struct aumix_source *src, bool enable);
+void aumix_source_set_adaptive(struct aumix_source *src, bool enable);
+void aumix_source_set_stretch(struct aumix_source *src, bool enable);
+int  aumix_source_set_plc(struct aumix_source *src, bool enable);
 int  aumix_source_put(struct aumix_source *src, const int16_t *sampv,
 		      size_t sampc);
+int  aumix_source_put_float(struct aumix_source *src, const float *sampv,
+			    size_t sampc);
 void aumix_source_flush(struct aumix_source *src);
+int  aumix_source_stats_get(const struct aumix_source *src,
+			    struct aubuf_stats *stats);
+
+
+/* Engine */
+int aumix_engine_alloc(struct aumix_engine **engp, unsigned nworkers);
+unsigned aumix_engine_workers(const struct aumix_engine *eng);
@@ -15,10 +15,24 @@
 typedef void (auresamp_h)(int16_t *outv, const int16_t *inv,
 			  size_t inc, unsigned ratio);
 
-/** Defines the resampler state */
+struct auresamp_bank;
+struct auresamp_fstate;
+
+/**
+ * Defines the resampler state
+ *
+ * The state owns heap memory: the filter bank of a rational ratio,
+ * allocated by auresamp_setup(), and the float state, allocated by the
+ * first auresamp_float(). A resampler that has been set up must be
+ * released with auresamp_reset(), and must not be copied, as the copy
+ * would share and free the same memory. Integer ratios with int16
+ * samples hold no memory, as before.
+ */
 struct auresamp {
 	struct fir fir;        /**< FIR filter state */
-	auresamp_h *resample;  /**< Resample handler */
+	auresamp_h *resample;  /**< Resample handler, set if configured */
+	struct auresamp_bank *bank; /**< Polyphase filter bank */
+	struct auresamp_fstate *fst; /**< Float state, on first use */
 	const int16_t *tapv;   /**< FIR filter taps */
 	size_t tapc;           /**< FIR filter tap count */
 	uint32_t orate, irate; /**< Input/output sample rate */
@@ -28,7 +42,10 @@ struct auresamp {
 };
 
 void auresamp_init(struct auresamp *rs);
+void auresamp_reset(struct auresamp *rs);
 int  auresamp_setup(struct auresamp *rs, uint32_t irate, unsigned ich,
 		    uint32_t orate, unsigned och);
 int  auresamp(struct auresamp *rs, int16_t *outv, size_t *outc,
 	      const int16_t *inv, size_t inc);
+int  auresamp_float(struct auresamp *rs, float *outv, size_t *outc,
+		    const float *inv, size_t inc);
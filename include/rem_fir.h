@@ -4,12 +4,33 @@
  * Copyright (C) 2010 Creytiv.com
  */
 
+/** Maximum number of history samples (channels times taps) */
+#define FIR_HIST_MAX 256
+
 /** Defines the fir filter state */
 struct fir {
-	int16_t history[256];  /**< Previous samples */
-	unsigned index;        /**< Sample index */
+	int16_t history[FIR_HIST_MAX];  /**< Previous samples */
+	unsigned index;                 /**< Sample index */
+};
+
+/** Defines the float fir filter state */
+struct fir_float {
+	float history[FIR_HIST_MAX];    /**< Previous samples */
+	unsigned index;                 /**< Sample index */
 };
 
 void fir_reset(struct fir *fir);
 void fir_filter(struct fir *fir, int16_t *outv, const int16_t *inv, size_t inc,
 		unsigned ch, const int16_t *tapv, size_t tapc);
+void fir_float_reset(struct fir_float *fir);
+void fir_float_filter(struct fir_float *fir, float *outv, const float *inv,
+		      size_t inc, unsigned ch, const float *tapv, size_t tapc);
+
+
+struct fir_block;
+
+int  fir_block_alloc(struct fir_block **fbp, unsigned ch,
+		     const int16_t *tapv, size_t tapc);
+void fir_block_reset(struct fir_block *fb);
+int  fir_block_filter(struct fir_block *fb, int16_t *outv,
+		      const int16_t *inv, size_t inc);
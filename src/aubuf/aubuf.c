@@ -6,223 +6,1289 @@
 #include <string.h>
 #include <re.h>
 #include <rem_aubuf.h>
+#include "aubuf.h"
 
 
 #define AUBUF_DEBUG 0
 
+#define CACHE_LINE_SIZE 64
+
+/** Maximum number of frames kept for reuse by aubuf_write() */
+#define POOL_MAX 32
+
+#if defined (__GNUC__) || defined (__clang__)
+#define HAVE_RING 1
+#define STAT_INC(x) (void)__atomic_fetch_add(&(x), 1, __ATOMIC_RELAXED)
+#define LOAD(x)     __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define PREFETCH(p) __builtin_prefetch((p))
+#else
+#define STAT_INC(x) ++(x)
+#define LOAD(x)     (x)
+#define STORE(x, v) (x) = (v)
+#define PREFETCH(p) (void)(p)
+#endif
+
+
+/**
+ * Lock-free ring storage, for exactly one producer and one consumer.
+ * The producer owns head, the consumer owns tail; both are free-running
+ * byte counters and are kept on separate cache-lines.
+ */
+struct aubuf_ring {
+	uint8_t *buf;
+	size_t size;
+	uint8_t pad0[CACHE_LINE_SIZE];
+	size_t head;
+	uint8_t pad1[CACHE_LINE_SIZE - sizeof(size_t)];
+	size_t tail;
+	uint8_t pad2[CACHE_LINE_SIZE - sizeof(size_t)];
+	int flush;
+};
+
+
+/** Adaptive sizing state, updated by the writer */
+struct aubuf_adapt {
+	uint64_t last;   /**< Time of the last write [ms]          */
+	int32_t mean;    /**< Mean inter-arrival time, Q4 [ms]     */
+	int32_t jitter;  /**< Mean inter-arrival deviation, Q4 [ms] */
+};
+
+
+/** Time-stretching state, owned by the reader */
+struct aubuf_stretch {
+	int16_t *buf;    /**< Scratch buffer for the unstretched samples */
+	size_t bufsz;    /**< Size of scratch buffer in [bytes]          */
+	int64_t avg;     /**< Smoothed buffer level in [bytes]           */
+	unsigned ch;     /**< Number of channels, 0 if disabled          */
+};
+
+
+/** Locked audio-buffer with almost zero-copy */
+struct aubuf {
+	struct list afl;
+	struct list pool;
+	uint32_t poolc;
+	struct lock *lock;
+	struct aubuf_ring *ring;
+	struct aubuf_adapt adapt;
+	struct aubuf_stretch stretch;
+	struct aubuf_plc plc;
+	size_t min_sz;
+	size_t wish_sz;
+	size_t cur_sz;
+	size_t max_sz;
+	size_t lim_sz;
+	size_t lost_sz;
+	size_t peek_sz;   /**< Size of the last peek, owned by the reader */
+	size_t ts_unit;
+	uint32_t ts_next;
+	bool ts_valid;
+	bool adaptive;
+	bool filling;
+	bool conceal;
+	uint64_t ts;
+	struct aubuf_stats stats;
+};
+
+
+struct auframe {
+	struct le le;
+	struct mbuf *mb;
+	uint32_t ts;      /**< RTP timestamp at the mbuf position */
+	bool ts_set;
+	bool pooled;      /**< Owned by the buffer, can be reused */
+};
+
+
+static void auframe_destructor(void *arg)
+{
+	struct auframe *af = arg;
+
+	list_unlink(&af->le);
+	mem_deref(af->mb);
+}
+
+
+static void aubuf_destructor(void *arg)
+{
+	struct aubuf *ab = arg;
+
+	list_flush(&ab->afl);
+	list_flush(&ab->pool);
+	mem_deref(ab->lock);
+	mem_deref(ab->ring);
+	mem_deref(ab->stretch.buf);
+	aubuf_plc_reset(&ab->plc);
+}
+
+
+/* Result of reading from the buffer storage */
+enum read_status {
+	READ_OK,       /**< Samples were read                 */
+	READ_FILLING,  /**< Silence was read, buffer filling  */
+	READ_LOST,     /**< Silence was read, to be concealed */
+};
+
+
+/*
+ * Adaptive sizing: track the inter-arrival jitter of the writes, and
+ * aim for two packets plus three times the jitter. The overrun limit
+ * follows at twice the target, so a buffer that has grown during a
+ * period of high jitter is trimmed down again.
+ */
+static void adapt_update(struct aubuf *ab, size_t sz)
+{
+	struct aubuf_adapt *a = &ab->adapt;
+	const uint64_t now = tmr_jiffies();
+	size_t wish, hi;
+	int32_t delta, dev;
+
+	if (!ab->adaptive || !sz)
+		return;
+
+	if (!a->last) {
+		a->last = now;
+		return;
+	}
+
+	delta = (int32_t)min(now - a->last, 10000) << 4;
+	a->last = now;
+
+	if (!a->mean) {
+		a->mean = delta;
+		return;
+	}
+
+	dev = delta > a->mean ? delta - a->mean : a->mean - delta;
+
+	a->mean   += (delta - a->mean) / 16;
+	a->jitter += (dev - a->jitter) / 16;
+
+	if (a->mean <= 0)
+		return;
+
+	wish = (2 + (size_t)((3 * a->jitter + a->mean / 2) / a->mean)) * sz;
+	hi   = ab->max_sz ? ab->max_sz / 2 : 4 * ab->min_sz;
+
+	wish = max(min(wish, hi), min(2 * sz, hi));
+
+	STORE(ab->wish_sz, wish);
+
+	if (ab->max_sz)
+		STORE(ab->lim_sz, min(2 * wish, ab->max_sz));
+}
+
+
+/* Number of bytes needed in the buffer before reading */
+static inline size_t read_level(const struct aubuf *ab, size_t sz)
+{
+	return ab->filling && !ab->conceal ? LOAD(ab->wish_sz) : sz;
+}
+
+
+/*
+ * Not enough data to read: with concealment enabled, the buffer resumes
+ * as soon as one read worth of data has arrived, until the concealment
+ * has faded out, otherwise it refills up to the wish size.
+ */
+static enum read_status underrun(struct aubuf *ab, size_t cur, size_t sz)
+{
+	if (!ab->filling) {
+		STAT_INC(ab->stats.underrun);
+#if AUBUF_DEBUG
+		(void)re_printf("aubuf: %p underrun (cur=%zu)\n", ab, cur);
+#else
+		(void)cur;
+#endif
+		ab->conceal = ab->plc.ch != 0;
+		ab->lost_sz = 0;
+	}
+
+	ab->filling = true;
+
+	if (!ab->conceal)
+		return READ_FILLING;
+
+	ab->lost_sz += sz;
+	if (ab->lost_sz > ab->plc.fadec * ab->plc.ch * 2)
+		ab->conceal = false;
+
+	return READ_LOST;
+}
+
+
+#ifdef HAVE_RING
+static void ring_destructor(void *arg)
+{
+	struct aubuf_ring *r = arg;
+
+	mem_deref(r->buf);
+}
+
+
+static inline size_t load_acquire(const size_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+
+static inline void store_release(size_t *p, size_t v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+
+static void ring_copy_in(struct aubuf_ring *r, size_t pos,
+			 const uint8_t *p, size_t sz)
+{
+	const size_t idx = pos & (r->size - 1);
+	const size_t n = min(sz, r->size - idx);
+
+	memcpy(&r->buf[idx], p, n);
+	memcpy(r->buf, p + n, sz - n);
+}
+
+
+static void ring_copy_out(const struct aubuf_ring *r, size_t pos,
+			  uint8_t *p, size_t sz)
+{
+	const size_t idx = pos & (r->size - 1);
+	const size_t n = min(sz, r->size - idx);
+
+	memcpy(p, &r->buf[idx], n);
+	memcpy(p + n, r->buf, sz - n);
+}
+
+
+/* Consumer side: apply a pending flush request */
+static void ring_sync(struct aubuf *ab)
+{
+	struct aubuf_ring *r = ab->ring;
+
+	if (!__atomic_load_n(&r->flush, __ATOMIC_RELAXED))
+		return;
+
+	if (!__atomic_exchange_n(&r->flush, 0, __ATOMIC_ACQ_REL))
+		return;
+
+	store_release(&r->tail, load_acquire(&r->head));
+	ab->filling = true;
+	ab->conceal = false;
+	ab->ts      = 0;
+}
+
+
+/* Producer side: copy into the ring, drop the data if the ring is full */
+static int ring_write(struct aubuf *ab, const uint8_t *p, size_t sz)
+{
+	struct aubuf_ring *r = ab->ring;
+	size_t head, tail;
+
+	adapt_update(ab, sz);
+
+	head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	tail = load_acquire(&r->tail);
+
+	if (sz > r->size - (head - tail)) {
+		STAT_INC(ab->stats.overrun);
+#if AUBUF_DEBUG
+		(void)re_printf("aubuf: %p ring full (cur=%zu)\n",
+				ab, head - tail);
+#endif
+		return 0;
+	}
+
+	ring_copy_in(r, head, p, sz);
+	store_release(&r->head, head + sz);
+
+	return 0;
+}
+
+
+/*
+ * Consumer side: get the read position and the number of bytes
+ * available, after applying a pending flush and dropping an overrun
+ */
+static size_t ring_avail(struct aubuf *ab, size_t *tailp)
+{
+	struct aubuf_ring *r = ab->ring;
+	const size_t lim = LOAD(ab->lim_sz);
+	size_t head, tail, cur;
+
+	ring_sync(ab);
+
+	tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	head = load_acquire(&r->head);
+	cur  = head - tail;
+
+	/* overrun: drop the oldest samples, keeping 32-bit alignment */
+	if (cur > lim) {
+
+		size_t skip = min((cur - lim + 3) & ~(size_t)3, cur);
+		STAT_INC(ab->stats.overrun);
+#if AUBUF_DEBUG
+		(void)re_printf("aubuf: %p overrun (cur=%zu)\n", ab, cur);
+#endif
+		tail += skip;
+		cur  -= skip;
+
+		store_release(&r->tail, tail);
+	}
+
+	*tailp = tail;
+
+	return cur;
+}
+
+
+/* Consumer side: same semantics as the list-based aubuf_read() */
+static enum read_status ring_read(struct aubuf *ab, uint8_t *p, size_t sz)
+{
+	struct aubuf_ring *r = ab->ring;
+	size_t tail, cur;
+
+	cur = ring_avail(ab, &tail);
+
+	if (cur < read_level(ab, sz)) {
+		memset(p, 0, sz);
+		return underrun(ab, cur, sz);
+	}
+
+	ab->filling = false;
+	ab->conceal = false;
+
+	ring_copy_out(r, tail, p, sz);
+	store_release(&r->tail, tail + sz);
+
+	return READ_OK;
+}
+
+
+static int ring_peek(struct aubuf *ab, size_t sz, struct aubuf_span *span)
+{
+	struct aubuf_ring *r = ab->ring;
+	size_t tail, cur, idx, n;
+
+	cur = ring_avail(ab, &tail);
+
+	ab->peek_sz = 0;
+
+	if (cur < read_level(ab, sz)) {
+		(void)underrun(ab, cur, sz);
+		return ENODATA;
+	}
+
+	ab->filling = false;
+	ab->conceal = false;
+	ab->peek_sz = min(sz, cur);
+
+	idx = tail & (r->size - 1);
+	n   = min(sz, r->size - idx);
+
+	span->p[0]  = &r->buf[idx];
+	span->sz[0] = n;
+	span->p[1]  = r->buf;
+	span->sz[1] = sz - n;
+
+	return 0;
+}
+#endif
+
+
+/**
+ * Allocate a new audio buffer
+ *
+ * @param abp    Pointer to allocated audio buffer
+ * @param min_sz Minimum buffer size
+ * @param max_sz Maximum buffer size (0 for no max size)
+ *
+ * @return 0 for success, otherwise error code
+ */
+int aubuf_alloc(struct aubuf **abp, size_t min_sz, size_t max_sz)
+{
+	struct aubuf *ab;
+	int err;
+
+	if (!abp || !min_sz)
+		return EINVAL;
+
+	ab = mem_zalloc(sizeof(*ab), aubuf_destructor);
+	if (!ab)
+		return ENOMEM;
+
+	err = lock_alloc(&ab->lock);
+	if (err)
+		goto out;
+
+	ab->min_sz  = min_sz;
+	ab->wish_sz = min_sz;
+	ab->max_sz  = max_sz;
+	ab->lim_sz  = max_sz;
+	ab->ts_unit = 2;
+	ab->filling = true;
+
+ out:
+	if (err)
+		mem_deref(ab);
+	else
+		*abp = ab;
+
+	return err;
+}
+
+
+/**
+ * Allocate a new lock-free audio buffer for one producer and one consumer
+ *
+ * The samples are copied into a preallocated ring, so writing and reading
+ * does not allocate memory or take any locks. aubuf_append() and
+ * aubuf_write() must only be called from the producer thread, and
+ * aubuf_read() and aubuf_get() only from the consumer thread.
+ * aubuf_flush() may be called from any thread and takes effect on the
+ * next read. The reader trims the oldest samples above max_sz as in
+ * list mode, but if a write does not fit into the ring, the new samples
+ * are dropped.
+ *
+ * @param abp    Pointer to allocated audio buffer
+ * @param min_sz Minimum buffer size
+ * @param max_sz Maximum buffer size
+ *
+ * @return 0 for success, otherwise error code
+ */
+int aubuf_alloc_ring(struct aubuf **abp, size_t min_sz, size_t max_sz)
+{
+#ifdef HAVE_RING
+	struct aubuf *ab;
+	size_t size = CACHE_LINE_SIZE;
+	int err = 0;
+
+	if (!abp || !min_sz || max_sz < min_sz)
+		return EINVAL;
+
+	/* room for max_sz plus the writes arriving before the next read */
+	while (size < 2 * max_sz)
+		size <<= 1;
+
+	ab = mem_zalloc(sizeof(*ab), aubuf_destructor);
+	if (!ab)
+		return ENOMEM;
+
+	ab->ring = mem_zalloc(sizeof(*ab->ring), ring_destructor);
+	if (!ab->ring) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	ab->ring->buf = mem_alloc(size, NULL);
+	if (!ab->ring->buf) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	ab->ring->size = size;
+	ab->min_sz  = min_sz;
+	ab->wish_sz = min_sz;
+	ab->max_sz  = max_sz;
+	ab->lim_sz  = max_sz;
+	ab->filling = true;
+
+ out:
+	if (err)
+		mem_deref(ab);
+	else
+		*abp = ab;
+
+	return err;
+#else
+	(void)abp;
+	(void)min_sz;
+	(void)max_sz;
+
+	return ENOSYS;
+#endif
+}
+
+
+/*
+ * List mode: free a frame, or keep it for reuse if it was taken from the
+ * pool by aubuf_write() or aubuf_put_ts(). Called with the lock held.
+ */
+static void frame_release(struct aubuf *ab, struct auframe *af)
+{
+	if (!af->pooled || ab->poolc >= POOL_MAX) {
+		mem_deref(af);
+		return;
+	}
+
+	list_unlink(&af->le);
+	list_append(&ab->pool, &af->le, af);
+	++ab->poolc;
+}
+
+
+/*
+ * Largest timestamp gap in bytes that is played out. Larger jumps are
+ * a discontinuity. Called with the lock held.
+ */
+static size_t gap_max(const struct aubuf *ab)
+{
+	return ab->lim_sz ? ab->lim_sz : 4 * ab->wish_sz;
+}
+
+
+/*
+ * List mode: get a frame with a copy of sz bytes, reused from the pool
+ * if possible. Called with the lock held.
+ */
+static struct auframe *frame_get(struct aubuf *ab, const uint8_t *p,
+				 size_t sz)
+{
+	struct auframe *af;
+
+	af = list_ledata(ab->pool.head);
+	if (af) {
+		list_unlink(&af->le);
+		--ab->poolc;
+
+		/* frames of another size are not reused */
+		if (af->mb->size < sz)
+			af = mem_deref(af);
+	}
+
+	if (!af) {
+		STAT_INC(ab->stats.pool_miss);
+
+		af = mem_zalloc(sizeof(*af), auframe_destructor);
+		if (!af)
+			return NULL;
+
+		af->mb = mbuf_alloc(sz);
+		if (!af->mb)
+			return mem_deref(af);
+
+		af->pooled = true;
+	}
+
+	mbuf_rewind(af->mb);
+	(void)mbuf_write_mem(af->mb, p, sz);
+	af->mb->pos = 0;
+
+	af->ts     = 0;
+	af->ts_set = false;
+
+	return af;
+}
+
+
+/* List mode: account for a newly inserted frame, with the lock held */
+static void frame_added(struct aubuf *ab, size_t sz)
+{
+	struct auframe *af;
+
+	adapt_update(ab, sz);
+
+	ab->cur_sz += sz;
+
+	if (ab->lim_sz && ab->cur_sz > ab->lim_sz) {
+		STAT_INC(ab->stats.overrun);
+#if AUBUF_DEBUG
+		(void)re_printf("aubuf: %p overrun (cur=%zu)\n",
+				ab, ab->cur_sz);
+#endif
+		/* also trims the buffer after the limit was lowered */
+		while (ab->cur_sz > ab->lim_sz &&
+		       (af = list_ledata(ab->afl.head))) {
+			ab->cur_sz -= mbuf_get_left(af->mb);
+			frame_release(ab, af);
+		}
+	}
+}
+
+
+/**
+ * Append a PCM-buffer to the end of the audio buffer
+ *
+ * @param ab Audio buffer
+ * @param mb Mbuffer with PCM samples
+ *
+ * @return 0 for success, otherwise error code
+ */
+int aubuf_append(struct aubuf *ab, struct mbuf *mb)
+{
+	struct auframe *af;
+
+	if (!ab || !mb)
+		return EINVAL;
+
+#ifdef HAVE_RING
+	if (ab->ring)
+		return ring_write(ab, mbuf_buf(mb), mbuf_get_left(mb));
+#endif
+
+	af = mem_zalloc(sizeof(*af), auframe_destructor);
+	if (!af)
+		return ENOMEM;
+
+	af->mb = mem_ref(mb);
+
+	lock_write_get(ab->lock);
+
+	list_append(&ab->afl, &af->le, af);
+	frame_added(ab, mbuf_get_left(mb));
+
+	lock_rel(ab->lock);
+
+	return 0;
+}
+
+
+/**
+ * Insert a PCM-buffer into the audio buffer, ordered by RTP timestamp
+ *
+ * Packets that arrive out of order are put back in order, and
+ * duplicates and packets arriving after their playout time are
+ * dropped, and counted in the dup and late statistics. A timestamp
+ * jump back by more than the largest gap, or while the buffer is empty
+ * or filling, starts a new stream instead. A gap in the
+ * timestamps is played out as lost samples, which are concealed if
+ * packet-loss concealment is enabled, also when the gap is shorter
+ * than a read.
+ *
+ * @param ab Audio buffer
+ * @param ts RTP timestamp of the first sample
+ * @param mb Mbuffer with PCM samples
+ *
+ * @note Not supported in ring mode
+ *
+ * @return 0 for success, otherwise error code
+ */
+int aubuf_put_ts(struct aubuf *ab, uint32_t ts, struct mbuf *mb)
+{
+	struct auframe *af;
+	struct le *le;
+	int64_t jump;
+	size_t sz;
+	int32_t d;
+	int err = 0;
+
+	if (!ab || !mb)
+		return EINVAL;
+
+	if (ab->ring)
+		return ENOTSUP;
+
+	sz = mbuf_get_left(mb);
+
+	lock_write_get(ab->lock);
+
+	jump = (int64_t)min(gap_max(ab) / ab->ts_unit, (size_t)INT32_MAX);
+	d    = (int32_t)(ts - ab->ts_next);
+
+	if (ab->ts_valid && d < 0) {
+
+		/* a jump back is a new stream, e.g. after a sender restart */
+		if (-(int64_t)d > jump || ab->filling || !ab->afl.head) {
+			ab->ts_valid = false;
+		}
+		else {
+			STAT_INC(ab->stats.late);
+			goto out;
+		}
+	}
+
+	/* search backwards, most packets arrive in order */
+	for (le = ab->afl.tail; le; le = le->prev) {
+
+		const struct auframe *f = le->data;
+
+		if (!f->ts_set)
+			break;
+
+		/* the new stream is played after the frames of the old one */
+		d = (int32_t)(ts - f->ts);
+		if (d == 0) {
+			STAT_INC(ab->stats.dup);
+			goto out;
+		}
+		else if (d > 0 || -(int64_t)d > jump)
+			break;
+	}
+
+	af = frame_get(ab, mbuf_buf(mb), sz);
+	if (!af) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	af->ts     = ts;
+	af->ts_set = true;
+
+	if (le)
+		list_insert_after(&ab->afl, le, &af->le, af);
+	else
+		list_prepend(&ab->afl, &af->le, af);
+
+	frame_added(ab, sz);
+
+ out:
+	lock_rel(ab->lock);
+
+	return err;
+}
+
+
+/**
+ * Set the size of one RTP timestamp tick, for aubuf_put_ts()
+ *
+ * @param ab   Audio buffer
+ * @param unit Number of bytes per timestamp tick, default 2
+ *
+ * @return 0 for success, otherwise error code
+ */
+int aubuf_set_ts_unit(struct aubuf *ab, size_t unit)
+{
+	if (!ab || !unit)
+		return EINVAL;
+
+	if (ab->ring)
+		return ENOTSUP;
+
+	lock_write_get(ab->lock);
+	ab->ts_unit = unit;
+	lock_rel(ab->lock);
+
+	return 0;
+}
+
+
+/**
+ * Enable/disable adaptive sizing of the audio buffer
+ *
+ * In adaptive mode the wish size is derived from the inter-arrival
+ * jitter of the writes, between two writes and half of the maximum
+ * size. When disabled, the wish size is reset to the minimum size.
+ *
+ * @param ab     Audio buffer
+ * @param enable True to enable, false to disable
+ *
+ * @note In ring mode this must be called from the producer thread
+ */
+void aubuf_set_adaptive(struct aubuf *ab, bool enable)
+{
+	if (!ab)
+		return;
+
+	if (!ab->ring)
+		lock_write_get(ab->lock);
+
+	ab->adaptive = enable;
+	memset(&ab->adapt, 0, sizeof(ab->adapt));
+
+	if (!enable) {
+		STORE(ab->wish_sz, ab->min_sz);
+		STORE(ab->lim_sz, ab->max_sz);
+	}
+
+	if (!ab->ring)
+		lock_rel(ab->lock);
+}
+
+
+/**
+ * Write PCM samples to the audio buffer
+ *
+ * @param ab Audio buffer
+ * @param p  Pointer to PCM data
+ * @param sz Number of bytes to write
+ *
+ * @return 0 for success, otherwise error code
+ */
+int aubuf_write(struct aubuf *ab, const uint8_t *p, size_t sz)
+{
+	struct auframe *af;
+	int err = 0;
+
+	if (!ab || !p)
+		return EINVAL;
+
+#ifdef HAVE_RING
+	if (ab->ring)
+		return ring_write(ab, p, sz);
+#endif
+
+	lock_write_get(ab->lock);
+
+	af = frame_get(ab, p, sz);
+	if (!af) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	list_append(&ab->afl, &af->le, af);
+	frame_added(ab, sz);
+
+ out:
+	lock_rel(ab->lock);
+
+	return err;
+}
+
+
+/*
+ * Read one segment of the next sz bytes: buffered samples up to the
+ * next timestamp gap, or the gap itself, or silence on an underrun.
+ * The segment size is returned in *np, and is never zero.
+ */
+static enum read_status read_raw(struct aubuf *ab, uint8_t *p, size_t sz,
+				 size_t *np)
+{
+	enum read_status rs = READ_OK;
+	size_t max_gap, got = 0;
+	struct le *le;
+	bool resync;
+
+#ifdef HAVE_RING
+	if (ab->ring) {
+		*np = sz;
+		return ring_read(ab, p, sz);
+	}
+#endif
+
+	lock_write_get(ab->lock);
+
+	if (ab->cur_sz < read_level(ab, sz)) {
+		rs = underrun(ab, ab->cur_sz, sz);
+		memset(p, 0, sz);
+		got = sz;
+		goto out;
+	}
+
+	/* do not play out the gaps accumulated while filling */
+	resync  = ab->filling;
+	max_gap = gap_max(ab);
+
+	ab->filling = false;
+	ab->conceal = false;
+
+	le = ab->afl.head;
+
+	while (le && got < sz) {
+		struct auframe *af = le->data;
+		size_t n;
+
+		/* play out a timestamp gap, unless it is a discontinuity */
+		if (af->ts_set && ab->ts_valid && !resync) {
+
+			const int32_t gap = (int32_t)(af->ts - ab->ts_next);
+			const size_t gap_sz = gap > 0 ?
+				(size_t)gap * ab->ts_unit : 0;
+
+			/* the gap is a segment of its own */
+			if (gap_sz && gap_sz <= max_gap) {
 
-/** Locked audio-buffer with almost zero-copy */
-struct aubuf {
-	struct list afl;
-	struct lock *lock;
-	size_t wish_sz;
-	size_t cur_sz;
-	size_t max_sz;
-	bool filling;
-	uint64_t ts;
+				if (got)
+					break;
 
-#if AUBUF_DEBUG
-	struct {
-		size_t or;
-		size_t ur;
-	} stats;
-#endif
-};
+				got = min(gap_sz, sz);
 
+				memset(p, 0, got);
+				ab->ts_next += (uint32_t)(got / ab->ts_unit);
 
-struct auframe {
-	struct le le;
-	struct mbuf *mb;
-};
+				STAT_INC(ab->stats.lost);
+				rs = READ_LOST;
+				goto out;
+			}
+		}
+
+		le = le->next;
+		resync = false;
 
+		n = min(mbuf_get_left(af->mb), sz - got);
 
-static void auframe_destructor(void *arg)
+		(void)mbuf_read_mem(af->mb, p + got, n);
+		ab->cur_sz -= n;
+		got += n;
+
+		if (af->ts_set) {
+			af->ts += (uint32_t)(n / ab->ts_unit);
+			ab->ts_next  = af->ts;
+			ab->ts_valid = true;
+		}
+
+		if (!mbuf_get_left(af->mb))
+			frame_release(ab, af);
+	}
+
+	/* cannot happen, cur_sz covers the read */
+	if (!got) {
+		memset(p, 0, sz);
+		got = sz;
+	}
+
+ out:
+	lock_rel(ab->lock);
+
+	*np = got;
+
+	return rs;
+}
+
+
+/*
+ * Read sz bytes segment by segment. With packet-loss concealment, lost
+ * segments are concealed and the samples read are kept as history.
+ * The result is READ_OK unless silence was read while filling.
+ */
+static enum read_status read_plc(struct aubuf *ab, uint8_t *p, size_t sz)
 {
-	struct auframe *af = arg;
+	struct aubuf_plc *plc = &ab->plc;
+	const size_t fsz = plc->ch * 2;
+	enum read_status res = READ_OK;
 
-	list_unlink(&af->le);
-	mem_deref(af->mb);
+	while (sz) {
+
+		enum read_status rs;
+		size_t n;
+
+		rs = read_raw(ab, p, sz, &n);
+
+		if (rs == READ_FILLING)
+			res = READ_FILLING;
+
+		if (fsz && !(n % fsz)) {
+
+			switch (rs) {
+
+			case READ_OK:
+				aubuf_plc_update(plc, (int16_t *)(void *)p,
+						 n / fsz);
+				break;
+
+			case READ_LOST:
+				aubuf_plc_conceal(plc, (int16_t *)(void *)p,
+						  n / fsz);
+				break;
+
+			default:
+				plc->period = 0;
+				break;
+			}
+		}
+
+		p  += n;
+		sz -= n;
+	}
+
+	return res;
 }
 
 
-static void aubuf_destructor(void *arg)
+/* Current size and fill state, as seen by the reader */
+static size_t read_state(struct aubuf *ab, bool *filling)
 {
-	struct aubuf *ab = arg;
+	size_t sz;
 
-	list_flush(&ab->afl);
-	mem_deref(ab->lock);
+#ifdef HAVE_RING
+	if (ab->ring) {
+		/* the consumer owns the fill state */
+		*filling = ab->filling;
+		return aubuf_cur_size(ab);
+	}
+#endif
+
+	lock_read_get(ab->lock);
+	sz       = ab->cur_sz;
+	*filling = ab->filling;
+	lock_rel(ab->lock);
+
+	return sz;
 }
 
 
-/**
- * Allocate a new audio buffer
- *
- * @param abp    Pointer to allocated audio buffer
- * @param min_sz Minimum buffer size
- * @param max_sz Maximum buffer size (0 for no max size)
+/*
+ * Drift compensation: when the smoothed buffer level stays above the
+ * target, read a few extra frames and shrink them into the output, and
+ * when it falls below, read a few frames less and expand them.
  *
- * @return 0 for success, otherwise error code
+ * Lost segments are concealed before stretching. Silence from an
+ * underrun is not stretched, but returned as is.
  */
-int aubuf_alloc(struct aubuf **abp, size_t min_sz, size_t max_sz)
+static bool stretch_read(struct aubuf *ab, uint8_t *p, size_t sz)
 {
-	struct aubuf *ab;
-	int err;
+	struct aubuf_stretch *st = &ab->stretch;
+	const size_t fsz = st->ch * 2;
+	const size_t n = sz / fsz;
+	size_t cur, wish, d;
+	bool filling;
 
-	if (!abp || !min_sz)
-		return EINVAL;
+	if (sz % fsz || n < STRETCH_MIN_FRAMES)
+		return false;
 
-	ab = mem_zalloc(sizeof(*ab), aubuf_destructor);
-	if (!ab)
-		return ENOMEM;
+	cur  = read_state(ab, &filling);
+	wish = LOAD(ab->wish_sz);
 
-	err = lock_alloc(&ab->lock);
-	if (err)
-		goto out;
+	if (filling) {
+		st->avg = (int64_t)cur;
+		return false;
+	}
 
-	ab->wish_sz = min_sz;
-	ab->max_sz = max_sz;
-	ab->filling = true;
+	st->avg += ((int64_t)cur - st->avg) / 16;
 
- out:
-	if (err)
-		mem_deref(ab);
-	else
-		*abp = ab;
+	d = aubuf_stretch_delta(n);
 
-	return err;
+	if (st->bufsz < sz + d * fsz) {
+
+		int16_t *buf = mem_realloc(st->buf, sz + d * fsz);
+		if (!buf)
+			return false;
+
+		st->buf   = buf;
+		st->bufsz = sz + d * fsz;
+	}
+
+	if (st->avg > (int64_t)(wish + 2 * sz) && cur >= sz + d * fsz) {
+
+		if (read_plc(ab, (uint8_t *)st->buf, sz + d * fsz) == READ_OK)
+			aubuf_stretch_shrink((int16_t *)(void *)p, st->buf,
+					     n, d, st->ch);
+		else
+			memset(p, 0, sz);
+
+		return true;
+	}
+	else if (st->avg < (int64_t)wish && cur >= sz) {
+
+		if (read_plc(ab, (uint8_t *)st->buf, sz - d * fsz) == READ_OK)
+			aubuf_stretch_expand((int16_t *)(void *)p, st->buf,
+					     n, d, st->ch);
+		else
+			memset(p, 0, sz);
+
+		return true;
+	}
+
+	return false;
 }
 
 
 /**
- * Append a PCM-buffer to the end of the audio buffer
+ * Read PCM samples from the audio buffer. If there is not enough data
+ * in the audio buffer, silence will be read.
  *
  * @param ab Audio buffer
- * @param mb Mbuffer with PCM samples
+ * @param p  Buffer where PCM samples are read into
+ * @param sz Number of bytes to read
+ */
+void aubuf_read(struct aubuf *ab, uint8_t *p, size_t sz)
+{
+	if (!ab || !p || !sz)
+		return;
+
+	if (!ab->stretch.ch || !stretch_read(ab, p, sz))
+		(void)read_plc(ab, p, sz);
+}
+
+
+/**
+ * Read PCM samples from many lock-free audio buffers in one pass, for
+ * example one per source of a mixer. While one buffer is read, the
+ * state of the next buffers is prefetched, so the reads do not stall
+ * on cache misses.
  *
- * @return 0 for success, otherwise error code
+ * Only buffers allocated with aubuf_alloc_ring() can be batched. A
+ * locked buffer takes its own lock for each read in any case, so the
+ * batch would not save anything, and aubuf_read() should be used.
+ *
+ * @param abv  Audio buffers, in ring mode
+ * @param outv Buffers where PCM samples are read into
+ * @param n    Number of audio buffers
+ * @param sz   Number of bytes to read from each audio buffer
+ *
+ * @note Must be called from the consumer thread of each buffer
+ *
+ * @return 0 for success, ENOTSUP if a buffer is not in ring mode
  */
-int aubuf_append(struct aubuf *ab, struct mbuf *mb)
+int aubuf_read_batch(struct aubuf **abv, int16_t **outv, size_t n,
+		     size_t sz)
 {
-	struct auframe *af;
+	size_t i;
 
-	if (!ab || !mb)
+	if (!abv || !outv)
 		return EINVAL;
 
-	af = mem_zalloc(sizeof(*af), auframe_destructor);
-	if (!af)
-		return ENOMEM;
+	for (i=0; i<n; i++) {
 
-	af->mb = mem_ref(mb);
+		if (!abv[i] || !outv[i])
+			return EINVAL;
 
-	lock_write_get(ab->lock);
+		if (!abv[i]->ring)
+			return ENOTSUP;
+	}
 
-	list_append(&ab->afl, &af->le, af);
-	ab->cur_sz += mbuf_get_left(mb);
+#ifdef HAVE_RING
+	if (n)
+		PREFETCH(abv[0]);
+	if (n > 1)
+		PREFETCH(abv[1]);
 
-	if (ab->max_sz && ab->cur_sz > ab->max_sz) {
-#if AUBUF_DEBUG
-		++ab->stats.or;
-		(void)re_printf("aubuf: %p overrun (cur=%zu)\n",
-				ab, ab->cur_sz);
-#endif
-		af = list_ledata(ab->afl.head);
-		if (af) {
-			ab->cur_sz -= mbuf_get_left(af->mb);
-			mem_deref(af);
+	for (i=0; i<n; i++) {
+
+		if (i + 2 < n)
+			PREFETCH(abv[i + 2]);
+
+		if (i + 1 < n) {
+			PREFETCH(&abv[i + 1]->ring->head);
+			PREFETCH(&abv[i + 1]->ring->tail);
 		}
-	}
 
-	lock_rel(ab->lock);
+		aubuf_read(abv[i], (uint8_t *)outv[i], sz);
+	}
+#else
+	(void)sz;
+#endif
 
 	return 0;
 }
 
 
 /**
- * Write PCM samples to the audio buffer
+ * Peek at buffered PCM samples without copying them
  *
- * @param ab Audio buffer
- * @param p  Pointer to PCM data
- * @param sz Number of bytes to write
+ * On success the next sz bytes of the buffer are returned as one or
+ * two contiguous spans, which stay valid until aubuf_consume() is
+ * called. If there is not enough data in the audio buffer, ENODATA is
+ * returned and the caller should play silence, as aubuf_read() would.
+ * Time-stretching and packet-loss concealment are not applied, so
+ * ENOTSUP is returned if they are enabled.
+ *
+ * @param ab   Audio buffer
+ * @param sz   Number of bytes to peek at
+ * @param span Returned spans
+ *
+ * @note Only supported in ring mode, from the consumer thread
  *
  * @return 0 for success, otherwise error code
  */
-int aubuf_write(struct aubuf *ab, const uint8_t *p, size_t sz)
+int aubuf_peek(struct aubuf *ab, size_t sz, struct aubuf_span *span)
 {
-	struct mbuf *mb = mbuf_alloc(sz);
-	int err;
-
-	if (!mb)
-		return ENOMEM;
-
-	(void)mbuf_write_mem(mb, p, sz);
-	mb->pos = 0;
-
-	err = aubuf_append(ab, mb);
+	if (!ab || !sz || !span)
+		return EINVAL;
 
-	mem_deref(mb);
+	if (!ab->ring || ab->stretch.ch || ab->plc.ch)
+		return ENOTSUP;
 
-	return err;
+#ifdef HAVE_RING
+	return ring_peek(ab, sz, span);
+#else
+	return ENOTSUP;
+#endif
 }
 
 
 /**
- * Read PCM samples from the audio buffer. If there is not enough data
- * in the audio buffer, silence will be read.
+ * Consume PCM samples after a successful aubuf_peek()
+ *
+ * The size is limited to the size of the last peek, so nothing is
+ * consumed without a successful aubuf_peek(), or twice for one peek.
  *
  * @param ab Audio buffer
- * @param p  Buffer where PCM samples are read into
- * @param sz Number of bytes to read
+ * @param sz Number of bytes to consume, at most the size peeked at
  */
-void aubuf_read(struct aubuf *ab, uint8_t *p, size_t sz)
+void aubuf_consume(struct aubuf *ab, size_t sz)
 {
-	struct le *le;
-
-	if (!ab || !p || !sz)
+	if (!ab || !ab->ring || ab->stretch.ch || ab->plc.ch)
 		return;
 
-	lock_write_get(ab->lock);
+#ifdef HAVE_RING
+	{
+		struct aubuf_ring *r = ab->ring;
+		const size_t tail = __atomic_load_n(&r->tail,
+						    __ATOMIC_RELAXED);
 
-	if (ab->cur_sz < (ab->filling ? ab->wish_sz : sz)) {
-#if AUBUF_DEBUG
-		if (!ab->filling) {
-			++ab->stats.ur;
-			(void)re_printf("aubuf: %p underrun (cur=%zu)\n",
-					ab, ab->cur_sz);
-		}
-#endif
-		ab->filling = true;
-		memset(p, 0, sz);
-		goto out;
+		sz = min(sz, ab->peek_sz);
+		sz = min(sz, load_acquire(&r->head) - tail);
+		ab->peek_sz = 0;
+
+		if (sz)
+			store_release(&r->tail, tail + sz);
 	}
+#else
+	(void)sz;
+#endif
+}
 
-	ab->filling = false;
 
-	le = ab->afl.head;
+/**
+ * Enable/disable time-stretching of the audio buffer
+ *
+ * With time-stretching enabled, aubuf_read() compensates for clock
+ * drift between writer and reader by removing or inserting a few
+ * samples per read, keeping the buffer level near the wish size
+ * without dropping whole packets or playing silence. Splice points are
+ * chosen by waveform similarity and cross-faded. Only 16-bit
+ * interleaved PCM is supported, with reads of at least 80 frames.
+ *
+ * @param ab Audio buffer
+ * @param ch Number of channels, or 0 to disable
+ *
+ * @note Must be called from the thread calling aubuf_read()
+ */
+void aubuf_set_stretch(struct aubuf *ab, unsigned ch)
+{
+	if (!ab)
+		return;
 
-	while (le) {
-		struct auframe *af = le->data;
-		size_t n;
+	ab->stretch.ch  = ch;
+	ab->stretch.avg = 0;
+}
 
-		le = le->next;
 
-		n = min(mbuf_get_left(af->mb), sz);
+/**
+ * Enable/disable packet-loss concealment of the audio buffer
+ *
+ * With concealment enabled, an underrun no longer plays silence until
+ * the buffer has refilled to the wish size. Instead the missing audio
+ * is synthesized by repeating the last pitch period with a fade-out,
+ * and reading resumes as soon as one read worth of data has arrived.
+ * Only 16-bit interleaved PCM is supported.
+ *
+ * @param ab    Audio buffer
+ * @param srate Sample rate in [Hz]
+ * @param ch    Number of channels, or 0 to disable
+ *
+ * @note Must be called from the thread calling aubuf_read()
+ *
+ * @return 0 for success, otherwise error code
+ */
+int aubuf_set_plc(struct aubuf *ab, uint32_t srate, unsigned ch)
+{
+	struct aubuf_plc plc;
+	int err;
 
-		(void)mbuf_read_mem(af->mb, p, n);
-		ab->cur_sz -= n;
+	if (!ab)
+		return EINVAL;
 
-		if (!mbuf_get_left(af->mb))
-			mem_deref(af);
+	if (ch) {
+		err = aubuf_plc_init(&plc, srate, ch);
+		if (err)
+			return err;
+	}
+	else {
+		memset(&plc, 0, sizeof(plc));
+	}
 
-		if (n == sz)
-			break;
+	if (!ab->ring)
+		lock_write_get(ab->lock);
 
-		p  += n;
-		sz -= n;
-	}
+	aubuf_plc_reset(&ab->plc);
+	ab->plc     = plc;
+	ab->conceal = false;
 
- out:
-	lock_rel(ab->lock);
+	if (!ab->ring)
+		lock_rel(ab->lock);
+
+	return 0;
 }
 
 
@@ -248,6 +1314,25 @@ int aubuf_get(struct aubuf *ab, uint32_t ptime, uint8_t *p, size_t sz)
 	if (!ab || !ptime)
 		return EINVAL;
 
+#ifdef HAVE_RING
+	/* the timestamp is owned by the consumer in ring mode */
+	if (ab->ring) {
+		ring_sync(ab);
+
+		now = tmr_jiffies();
+		if (!ab->ts)
+			ab->ts = now;
+
+		if (now < ab->ts)
+			return ETIMEDOUT;
+
+		ab->ts += ptime;
+		aubuf_read(ab, p, sz);
+
+		return 0;
+	}
+#endif
+
 	lock_write_get(ab->lock);
 
 	now = tmr_jiffies();
@@ -281,11 +1366,22 @@ void aubuf_flush(struct aubuf *ab)
 	if (!ab)
 		return;
 
+#ifdef HAVE_RING
+	if (ab->ring) {
+		__atomic_store_n(&ab->ring->flush, 1, __ATOMIC_RELEASE);
+		return;
+	}
+#endif
+
 	lock_write_get(ab->lock);
 
-	list_flush(&ab->afl);
-	ab->filling = true;
-	ab->cur_sz  = 0;
+	while (ab->afl.head)
+		frame_release(ab, list_ledata(ab->afl.head));
+
+	ab->filling  = true;
+	ab->conceal  = false;
+	ab->ts_valid = false;
+	ab->cur_sz   = 0;
 	ab->ts      = 0;
 
 	lock_rel(ab->lock);
@@ -307,15 +1403,26 @@ int aubuf_debug(struct re_printf *pf, const struct aubuf *ab)
 	if (!ab)
 		return 0;
 
-	lock_read_get(ab->lock);
-	err = re_hprintf(pf, "wish_sz=%zu cur_sz=%zu filling=%d",
-			 ab->wish_sz, ab->cur_sz, ab->filling);
-
-#if AUBUF_DEBUG
-	err |= re_hprintf(pf, " [overrun=%zu underrun=%zu]",
-			  ab->stats.or, ab->stats.ur);
+#ifdef HAVE_RING
+	if (ab->ring) {
+		return re_hprintf(pf, "wish_sz=%zu cur_sz=%zu filling=%d"
+				  " ring=%zu [overrun=%llu underrun=%llu]",
+				  LOAD(ab->wish_sz), aubuf_cur_size(ab),
+				  ab->filling, ab->ring->size,
+				  LOAD(ab->stats.overrun),
+				  LOAD(ab->stats.underrun));
+	}
 #endif
 
+	lock_read_get(ab->lock);
+	err = re_hprintf(pf, "wish_sz=%zu cur_sz=%zu filling=%d"
+			 " [overrun=%llu underrun=%llu late=%llu dup=%llu"
+			 " lost=%llu pool_miss=%llu]",
+			 ab->wish_sz, ab->cur_sz, ab->filling,
+			 ab->stats.overrun, ab->stats.underrun,
+			 ab->stats.late, ab->stats.dup, ab->stats.lost,
+			 ab->stats.pool_miss);
+
 	lock_rel(ab->lock);
 
 	return err;
@@ -336,9 +1443,38 @@ size_t aubuf_cur_size(const struct aubuf *ab)
 	if (!ab)
 		return 0;
 
+#ifdef HAVE_RING
+	if (ab->ring) {
+		const size_t tail = load_acquire(&ab->ring->tail);
+
+		return load_acquire(&ab->ring->head) - tail;
+	}
+#endif
+
 	lock_read_get(ab->lock);
 	sz = ab->cur_sz;
 	lock_rel(ab->lock);
 
 	return sz;
 }
+
+
+/**
+ * Get the overrun and underrun counters of the audio buffer. This does
+ * not take the buffer lock, so it is safe to call at any time.
+ *
+ * @param ab    Audio buffer
+ * @param stats Returned statistics
+ */
+void aubuf_stats_get(const struct aubuf *ab, struct aubuf_stats *stats)
+{
+	if (!ab || !stats)
+		return;
+
+	stats->overrun  = LOAD(ab->stats.overrun);
+	stats->underrun = LOAD(ab->stats.underrun);
+	stats->late     = LOAD(ab->stats.late);
+	stats->dup      = LOAD(ab->stats.dup);
+	stats->lost     = LOAD(ab->stats.lost);
+	stats->pool_miss = LOAD(ab->stats.pool_miss);
+}
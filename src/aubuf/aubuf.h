@@ -0,0 +1,44 @@
+/**
+ * @file aubuf.h  Audio Buffer -- internal API
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+
+/*
+ * Time-stretching of 16-bit interleaved PCM, used for drift compensation
+ */
+
+enum {
+	STRETCH_MIN_FRAMES = 80,  /**< Minimum frames per read to stretch */
+};
+
+size_t aubuf_stretch_delta(size_t n);
+void aubuf_stretch_shrink(int16_t *outv, const int16_t *inv, size_t n,
+			  size_t d, unsigned ch);
+void aubuf_stretch_expand(int16_t *outv, const int16_t *inv, size_t n,
+			  size_t d, unsigned ch);
+
+
+/*
+ * Packet-loss concealment of 16-bit interleaved PCM
+ */
+
+/** Packet-loss concealment state, owned by the reader */
+struct aubuf_plc {
+	int16_t *hist;  /**< Last played frames                  */
+	size_t histc;   /**< Size of history in [frames]         */
+	size_t pmin;    /**< Shortest pitch period in [frames]   */
+	size_t pmax;    /**< Longest pitch period in [frames]    */
+	size_t fadec;   /**< Fade-out length in [frames]         */
+	size_t period;  /**< Pitch period, 0 if not concealing   */
+	size_t pos;     /**< Position within the pitch period    */
+	int32_t gain;   /**< Concealment gain, Q15               */
+	int32_t step;   /**< Gain decrement per frame, Q15       */
+	unsigned ch;    /**< Number of channels, 0 if disabled   */
+};
+
+int  aubuf_plc_init(struct aubuf_plc *plc, uint32_t srate, unsigned ch);
+void aubuf_plc_reset(struct aubuf_plc *plc);
+void aubuf_plc_conceal(struct aubuf_plc *plc, int16_t *sampv, size_t n);
+void aubuf_plc_update(struct aubuf_plc *plc, int16_t *sampv, size_t n);
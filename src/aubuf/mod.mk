@@ -5,3 +5,5 @@
 #
 
 SRCS	+= aubuf/aubuf.c
+SRCS	+= aubuf/stretch.c
+SRCS	+= aubuf/plc.c
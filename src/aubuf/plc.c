@@ -0,0 +1,195 @@
+/**
+ * @file plc.c  Audio Buffer -- packet-loss concealment
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <math.h>
+#include <string.h>
+#include <re.h>
+#include "aubuf.h"
+
+
+/*
+ * Missing blocks are synthesized by repeating the last pitch period of
+ * the played audio, fading out over PLC_FADE_MS. When real audio
+ * arrives again it is cross-faded with the continued synthesis.
+ */
+
+
+enum {
+	PLC_FADE_MS  = 60,  /**< Fade-out time of the concealment [ms]  */
+	PLC_PMIN_US  = 2500,  /**< Shortest pitch period, 400 Hz [us]  */
+	PLC_PMAX_US  = 15000, /**< Longest pitch period, 66 Hz [us]    */
+};
+
+
+/**
+ * Initialise the packet-loss concealment state
+ *
+ * @param plc   PLC state
+ * @param srate Sample rate in [Hz]
+ * @param ch    Number of channels
+ *
+ * @return 0 for success, otherwise error code
+ */
+int aubuf_plc_init(struct aubuf_plc *plc, uint32_t srate, unsigned ch)
+{
+	if (!plc || !srate || !ch)
+		return EINVAL;
+
+	memset(plc, 0, sizeof(*plc));
+
+	plc->pmin  = max((size_t)srate * PLC_PMIN_US / 1000000, (size_t)1);
+	plc->pmax  = max((size_t)srate * PLC_PMAX_US / 1000000, plc->pmin);
+	plc->histc = 2 * plc->pmax;
+	plc->fadec = max((size_t)srate * PLC_FADE_MS / 1000, (size_t)1);
+	plc->ch    = ch;
+
+	plc->hist = mem_zalloc(plc->histc * ch * sizeof(int16_t), NULL);
+	if (!plc->hist)
+		return ENOMEM;
+
+	return 0;
+}
+
+
+/**
+ * Reset the packet-loss concealment state and free its memory
+ *
+ * @param plc PLC state
+ */
+void aubuf_plc_reset(struct aubuf_plc *plc)
+{
+	if (!plc)
+		return;
+
+	mem_deref(plc->hist);
+	memset(plc, 0, sizeof(*plc));
+}
+
+
+/* Find the pitch period of the end of the history */
+static size_t find_period(const struct aubuf_plc *plc)
+{
+	const size_t len = plc->pmax * plc->ch;
+	const int16_t *x = &plc->hist[plc->histc * plc->ch - len];
+	double best = 0.0;
+	size_t t, best_t = plc->pmax;
+
+	for (t=plc->pmin; t<=plc->pmax; t++) {
+
+		const int16_t *y = x - t * plc->ch;
+		int64_t xy = 0, yy = 0;
+		double c;
+		size_t i;
+
+		for (i=0; i<len; i++) {
+			xy += (int32_t)x[i] * y[i];
+			yy += (int32_t)y[i] * y[i];
+		}
+
+		if (xy <= 0 || !yy)
+			continue;
+
+		c = (double)xy / sqrt((double)yy);
+		if (c > best) {
+			best   = c;
+			best_t = t;
+		}
+	}
+
+	return best_t;
+}
+
+
+/*
+ * Synthesize the next frame of the concealment, and mix it with the
+ * frame with weight w (Q15)
+ */
+static void synth_frame(struct aubuf_plc *plc, int16_t *frame, int32_t w)
+{
+	const int16_t *s;
+	unsigned c;
+
+	s = &plc->hist[(plc->histc - plc->period + plc->pos) * plc->ch];
+
+	for (c=0; c<plc->ch; c++) {
+
+		const int32_t v = (s[c] * plc->gain) >> 15;
+
+		if (w)
+			frame[c] = (int16_t)((v * (32768 - w) +
+					      frame[c] * w) >> 15);
+		else
+			frame[c] = (int16_t)v;
+	}
+
+	if (++plc->pos == plc->period)
+		plc->pos = 0;
+
+	plc->gain = max(plc->gain - plc->step, 0);
+}
+
+
+/**
+ * Conceal a missing block
+ *
+ * @param plc   PLC state
+ * @param sampv Buffer for the concealment samples
+ * @param n     Number of frames
+ */
+void aubuf_plc_conceal(struct aubuf_plc *plc, int16_t *sampv, size_t n)
+{
+	size_t i;
+
+	if (!plc->period) {
+		plc->period = find_period(plc);
+		plc->pos    = 0;
+		plc->gain   = 1 << 15;
+		plc->step   = (int32_t)(((1 << 15) + plc->fadec - 1) /
+					plc->fadec);
+	}
+
+	for (i=0; i<n; i++)
+		synth_frame(plc, &sampv[i * plc->ch], 0);
+}
+
+
+/**
+ * Feed a block of played audio, cross-fading it with the concealment
+ * if the previous block was lost
+ *
+ * @param plc   PLC state
+ * @param sampv Played samples, modified in place
+ * @param n     Number of frames
+ */
+void aubuf_plc_update(struct aubuf_plc *plc, int16_t *sampv, size_t n)
+{
+	const size_t histn = plc->histc * plc->ch;
+
+	if (plc->period) {
+
+		const size_t len = min(n, plc->pmin);
+		size_t i;
+
+		for (i=0; i<len; i++) {
+			synth_frame(plc, &sampv[i * plc->ch],
+				    (int32_t)((i << 15) / len));
+		}
+
+		plc->period = 0;
+	}
+
+	if (n * plc->ch >= histn) {
+		memcpy(plc->hist, &sampv[n * plc->ch - histn],
+		       histn * sizeof(int16_t));
+	}
+	else {
+		const size_t sampc = n * plc->ch;
+
+		memmove(plc->hist, &plc->hist[sampc],
+			(histn - sampc) * sizeof(int16_t));
+		memcpy(&plc->hist[histn - sampc], sampv,
+		       sampc * sizeof(int16_t));
+	}
+}
@@ -0,0 +1,144 @@
+/**
+ * @file stretch.c  Audio Buffer -- time-stretching
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <math.h>
+#include <string.h>
+#include <re.h>
+#include "aubuf.h"
+
+
+/*
+ * A simplified WSOLA: a block of n frames is made d frames shorter or
+ * longer by splicing the signal onto a copy of itself shifted by d
+ * frames. The splice point is searched for the best similarity between
+ * the two overlapping segments, and the overlap is cross-faded, so the
+ * change is not audible as a click.
+ */
+
+
+static inline size_t overlap_len(size_t n)
+{
+	return n / 4;
+}
+
+
+/**
+ * Get the number of frames added or removed per stretched block
+ *
+ * @param n Number of frames in the block
+ *
+ * @return Number of frames
+ */
+size_t aubuf_stretch_delta(size_t n)
+{
+	return max(n / 40, (size_t)1);
+}
+
+
+/* Find the splice point in [0, amax] where x[a] best matches x[a+d] */
+static size_t find_splice(const int16_t *x, size_t amax, size_t d,
+			  size_t len, unsigned ch)
+{
+	double best = -2.0;
+	size_t a, best_a = 0;
+
+	for (a=0; a<=amax; a++) {
+
+		const int16_t *s1 = &x[a * ch];
+		const int16_t *s2 = &x[(a + d) * ch];
+		int64_t xy = 0, xx = 0, yy = 0;
+		double c;
+		size_t i;
+
+		for (i=0; i<len*ch; i++) {
+			xy += (int32_t)s1[i] * s2[i];
+			xx += (int32_t)s1[i] * s1[i];
+			yy += (int32_t)s2[i] * s2[i];
+		}
+
+		if (!xx || !yy)
+			c = (xx == yy) ? 1.0 : 0.0;
+		else
+			c = (double)xy / sqrt((double)xx * (double)yy);
+
+		if (c > best) {
+			best   = c;
+			best_a = a;
+		}
+	}
+
+	return best_a;
+}
+
+
+/* outv[j] fades from x1 to x2 over len frames */
+static void crossfade(int16_t *outv, const int16_t *x1, const int16_t *x2,
+		      size_t len, unsigned ch)
+{
+	size_t j;
+	unsigned c;
+
+	for (j=0; j<len; j++) {
+
+		const int32_t w = (int32_t)((j << 15) / len);
+
+		for (c=0; c<ch; c++) {
+
+			const size_t i = j * ch + c;
+
+			outv[i] = (int16_t)((x1[i] * (32768 - w) +
+					     x2[i] * w) >> 15);
+		}
+	}
+}
+
+
+/**
+ * Shrink n + d frames of input to n frames of output
+ *
+ * @param outv Output samples (n frames)
+ * @param inv  Input samples (n + d frames)
+ * @param n    Number of output frames
+ * @param d    Number of frames to remove
+ * @param ch   Number of channels
+ */
+void aubuf_stretch_shrink(int16_t *outv, const int16_t *inv, size_t n,
+			  size_t d, unsigned ch)
+{
+	const size_t len = overlap_len(n);
+	size_t a;
+
+	a = find_splice(inv, min(n - len, n / 2), d, len, ch);
+
+	memcpy(outv, inv, a * ch * 2);
+	crossfade(&outv[a * ch], &inv[a * ch], &inv[(a + d) * ch], len, ch);
+	memcpy(&outv[(a + len) * ch], &inv[(a + d + len) * ch],
+	       (n - a - len) * ch * 2);
+}
+
+
+/**
+ * Expand n - d frames of input to n frames of output
+ *
+ * @param outv Output samples (n frames)
+ * @param inv  Input samples (n - d frames)
+ * @param n    Number of output frames
+ * @param d    Number of frames to insert
+ * @param ch   Number of channels
+ */
+void aubuf_stretch_expand(int16_t *outv, const int16_t *inv, size_t n,
+			  size_t d, unsigned ch)
+{
+	const size_t len = overlap_len(n);
+	size_t a;
+
+	a = find_splice(inv, min(n - 2 * d - len, n / 2), d, len, ch);
+
+	memcpy(outv, inv, (a + d) * ch * 2);
+	crossfade(&outv[(a + d) * ch], &inv[(a + d) * ch], &inv[a * ch],
+		  len, ch);
+	memcpy(&outv[(a + d + len) * ch], &inv[(a + len) * ch],
+	       (n - d - a - len) * ch * 2);
+}
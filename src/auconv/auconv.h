@@ -0,0 +1,30 @@
+/**
+ * @file auconv.h  Audio sample format converter -- internal API
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+
+/*
+ * Conversion kernels
+ */
+
+typedef void (auconv_s16_float_h)(float *dst, const int16_t *src, size_t n);
+typedef void (auconv_float_s16_h)(int16_t *dst, const float *src, size_t n);
+typedef void (auconv_s16_s24_h)(uint8_t *dst, const int16_t *src, size_t n);
+typedef void (auconv_s24_s16_h)(int16_t *dst, const uint8_t *src, size_t n);
+
+/** Defines a set of conversion kernels */
+struct auconv_kernel {
+	const char *name;                 /**< Kernel set name           */
+	auconv_s16_float_h *s16_to_float; /**< dst[i] = src[i] / 32768   */
+	auconv_float_s16_h *float_to_s16; /**< dst[i] = sat16(src[i])    */
+	auconv_s16_s24_h *s16_to_s24;     /**< Pack to S24_3LE           */
+	auconv_s24_s16_h *s24_to_s16;     /**< Unpack the upper 16 bits  */
+};
+
+extern const struct auconv_kernel auconv_kernel_scalar;
+
+const struct auconv_kernel *auconv_kernel_get(unsigned i);
+const struct auconv_kernel *auconv_kernel_select(void);
+const struct auconv_kernel *auconv_kernel(void);
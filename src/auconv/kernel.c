@@ -0,0 +1,494 @@
+/**
+ * @file kernel.c  Audio sample format converter -- conversion kernels
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <math.h>
+#include <re.h>
+#include "auconv.h"
+
+
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__)
+#define USE_X86 1
+#include <immintrin.h>
+#endif
+
+#ifdef HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+
+/*
+ * Scalar reference kernels, all other kernels must be bit-exact with these
+ */
+
+static void s16_to_float_scalar(float *dst, const int16_t *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i<n; i++)
+		dst[i] = (float) (src[i] / (1.0 * 0x8000));
+}
+
+
+static void float_to_s16_scalar(int16_t *dst, const float *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i<n; i++) {
+
+		const double value = src[i] * (8.0 * 0x10000000);
+
+		if (value >= (1.0 * 0x7fffffff))
+			dst[i] = 32767;
+		else if (value <= (-8.0 * 0x10000000))
+			dst[i] = -32768;
+		else
+			dst[i] = (short) (lrint (value) >> 16);
+	}
+}
+
+
+static void s16_to_s24_scalar(uint8_t *dst, const int16_t *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i<n; i++) {
+		int16_t s = src[i];
+		dst[3*i+2] = s >> 8;
+		dst[3*i+1] = s & 0xff;
+		dst[3*i+0] = 0;
+	}
+}
+
+
+static void s24_to_s16_scalar(int16_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i<n; i++)
+		dst[i] = (int16_t)(src[3*i+1] | src[3*i+2] << 8);
+}
+
+
+const struct auconv_kernel auconv_kernel_scalar = {
+	"scalar", s16_to_float_scalar, float_to_s16_scalar,
+	s16_to_s24_scalar, s24_to_s16_scalar
+};
+
+
+/*
+ * The float to int16 kernels do not go through double like the scalar
+ * kernel. The scaled value v = x * 2^31 is exact in float, and the
+ * result is floor(rint(v) / 2^16), saturated. rint() only changes v for
+ * |v| < 2^23, where adding and subtracting 2^23 rounds it to nearest
+ * even, and the floor is a truncation corrected by one for negatives.
+ * A NaN is cleared to zero before the saturation, as in the scalar
+ * kernel, which would otherwise make it -32768.
+ */
+
+#define F2S_SCALE  2147483648.0f     /* 2^31  */
+#define F2S_MAGIC  8388608.0f        /* 2^23  */
+#define F2S_DOWN   (1.0f / 65536.0f) /* 2^-16 */
+
+
+#ifdef USE_X86
+
+__attribute__((target("sse2")))
+static inline __m128i float_to_s32_sse2(__m128 x)
+{
+	const __m128 sign  = _mm_set1_ps(-0.0f);
+	const __m128 magic = _mm_set1_ps(F2S_MAGIC);
+	const __m128 v = _mm_mul_ps(x, _mm_set1_ps(F2S_SCALE));
+	const __m128 a = _mm_andnot_ps(sign, v);
+	const __m128 small = _mm_cmplt_ps(a, magic);
+	__m128 r, y;
+	__m128i t;
+
+	r = _mm_sub_ps(_mm_add_ps(a, magic), magic);
+	r = _mm_or_ps(r, _mm_and_ps(v, sign));
+	r = _mm_or_ps(_mm_and_ps(small, r), _mm_andnot_ps(small, v));
+
+	y = _mm_mul_ps(r, _mm_set1_ps(F2S_DOWN));
+	y = _mm_and_ps(y, _mm_cmpord_ps(y, y));
+	y = _mm_min_ps(_mm_max_ps(y, _mm_set1_ps(-32768.0f)),
+		       _mm_set1_ps(32767.0f));
+
+	t = _mm_cvttps_epi32(y);
+
+	return _mm_add_epi32(t, _mm_castps_si128(_mm_cmpgt_ps(
+						_mm_cvtepi32_ps(t), y)));
+}
+
+
+__attribute__((target("sse2")))
+static void s16_to_float_sse2(float *dst, const int16_t *src, size_t n)
+{
+	const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+
+		const __m128i s = _mm_loadu_si128((const __m128i *)&src[i]);
+		__m128 lo, hi;
+
+		lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s),
+						    16));
+		hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s),
+						    16));
+
+		_mm_storeu_ps(&dst[i],   _mm_mul_ps(lo, scale));
+		_mm_storeu_ps(&dst[i+4], _mm_mul_ps(hi, scale));
+	}
+
+	s16_to_float_scalar(&dst[i], &src[i], n - i);
+}
+
+
+__attribute__((target("sse2")))
+static void float_to_s16_sse2(int16_t *dst, const float *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+
+		const __m128i a = float_to_s32_sse2(_mm_loadu_ps(&src[i]));
+		const __m128i b = float_to_s32_sse2(_mm_loadu_ps(&src[i+4]));
+
+		_mm_storeu_si128((__m128i *)&dst[i], _mm_packs_epi32(a, b));
+	}
+
+	float_to_s16_scalar(&dst[i], &src[i], n - i);
+}
+
+
+/* 8 samples to 24 bytes, the low byte of each S24 sample is zero */
+__attribute__((target("ssse3")))
+static void s16_to_s24_ssse3(uint8_t *dst, const int16_t *src, size_t n)
+{
+	const __m128i m0 = _mm_setr_epi8(-1,  0,  1, -1,  2,  3, -1,  4,
+					  5, -1,  6,  7, -1,  8,  9, -1);
+	const __m128i m1 = _mm_setr_epi8(10, 11, -1, 12, 13, -1, 14, 15,
+					 -1, -1, -1, -1, -1, -1, -1, -1);
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+
+		const __m128i s = _mm_loadu_si128((const __m128i *)&src[i]);
+
+		_mm_storeu_si128((__m128i *)&dst[3*i],
+				 _mm_shuffle_epi8(s, m0));
+		_mm_storel_epi64((__m128i *)&dst[3*i+16],
+				 _mm_shuffle_epi8(s, m1));
+	}
+
+	s16_to_s24_scalar(&dst[3*i], &src[i], n - i);
+}
+
+
+/* 24 bytes to 8 samples, from two overlapping loads */
+__attribute__((target("ssse3")))
+static void s24_to_s16_ssse3(int16_t *dst, const uint8_t *src, size_t n)
+{
+	const __m128i m0 = _mm_setr_epi8( 1,  2,  4,  5,  7,  8, 10, 11,
+					 13, 14, -1, -1, -1, -1, -1, -1);
+	const __m128i m1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+					 -1, -1,  8,  9, 11, 12, 14, 15);
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+
+		const __m128i a = _mm_loadu_si128((const __m128i *)
+						  &src[3*i]);
+		const __m128i b = _mm_loadu_si128((const __m128i *)
+						  &src[3*i+8]);
+
+		_mm_storeu_si128((__m128i *)&dst[i],
+				 _mm_or_si128(_mm_shuffle_epi8(a, m0),
+					      _mm_shuffle_epi8(b, m1)));
+	}
+
+	s24_to_s16_scalar(&dst[i], &src[3*i], n - i);
+}
+
+
+static const struct auconv_kernel kernel_sse2 = {
+	"sse2", s16_to_float_sse2, float_to_s16_sse2,
+	s16_to_s24_scalar, s24_to_s16_scalar
+};
+
+
+static const struct auconv_kernel kernel_ssse3 = {
+	"ssse3", s16_to_float_sse2, float_to_s16_sse2,
+	s16_to_s24_ssse3, s24_to_s16_ssse3
+};
+
+
+__attribute__((target("avx2")))
+static inline __m256i float_to_s32_avx2(__m256 x)
+{
+	const __m256 sign  = _mm256_set1_ps(-0.0f);
+	const __m256 magic = _mm256_set1_ps(F2S_MAGIC);
+	const __m256 v = _mm256_mul_ps(x, _mm256_set1_ps(F2S_SCALE));
+	const __m256 a = _mm256_andnot_ps(sign, v);
+	__m256 r, y;
+	__m256i t;
+
+	r = _mm256_sub_ps(_mm256_add_ps(a, magic), magic);
+	r = _mm256_or_ps(r, _mm256_and_ps(v, sign));
+	r = _mm256_blendv_ps(v, r, _mm256_cmp_ps(a, magic, _CMP_LT_OQ));
+
+	y = _mm256_mul_ps(r, _mm256_set1_ps(F2S_DOWN));
+	y = _mm256_and_ps(y, _mm256_cmp_ps(y, y, _CMP_ORD_Q));
+	y = _mm256_min_ps(_mm256_max_ps(y, _mm256_set1_ps(-32768.0f)),
+			  _mm256_set1_ps(32767.0f));
+
+	t = _mm256_cvttps_epi32(y);
+
+	return _mm256_add_epi32(t, _mm256_castps_si256(_mm256_cmp_ps(
+				_mm256_cvtepi32_ps(t), y, _CMP_GT_OQ)));
+}
+
+
+__attribute__((target("avx2")))
+static void s16_to_float_avx2(float *dst, const int16_t *src, size_t n)
+{
+	const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+	size_t i;
+
+	for (i=0; i+16<=n; i+=16) {
+
+		const __m128i s0 = _mm_loadu_si128((const __m128i *)&src[i]);
+		const __m128i s1 = _mm_loadu_si128((const __m128i *)
+						   &src[i+8]);
+		__m256 f0, f1;
+
+		f0 = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(s0));
+		f1 = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(s1));
+
+		_mm256_storeu_ps(&dst[i],   _mm256_mul_ps(f0, scale));
+		_mm256_storeu_ps(&dst[i+8], _mm256_mul_ps(f1, scale));
+	}
+
+	/* the tail is legacy SSE, leave the upper lanes clean for it */
+	_mm256_zeroupper();
+	s16_to_float_sse2(&dst[i], &src[i], n - i);
+}
+
+
+__attribute__((target("avx2")))
+static void float_to_s16_avx2(int16_t *dst, const float *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+16<=n; i+=16) {
+
+		const __m256 a = _mm256_loadu_ps(&src[i]);
+		const __m256 b = _mm256_loadu_ps(&src[i+8]);
+		__m256i r;
+
+		/* packs works per 128-bit lane, restore the sample order */
+		r = _mm256_packs_epi32(float_to_s32_avx2(a),
+				       float_to_s32_avx2(b));
+		r = _mm256_permute4x64_epi64(r, 0xd8);
+
+		_mm256_storeu_si256((__m256i *)&dst[i], r);
+	}
+
+	/* the tail is legacy SSE, leave the upper lanes clean for it */
+	_mm256_zeroupper();
+	float_to_s16_sse2(&dst[i], &src[i], n - i);
+}
+
+
+/* The S24 byte shuffles do not gain from the wider registers */
+static const struct auconv_kernel kernel_avx2 = {
+	"avx2", s16_to_float_avx2, float_to_s16_avx2,
+	s16_to_s24_ssse3, s24_to_s16_ssse3
+};
+
+#endif
+
+
+#ifdef HAVE_NEON
+
+static inline int32x4_t float_to_s32_neon(float32x4_t x)
+{
+	const uint32x4_t sign = vdupq_n_u32(0x80000000);
+	const float32x4_t magic = vdupq_n_f32(F2S_MAGIC);
+	const float32x4_t v = vmulq_n_f32(x, F2S_SCALE);
+	const float32x4_t a = vabsq_f32(v);
+	float32x4_t r, y;
+	int32x4_t t;
+
+	r = vsubq_f32(vaddq_f32(a, magic), magic);
+	r = vbslq_f32(sign, v, r);
+	r = vbslq_f32(vcltq_f32(a, magic), r, v);
+
+	y = vmulq_n_f32(r, F2S_DOWN);
+	y = vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(y),
+					    vceqq_f32(y, y)));
+	y = vminq_f32(vmaxq_f32(y, vdupq_n_f32(-32768.0f)),
+		      vdupq_n_f32(32767.0f));
+
+	t = vcvtq_s32_f32(y);
+
+	return vaddq_s32(t, vreinterpretq_s32_u32(vcgtq_f32(
+						vcvtq_f32_s32(t), y)));
+}
+
+
+static void s16_to_float_neon(float *dst, const int16_t *src, size_t n)
+{
+	const float scale = 1.0f / 32768.0f;
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+
+		const int16x8_t s = vld1q_s16(&src[i]);
+		const int32x4_t lo = vmovl_s16(vget_low_s16(s));
+		const int32x4_t hi = vmovl_s16(vget_high_s16(s));
+
+		vst1q_f32(&dst[i],   vmulq_n_f32(vcvtq_f32_s32(lo), scale));
+		vst1q_f32(&dst[i+4], vmulq_n_f32(vcvtq_f32_s32(hi), scale));
+	}
+
+	s16_to_float_scalar(&dst[i], &src[i], n - i);
+}
+
+
+static void float_to_s16_neon(int16_t *dst, const float *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+
+		const int32x4_t a = float_to_s32_neon(vld1q_f32(&src[i]));
+		const int32x4_t b = float_to_s32_neon(vld1q_f32(&src[i+4]));
+
+		vst1q_s16(&dst[i], vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+	}
+
+	float_to_s16_scalar(&dst[i], &src[i], n - i);
+}
+
+
+/* Structure loads split the samples into byte planes */
+static void s16_to_s24_neon(uint8_t *dst, const int16_t *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+16<=n; i+=16) {
+
+		const uint8x16x2_t s = vld2q_u8((const uint8_t *)&src[i]);
+		uint8x16x3_t d;
+
+		d.val[0] = vdupq_n_u8(0);
+		d.val[1] = s.val[0];
+		d.val[2] = s.val[1];
+
+		vst3q_u8(&dst[3*i], d);
+	}
+
+	s16_to_s24_scalar(&dst[3*i], &src[i], n - i);
+}
+
+
+static void s24_to_s16_neon(int16_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+16<=n; i+=16) {
+
+		const uint8x16x3_t s = vld3q_u8(&src[3*i]);
+		uint8x16x2_t d;
+
+		d.val[0] = s.val[1];
+		d.val[1] = s.val[2];
+
+		vst2q_u8((uint8_t *)&dst[i], d);
+	}
+
+	s24_to_s16_scalar(&dst[i], &src[3*i], n - i);
+}
+
+
+static const struct auconv_kernel kernel_neon = {
+	"neon", s16_to_float_neon, float_to_s16_neon,
+	s16_to_s24_neon, s24_to_s16_neon
+};
+
+#endif
+
+
+/**
+ * Get a set of conversion kernels supported by the running CPU
+ *
+ * @param i Index of the kernel set, 0 is the fastest
+ *
+ * @return Conversion kernels, or NULL if there are no more kernel sets.
+ *         The last set is auconv_kernel_scalar.
+ */
+const struct auconv_kernel *auconv_kernel_get(unsigned i)
+{
+	const struct auconv_kernel *kv[5];
+	unsigned n = 0;
+
+#ifdef USE_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		kv[n++] = &kernel_avx2;
+
+	if (__builtin_cpu_supports("ssse3"))
+		kv[n++] = &kernel_ssse3;
+
+	if (__builtin_cpu_supports("sse2"))
+		kv[n++] = &kernel_sse2;
+#endif
+
+#ifdef HAVE_NEON
+	kv[n++] = &kernel_neon;
+#endif
+
+	kv[n++] = &auconv_kernel_scalar;
+
+	return i < n ? kv[i] : NULL;
+}
+
+
+/**
+ * Select the fastest conversion kernels supported by the running CPU
+ *
+ * @return Conversion kernels
+ */
+const struct auconv_kernel *auconv_kernel_select(void)
+{
+	return auconv_kernel_get(0);
+}
+
+
+/**
+ * Get the conversion kernels, selecting them on first use
+ *
+ * @return Conversion kernels
+ */
+const struct auconv_kernel *auconv_kernel(void)
+{
+	static const struct auconv_kernel *kern;
+	const struct auconv_kernel *k;
+
+#ifdef __GNUC__
+	k = __atomic_load_n(&kern, __ATOMIC_RELAXED);
+	if (!k) {
+		k = auconv_kernel_select();
+		__atomic_store_n(&kern, k, __ATOMIC_RELAXED);
+	}
+#else
+	k = kern;
+	if (!k)
+		kern = k = auconv_kernel_select();
+#endif
+
+	return k;
+}
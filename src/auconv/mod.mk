@@ -5,3 +5,5 @@
 #
 
 SRCS	+= auconv/auconv.c
+SRCS	+= auconv/kernel.c
+SRCS	+= auconv/remix.c
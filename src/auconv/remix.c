@@ -0,0 +1,384 @@
+/**
+ * @file remix.c  Audio sample format converter -- channel remixing
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <string.h>
+#include <re.h>
+#include <rem_au.h>
+#include <rem_auconv.h>
+#include "auconv.h"
+
+
+/*
+ * The conversion runs in blocks of frames. Each block is converted to
+ * interleaved float, remixed and converted to the output format while
+ * it is in the L1 cache, so the buffers are only read and written once.
+ * The format conversion uses the vector kernels, and the remixing loops
+ * see whole frames, which the compiler can vectorize.
+ *
+ * The scratch is on the stack, about 7 KB. The frames per block are a
+ * multiple of the widest kernel vector, so that only the last block of
+ * a buffer goes through the kernel tails. Measured with remtest -p
+ * auconv_remix, this is faster than converting, remixing and converting
+ * back in three passes from 160 frames up, and larger blocks gain
+ * nothing.
+ */
+
+enum {
+	BLOCK       = 512,  /* Samples per block         */
+	BLOCK_ALIGN = 16,   /* Samples per kernel vector */
+};
+
+
+static bool layout_valid(const void * const *v,
+			 const struct auconv_layout *l)
+{
+	unsigned k;
+
+	if (!l->ch || l->ch > AUCONV_CH_MAX)
+		return false;
+
+	for (k=0; k < (l->planar ? l->ch : 1); k++) {
+		if (!v[k])
+			return false;
+	}
+
+	return true;
+}
+
+
+static bool fmt_supported(enum aufmt fmt)
+{
+	return fmt == AUFMT_S16LE || fmt == AUFMT_FLOAT ||
+		fmt == AUFMT_S24_3LE;
+}
+
+
+/*
+ * Gain of each input channel in each output channel. Channels are in
+ * WAVE order (FL, FR, FC, LFE, BL, BR, ..), 6 channels are 5.1.
+ */
+static void remix_matrix(float m[AUCONV_CH_MAX][AUCONV_CH_MAX],
+			 unsigned och, unsigned ich)
+{
+	const float c = 0.70710678f;          /* -3 dB                 */
+	const float n = 1.0f / (1.0f + 2*c);  /* no clipping from 5.1 */
+	unsigned i;
+
+	memset(m, 0, sizeof(float) * AUCONV_CH_MAX * AUCONV_CH_MAX);
+
+	if (och == ich) {
+		for (i=0; i<och; i++)
+			m[i][i] = 1.0f;
+	}
+	else if (ich == 6 && och <= 2) {
+
+		/* ITU-R BS.775 downmix without LFE: L + c*C + c*Ls */
+		const float g = och == 1 ? n / 2 : n;
+
+		m[0][0] = g;
+		m[0][2] = c * g;
+		m[0][4] = c * g;
+		m[och-1][1] = g;
+		m[och-1][2] += c * g;
+		m[och-1][5] = c * g;
+	}
+	else if (och == 1) {
+		for (i=0; i<ich; i++)
+			m[0][i] = 1.0f / ich;
+	}
+	else if (ich == 1 && och == 6) {
+		m[2][0] = 1.0f;
+	}
+	else if (ich == 1) {
+		m[0][0] = 1.0f;
+		m[1][0] = 1.0f;
+	}
+	else {
+		for (i=0; i<min(och, ich); i++)
+			m[i][i] = 1.0f;
+	}
+}
+
+
+/* A single plane is the same as an interleaved buffer */
+static bool interleaved(const struct auconv_layout *l)
+{
+	return !l->planar || l->ch == 1;
+}
+
+
+/* Convert a run of samples to float */
+static void load_run(const struct auconv_kernel *kern, float *dst,
+		     int16_t *tmp, enum aufmt fmt, const void *src,
+		     size_t off, size_t n)
+{
+	if (fmt == AUFMT_S24_3LE) {
+		kern->s24_to_s16(tmp, (const uint8_t *)src + off * 3, n);
+		kern->s16_to_float(dst, tmp, n);
+	}
+	else {
+		kern->s16_to_float(dst, (const int16_t *)src + off, n);
+	}
+}
+
+
+/* Convert a run of float samples to the output format */
+static void store_run(const struct auconv_kernel *kern, void *dst,
+		      int16_t *tmp, enum aufmt fmt, const float *src,
+		      size_t off, size_t n)
+{
+	if (fmt == AUFMT_S24_3LE) {
+		kern->float_to_s16(tmp, src, n);
+		kern->s16_to_s24((uint8_t *)dst + off * 3, tmp, n);
+	}
+	else {
+		kern->float_to_s16((int16_t *)dst + off, src, n);
+	}
+}
+
+
+/* Interleaved float frames of the input block */
+static const float *load(const struct auconv_kernel *kern, float *frames,
+			 float *plane, int16_t *tmp, const void * const *v,
+			 const struct auconv_layout *l, size_t off, size_t n)
+{
+	const unsigned ch = l->ch;
+	unsigned k;
+	size_t i;
+
+	if (interleaved(l) && l->fmt == AUFMT_FLOAT)
+		return (const float *)v[0] + off * ch;
+
+	if (interleaved(l)) {
+		load_run(kern, frames, tmp, l->fmt, v[0], off * ch, n * ch);
+		return frames;
+	}
+
+	for (k=0; k<ch; k++) {
+
+		const float *p = plane;
+
+		if (l->fmt == AUFMT_FLOAT)
+			p = (const float *)v[k] + off;
+		else
+			load_run(kern, plane, tmp, l->fmt, v[k], off, n);
+
+		for (i=0; i<n; i++)
+			frames[i*ch + k] = p[i];
+	}
+
+	return frames;
+}
+
+
+/* Write interleaved float frames to the output block */
+static void store(const struct auconv_kernel *kern, void * const *v,
+		  const struct auconv_layout *l, const float *frames,
+		  float *plane, int16_t *tmp, size_t off, size_t n)
+{
+	const unsigned ch = l->ch;
+	unsigned k;
+	size_t i;
+
+	if (interleaved(l)) {
+		if (l->fmt != AUFMT_FLOAT) {
+			store_run(kern, v[0], tmp, l->fmt, frames,
+				  off * ch, n * ch);
+		}
+		return;
+	}
+
+	for (k=0; k<ch; k++) {
+
+		float *p = plane;
+
+		if (l->fmt == AUFMT_FLOAT)
+			p = (float *)v[k] + off;
+
+		for (i=0; i<n; i++)
+			p[i] = frames[i*ch + k];
+
+		if (l->fmt != AUFMT_FLOAT)
+			store_run(kern, v[k], tmp, l->fmt, plane, off, n);
+	}
+}
+
+
+static void mix_frames(float *o, unsigned och, const float *x, unsigned ich,
+		       float m[AUCONV_CH_MAX][AUCONV_CH_MAX], size_t n)
+{
+	unsigned d, k;
+	size_t i;
+
+	for (i=0; i<n; i++) {
+
+		for (d=0; d<och; d++) {
+
+			float acc = 0.0f;
+
+			for (k=0; k<ich; k++)
+				acc += m[d][k] * x[i*ich + k];
+
+			o[i*och + d] = acc;
+		}
+	}
+}
+
+
+/*
+ * The common conversions, with the channel loops unrolled. They add in
+ * the same order as mix_frames(), without the zero gains.
+ */
+
+static void mix_6_2(float *o, const float *x,
+		    float m[AUCONV_CH_MAX][AUCONV_CH_MAX], size_t n)
+{
+	const float gl = m[0][0], glc = m[0][2], gls = m[0][4];
+	const float gr = m[1][1], grc = m[1][2], grs = m[1][5];
+	size_t i;
+
+	for (i=0; i<n; i++, o+=2, x+=6) {
+
+		const float l = gl * x[0] + glc * x[2] + gls * x[4];
+		const float r = gr * x[1] + grc * x[2] + grs * x[5];
+
+		o[0] = l;
+		o[1] = r;
+	}
+}
+
+
+static void mix_6_1(float *o, const float *x,
+		    float m[AUCONV_CH_MAX][AUCONV_CH_MAX], size_t n)
+{
+	const float gl = m[0][0], gr = m[0][1], gc = m[0][2];
+	const float gls = m[0][4], grs = m[0][5];
+	size_t i;
+
+	for (i=0; i<n; i++, x+=6) {
+		o[i] = gl * x[0] + gr * x[1] + gc * x[2] +
+			gls * x[4] + grs * x[5];
+	}
+}
+
+
+static void mix_2_1(float *o, const float *x,
+		    float m[AUCONV_CH_MAX][AUCONV_CH_MAX], size_t n)
+{
+	const float gl = m[0][0], gr = m[0][1];
+	size_t i;
+
+	for (i=0; i<n; i++)
+		o[i] = gl * x[2*i] + gr * x[2*i+1];
+}
+
+
+static void mix_1_2(float *o, const float *x,
+		    float m[AUCONV_CH_MAX][AUCONV_CH_MAX], size_t n)
+{
+	const float gl = m[0][0], gr = m[1][0];
+	size_t i;
+
+	for (i=0; i<n; i++) {
+
+		const float v = x[i];
+
+		o[2*i]   = gl * v;
+		o[2*i+1] = gr * v;
+	}
+}
+
+
+static void mix(float *o, unsigned och, const float *x, unsigned ich,
+		float m[AUCONV_CH_MAX][AUCONV_CH_MAX], size_t n)
+{
+	if (ich == 6 && och == 2)
+		mix_6_2(o, x, m, n);
+	else if (ich == 6 && och == 1)
+		mix_6_1(o, x, m, n);
+	else if (ich == 2 && och == 1)
+		mix_2_1(o, x, m, n);
+	else if (ich == 1 && och == 2)
+		mix_1_2(o, x, m, n);
+	else
+		mix_frames(o, och, x, ich, m, n);
+}
+
+
+/**
+ * Convert audio between sample formats, interleaved and planar layouts
+ * and channel counts, in one pass over the buffers.
+ *
+ * Channels are in WAVE order, and 6 channels are 5.1 (FL, FR, FC, LFE,
+ * BL, BR). The channels are remixed as follows:
+ *
+ *   - 5.1 to stereo or mono with the ITU-R BS.775 coefficients, without
+ *     the LFE channel, scaled so that the downmix cannot clip
+ *   - other channel counts to mono as the average of all channels
+ *   - mono to the front left and right channels, or to the centre
+ *     channel of 5.1
+ *   - otherwise channel by channel, extra output channels are silent
+ *
+ * @param dstv   Output buffer, or one buffer per channel if planar
+ * @param dst    Output layout
+ * @param srcv   Input buffer, or one buffer per channel if planar
+ * @param src    Input layout
+ * @param frames Number of frames (samples per channel)
+ *
+ * @return 0 for success, otherwise error code
+ *
+ * @note The input and output buffers must not overlap
+ */
+int auconv_remix(void * const *dstv, const struct auconv_layout *dst,
+		 const void * const *srcv, const struct auconv_layout *src,
+		 size_t frames)
+{
+	float m[AUCONV_CH_MAX][AUCONV_CH_MAX];
+	float iscr[BLOCK], oscr[BLOCK], plane[BLOCK];
+	int16_t tmp[BLOCK];
+	const struct auconv_kernel *kern;
+	size_t off, n, bf;
+
+	if (!dstv || !dst || !srcv || !src)
+		return EINVAL;
+
+	if (!layout_valid((const void * const *)dstv, dst) ||
+	    !layout_valid(srcv, src))
+		return EINVAL;
+
+	if (!fmt_supported(dst->fmt) || !fmt_supported(src->fmt))
+		return ENOTSUP;
+
+	kern = auconv_kernel();
+
+	remix_matrix(m, dst->ch, src->ch);
+
+	bf = BLOCK / max(dst->ch, src->ch) / BLOCK_ALIGN * BLOCK_ALIGN;
+
+	for (off=0; off<frames; off+=n) {
+
+		const float *in;
+		float *out = oscr;
+
+		n = min(frames - off, bf);
+
+		in = load(kern, iscr, plane, tmp, srcv, src, off, n);
+
+		/* float output is remixed in place */
+		if (interleaved(dst) && dst->fmt == AUFMT_FLOAT)
+			out = (float *)dstv[0] + off * dst->ch;
+
+		if (dst->ch != src->ch)
+			mix(out, dst->ch, in, src->ch, m, n);
+		else if (out != oscr)
+			memcpy(out, in, n * dst->ch * sizeof(float));
+		else
+			out = (float *)in;
+
+		store(kern, dstv, dst, out, plane, tmp, off, n);
+	}
+
+	return 0;
+}
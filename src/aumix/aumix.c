@@ -9,11 +9,32 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <string.h>
+#include <time.h>
 #include <re.h>
 #include <rem_au.h>
 #include <rem_aubuf.h>
-#include <rem_aufile.h>
+#include <rem_auconv.h>
+#include <rem_fir.h>
+#include <rem_auresamp.h>
 #include <rem_aumix.h>
+#include <rem_dsp.h>
+#include "aumix.h"
+
+
+/* Statistics have one writer (the mixer thread) and lock-free readers */
+#define STAT_INC(x)    (void)__atomic_fetch_add(&(x), 1, __ATOMIC_RELAXED)
+#define STAT_SET(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define STAT_GET(x)    __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+
+enum {
+	GAIN_UNITY    = 1 << 12,        /* Q12 fixed-point unity gain  */
+	GAIN_MAX      = 16 * GAIN_UNITY,
+	AGC_TARGET    = 4096,           /* RMS target, approx -18 dBFS */
+	AGC_FLOOR     = 64,             /* RMS below this is not boosted */
+	AGC_GAIN_MIN  = GAIN_UNITY / 4,
+	AGC_GAIN_MAX  = 8 * GAIN_UNITY,
+};
 
 
 /** Defines an Audio mixer */
@@ -22,22 +43,54 @@ struct aumix {
 	pthread_cond_t cond;
 	struct list srcl;
 	pthread_t thread;
-	struct aufile *af;
+	struct aumix_worker *worker;
+	struct le wle;
+	struct aumix_prompt *prompt;
+	size_t prompt_pos;
+	void *silence;
+	void *frame;
+	const struct aumix_kernel *kern;
+	enum aufmt fmt;
+	size_t ssz;
+	uint64_t deadline;
 	uint32_t ptime;
 	uint32_t frame_size;
 	uint32_t srate;
 	uint8_t ch;
+	size_t rs_sampc;
+	unsigned speakers;
+	bool lockfree;
 	bool run;
+
+	struct aumix_stats stats;
 };
 
 /** Defines an Audio mixer source */
 struct aumix_source {
 	struct le le;
-	int16_t *frame;
+	void *frame;
+	const void *spanv[2];     /**< Frame to mix, in one or two spans */
+	size_t spanc[2];
+	bool peeked;              /**< Spans point into the aubuf        */
 	struct aubuf *aubuf;
+	struct auresamp rs_in;
+	struct auresamp rs_out;
+	size_t sampc;
+	uint32_t srate;
+	uint8_t ch;
+	bool resamp;
+	bool lockfree;            /**< The aubuf is in ring mode         */
 	struct aumix *mix;
 	aumix_frame_h *fh;
+	aumix_float_h *ffh;
 	void *arg;
+	uint64_t level;
+	int32_t gain;
+	int32_t agc_gain;
+	bool agc;
+	bool muted;
+	bool active;
+	bool picked;
 };
 
 
@@ -49,6 +102,14 @@ static void dummy_frame_handler(const int16_t *sampv, size_t sampc, void *arg)
 }
 
 
+static void dummy_float_handler(const float *sampv, size_t sampc, void *arg)
+{
+	(void)sampv;
+	(void)sampc;
+	(void)arg;
+}
+
+
 static void destructor(void *arg)
 {
 	struct aumix *mix = arg;
@@ -63,7 +124,12 @@ static void destructor(void *arg)
 		pthread_join(mix->thread, NULL);
 	}
 
-	mem_deref(mix->af);
+	if (mix->worker)
+		aumix_worker_detach(mix->worker, &mix->wle);
+
+	aumix_prompt_put(mix->prompt);
+	mem_deref(mix->silence);
+	mem_deref(mix->frame);
 }
 
 
@@ -77,174 +143,911 @@ static void source_destructor(void *arg)
 		pthread_mutex_unlock(&src->mix->mutex);
 	}
 
+	auresamp_reset(&src->rs_in);
+	auresamp_reset(&src->rs_out);
 	mem_deref(src->aubuf);
 	mem_deref(src->frame);
 	mem_deref(src->mix);
 }
 
 
-static void *aumix_thread(void *arg)
+uint64_t aumix_mono_ns(void)
 {
-	uint8_t *silence, *frame, *base_frame;
-	struct aumix *mix = arg;
-	int16_t *mix_frame;
-	uint64_t ts = 0;
+	struct timespec ts;
 
-	silence   = mem_zalloc(mix->frame_size*2, NULL);
-	frame     = mem_alloc(mix->frame_size*2, NULL);
-	mix_frame = mem_alloc(mix->frame_size*2, NULL);
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	if (!silence || !frame || !mix_frame)
-		goto out;
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-	pthread_mutex_lock(&mix->mutex);
 
-	while (mix->run) {
+/* Sleep until an absolute deadline on the monotonic clock */
+void aumix_sleep_until(uint64_t deadline)
+{
+#if defined (TIMER_ABSTIME) && !defined (__APPLE__)
+	struct timespec ts;
 
-		struct le *le;
-		uint64_t now;
+	ts.tv_sec  = (time_t)(deadline / 1000000000ULL);
+	ts.tv_nsec = (long)(deadline % 1000000000ULL);
 
-		if (!mix->srcl.head) {
-			mix->af = mem_deref(mix->af);
-			pthread_cond_wait(&mix->cond, &mix->mutex);
-			ts = 0;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+	       == EINTR)
+		;
+#else
+	const uint64_t now = aumix_mono_ns();
+
+	if (deadline > now)
+		(void)usleep((useconds_t)((deadline - now) / 1000));
+#endif
+}
+
+
+void aumix_scratch_reset(struct aumix_scratch *sc)
+{
+	if (!sc)
+		return;
+
+	sc->frame  = mem_deref(sc->frame);
+	sc->acc    = mem_deref(sc->acc);
+	sc->rsamp  = mem_deref(sc->rsamp);
+	sc->abv    = mem_deref(sc->abv);
+	sc->outv   = mem_deref(sc->outv);
+	sc->sampc  = 0;
+	sc->rsampc = 0;
+	sc->batchc = 0;
+}
+
+
+/* The frame and resampler buffers are sized for float samples */
+static int scratch_ensure(struct aumix_scratch *sc, size_t sampc,
+			  size_t rsampc, size_t batchc)
+{
+	void *frame, *acc;
+
+	if (sc->batchc < batchc) {
+
+		struct aubuf **abv;
+		int16_t **outv;
+
+		abv = mem_realloc(sc->abv, batchc * sizeof(*abv));
+		if (!abv)
+			return ENOMEM;
+
+		sc->abv = abv;
+
+		outv = mem_realloc(sc->outv, batchc * sizeof(*outv));
+		if (!outv)
+			return ENOMEM;
+
+		sc->outv   = outv;
+		sc->batchc = batchc;
+	}
+
+	if (sc->rsampc < rsampc) {
+
+		void *rsamp = mem_realloc(sc->rsamp, rsampc * sizeof(float));
+		if (!rsamp)
+			return ENOMEM;
+
+		sc->rsamp  = rsamp;
+		sc->rsampc = rsampc;
+	}
+
+	if (sc->sampc >= sampc)
+		return 0;
+
+	frame = mem_realloc(sc->frame, sampc * sizeof(float));
+	if (!frame)
+		return ENOMEM;
+
+	sc->frame = frame;
+
+	acc = mem_realloc(sc->acc, sampc * sizeof(float));
+	if (!acc)
+		return ENOMEM;
+
+	sc->acc   = acc;
+	sc->sampc = sampc;
+
+	return 0;
+}
+
+
+static uint64_t frame_energy(const struct aumix_source *src)
+{
+	uint64_t e = 0;
+	size_t i, k;
+
+	for (k=0; k<2; k++) {
+
+		const int16_t *sampv = src->spanv[k];
+
+		for (i=0; i<src->spanc[k]; i++)
+			e += (uint64_t)((int32_t)sampv[i] * sampv[i]);
+	}
+
+	i = src->spanc[0] + src->spanc[1];
+
+	return i ? e / i : 0;
+}
+
+
+/*
+ * Mean energy of a float frame, in the units of the int16 frames. It is
+ * clamped so that applying the maximum gain cannot overflow.
+ */
+static uint64_t frame_energy_float(const struct aumix_source *src)
+{
+	const double emax = (double)(1ULL << 40);
+	double e = 0;
+	size_t i, k;
+
+	for (k=0; k<2; k++) {
+
+		const float *sampv = src->spanv[k];
+
+		for (i=0; i<src->spanc[k]; i++)
+			e += (double)sampv[i] * sampv[i];
+	}
+
+	i = src->spanc[0] + src->spanc[1];
+	if (!i)
+		return 0;
+
+	e = e / (double)i * 32768.0 * 32768.0;
+
+	return e < emax ? (uint64_t)e : (uint64_t)emax;
+}
+
+
+static void set_frame(struct aumix_source *src, const void *sampv,
+		      size_t sampc)
+{
+	src->spanv[0] = sampv;
+	src->spanc[0] = sampc;
+	src->spanv[1] = NULL;
+	src->spanc[1] = 0;
+	src->peeked   = false;
+}
+
+
+/*
+ * Mix straight from the storage of the source's audio buffer, saving a
+ * copy, if no gain has to be applied to the frame
+ */
+static bool peek_frame(struct aumix_source *src, size_t sampc)
+{
+	const size_t ssz = src->mix->ssz;
+	struct aubuf_span span;
+	int err;
+
+	if (src->muted || src->agc || src->gain != GAIN_UNITY)
+		return false;
+
+	err = aubuf_peek(src->aubuf, sampc * ssz, &span);
+	if (err == ENODATA) {
+		set_frame(src, src->mix->silence, sampc);
+		return true;
+	}
+	else if (err)
+		return false;
+
+	src->spanv[0] = span.p[0];
+	src->spanc[0] = span.sz[0] / ssz;
+	src->spanv[1] = span.p[1];
+	src->spanc[1] = span.sz[1] / ssz;
+	src->peeked   = true;
+
+	return true;
+}
+
+
+static uint32_t isqrt(uint64_t v)
+{
+	uint64_t r = 0, b = 1ULL << 62;
+
+	while (b > v)
+		b >>= 2;
+
+	while (b) {
+
+		if (v >= r + b) {
+			v -= r + b;
+			r  = (r >> 1) + b;
 		}
 		else {
-			pthread_mutex_unlock(&mix->mutex);
-			(void)usleep(4000);
-			pthread_mutex_lock(&mix->mutex);
+			r >>= 1;
 		}
 
-		now = tmr_jiffies();
-		if (!ts)
-			ts = now;
+		b >>= 2;
+	}
+
+	return (uint32_t)r;
+}
 
-		if (ts > now)
-			continue;
 
-		if (mix->af) {
+/*
+ * Automatic gain control, updated once per frame from the mean energy.
+ * The gain is reduced quickly and increased slowly, and silence or
+ * noise below AGC_FLOOR does not change it.
+ */
+static void agc_update(struct aumix_source *src, uint64_t energy)
+{
+	const uint32_t rms = isqrt(energy);
+	int32_t target;
 
-			size_t n = mix->frame_size*2;
+	if (rms < AGC_FLOOR)
+		return;
 
-			if (aufile_read(mix->af, frame, &n) || n == 0) {
-				mix->af = mem_deref(mix->af);
-				base_frame = silence;
-			}
-			else if (n < mix->frame_size*2) {
-				memset(frame + n, 0, mix->frame_size*2 - n);
-				mix->af = mem_deref(mix->af);
-				base_frame = frame;
+	target = (int32_t)(((int64_t)AGC_TARGET * GAIN_UNITY) / rms);
+
+	if (target < AGC_GAIN_MIN)
+		target = AGC_GAIN_MIN;
+	else if (target > AGC_GAIN_MAX)
+		target = AGC_GAIN_MAX;
+
+	if (target < src->agc_gain)
+		src->agc_gain += (target - src->agc_gain) / 2;
+	else
+		src->agc_gain += (target - src->agc_gain) / 16;
+}
+
+
+static void apply_gain(int16_t *sampv, size_t sampc, int32_t gain)
+{
+	size_t i;
+
+	for (i=0; i<sampc; i++)
+		sampv[i] = saturate_s16((sampv[i] * gain) >> 12);
+}
+
+
+static void apply_gain_float(float *sampv, size_t sampc, int32_t gain)
+{
+	const float g = (float)gain / GAIN_UNITY;
+	size_t i;
+
+	for (i=0; i<sampc; i++)
+		sampv[i] *= g;
+}
+
+
+/* Apply gain, mute and AGC to a source frame, return its mean energy */
+static uint64_t source_level(struct aumix_source *src, size_t sampc,
+			     bool topn)
+{
+	const bool flt = src->mix->fmt == AUFMT_FLOAT;
+	uint64_t energy = 0;
+	int32_t gain;
+
+	if (topn || src->agc)
+		energy = flt ? frame_energy_float(src) : frame_energy(src);
+
+	if (src->agc) {
+		agc_update(src, energy);
+		gain = (int32_t)(((int64_t)src->gain * src->agc_gain) >> 12);
+		if (gain > GAIN_MAX)
+			gain = GAIN_MAX;
+	}
+	else {
+		gain = src->gain;
+	}
+
+	if (gain != GAIN_UNITY) {
+		if (flt)
+			apply_gain_float(src->frame, sampc, gain);
+		else
+			apply_gain(src->frame, sampc, gain);
+
+		energy = (((energy * gain) >> 12) * gain) >> 12;
+	}
+
+	return energy;
+}
+
+
+/*
+ * Select the loudest sources. An active speaker gets a 3 dB bonus, so
+ * that two speakers at similar level do not toggle every frame.
+ */
+static void select_speakers(struct aumix *mix)
+{
+	struct le *le;
+	unsigned k;
+
+	for (le=mix->srcl.head; le; le=le->next) {
+
+		struct aumix_source *src = le->data;
+
+		src->picked = false;
+	}
+
+	for (k=0; k<mix->speakers; k++) {
+
+		struct aumix_source *best = NULL;
+		uint64_t best_score = 0;
+
+		for (le=mix->srcl.head; le; le=le->next) {
+
+			struct aumix_source *src = le->data;
+			uint64_t score;
+
+			if (src->picked || src->muted)
+				continue;
+
+			score = src->active ? src->level * 2 : src->level;
+
+			if (!best || score > best_score) {
+				best = src;
+				best_score = score;
 			}
-			else {
-				base_frame = frame;
+		}
+
+		if (!best)
+			break;
+
+		best->picked = true;
+	}
+
+	for (le=mix->srcl.head; le; le=le->next) {
+
+		struct aumix_source *src = le->data;
+
+		src->active = src->picked;
+	}
+}
+
+
+/*
+ * Kernels for the sample format of the mixer, the offset is in samples.
+ * The accumulator is int32 for int16 mixers and float for float mixers.
+ */
+
+static void tick_load(const struct aumix *mix, void *acc, const void *sampv)
+{
+	if (mix->fmt == AUFMT_FLOAT)
+		memcpy(acc, sampv, mix->frame_size * sizeof(float));
+	else
+		mix->kern->load(acc, sampv, mix->frame_size);
+}
+
+
+static void tick_accum(const struct aumix *mix, void *acc, size_t off,
+		       const void *sampv, size_t n)
+{
+	if (mix->fmt == AUFMT_FLOAT)
+		mix->kern->accumf((float *)acc + off, sampv, n);
+	else
+		mix->kern->accum((int32_t *)acc + off, sampv, n);
+}
+
+
+static void tick_minus(const struct aumix *mix, void *outv, const void *acc,
+		       size_t off, const void *sampv, size_t n)
+{
+	if (mix->fmt == AUFMT_FLOAT)
+		mix->kern->minusf((float *)outv + off,
+				  (const float *)acc + off, sampv, n);
+	else
+		mix->kern->minus((int16_t *)outv + off,
+				 (const int32_t *)acc + off, sampv, n);
+}
+
+
+static int tick_resamp(const struct aumix *mix, struct auresamp *rs,
+		       void *outv, size_t *outc, const void *inv, size_t inc)
+{
+	if (mix->fmt == AUFMT_FLOAT)
+		return auresamp_float(rs, outv, outc, inv, inc);
+	else
+		return auresamp(rs, outv, outc, inv, inc);
+}
+
+
+/* Next frame of the prompt, or silence */
+static const void *base_frame(struct aumix *mix)
+{
+	const struct aumix_prompt *p = mix->prompt;
+	const int16_t *sampv;
+	size_t n;
+
+	if (!p)
+		return mix->silence;
+
+	sampv = &p->sampv[mix->prompt_pos];
+	n = min(p->sampc - mix->prompt_pos, mix->frame_size);
+
+	mix->prompt_pos += n;
+
+	/* the prompt is used in place only while the reference is held */
+	if (mix->fmt == AUFMT_S16LE && n == mix->frame_size &&
+	    mix->prompt_pos < p->sampc)
+		return sampv;
+
+	/* prompts are decoded to int16 */
+	if (mix->fmt == AUFMT_FLOAT)
+		auconv_from_s16(AUFMT_FLOAT, mix->frame, sampv, n);
+	else
+		memcpy(mix->frame, sampv, n * mix->ssz);
+
+	memset((uint8_t *)mix->frame + n * mix->ssz, 0,
+	       (mix->frame_size - n) * mix->ssz);
+
+	/* the cache may already have released its reference */
+	if (mix->prompt_pos >= p->sampc)
+		mix->prompt = aumix_prompt_put(mix->prompt);
+
+	return mix->frame;
+}
+
+
+static unsigned mix_tick(struct aumix *mix, struct aumix_scratch *sc)
+{
+	const size_t fsz = mix->frame_size * mix->ssz;
+	const void *base;
+	void *mix_frame = sc->frame;
+	void *acc = sc->acc;
+	bool topn, shared = false;
+	unsigned mixed = 0;
+	size_t batchc = 0;
+	struct le *le;
+
+	base = base_frame(mix);
+
+	topn = mix->speakers && list_count(&mix->srcl) > mix->speakers;
+
+	for (le=mix->srcl.head; le; le=le->next) {
+
+		struct aumix_source *src = le->data;
+
+		if (src->resamp) {
+			size_t outc = max(src->sampc, mix->frame_size);
+
+			aubuf_read(src->aubuf, sc->rsamp,
+				   src->sampc * mix->ssz);
+
+			if (tick_resamp(mix, &src->rs_in, src->frame, &outc,
+					sc->rsamp, src->sampc) ||
+			    outc != mix->frame_size) {
+				memset(src->frame, 0, fsz);
 			}
+
+			set_frame(src, src->frame, mix->frame_size);
+		}
+		else if (peek_frame(src, mix->frame_size)) {
+			continue;
+		}
+		else if (src->lockfree) {
+			sc->abv[batchc]  = src->aubuf;
+			sc->outv[batchc] = src->frame;
+			++batchc;
+
+			set_frame(src, src->frame, mix->frame_size);
 		}
 		else {
-			base_frame = silence;
+			aubuf_read(src->aubuf, src->frame, fsz);
+
+			set_frame(src, src->frame, mix->frame_size);
 		}
+	}
 
-		for (le=mix->srcl.head; le; le=le->next) {
+	/* the lock-free buffers are read in one pass */
+	(void)aubuf_read_batch(sc->abv, sc->outv, batchc, fsz);
 
-			struct aumix_source *src = le->data;
+	for (le=mix->srcl.head; le; le=le->next) {
+
+		struct aumix_source *src = le->data;
+		uint64_t energy;
+
+		if (src->muted) {
+			src->active = false;
+			src->level  = 0;
+			continue;
+		}
+
+		energy = source_level(src, mix->frame_size, topn);
+
+		if (topn)
+			src->level = (3 * src->level + energy) / 4;
+		else
+			src->active = true;
+	}
+
+	if (topn)
+		select_speakers(mix);
+
+	/* full mix of all active sources, in 32-bit to avoid wraparound */
+	tick_load(mix, acc, base);
+
+	for (le=mix->srcl.head; le; le=le->next) {
+
+		struct aumix_source *src = le->data;
+
+		if (src->active) {
+			tick_accum(mix, acc, 0, src->spanv[0], src->spanc[0]);
+
+			if (src->spanc[1]) {
+				tick_accum(mix, acc, src->spanc[0],
+					   src->spanv[1], src->spanc[1]);
+			}
+			++mixed;
+		}
+	}
+
+	/* mix-minus: each source gets the full mix except itself */
+	for (le=mix->srcl.head; le; le=le->next) {
+
+		struct aumix_source *src = le->data;
+		const void *outv = mix_frame;
+		size_t outc = mix->frame_size;
+
+		if (src->active) {
+			const size_t n = src->spanc[0];
+
+			tick_minus(mix, mix_frame, acc, 0, src->spanv[0], n);
+
+			if (src->spanc[1]) {
+				tick_minus(mix, mix_frame, acc, n,
+					   src->spanv[1], src->spanc[1]);
+			}
+			shared = false;
+		}
+		else if (!shared) {
+			/* inactive sources all get the same full mix */
+			tick_minus(mix, mix_frame, acc, 0, mix->silence,
+				   mix->frame_size);
+			shared = true;
+		}
+
+		if (src->peeked) {
+			aubuf_consume(src->aubuf, fsz);
+			src->peeked = false;
+		}
+
+		if (src->resamp) {
+			outc = sc->rsampc;
+
+			if (tick_resamp(mix, &src->rs_out, sc->rsamp, &outc,
+					mix_frame, mix->frame_size))
+				continue;
+
+			outv = sc->rsamp;
+		}
+
+		if (mix->fmt == AUFMT_FLOAT)
+			src->ffh(outv, outc, src->arg);
+		else
+			src->fh(outv, outc, src->arg);
+	}
+
+	return mixed;
+}
+
+
+/**
+ * Run the audio mixer if its deadline has passed
+ *
+ * @param mix Audio mixer
+ * @param sc  Scratch buffers of the calling thread
+ * @param now Current time of the monotonic clock in [ns]
+ *
+ * @return Next deadline in [ns], or 0 if the mixer is idle
+ */
+uint64_t aumix_process(struct aumix *mix, struct aumix_scratch *sc,
+		       uint64_t now)
+{
+	const uint64_t period = mix->ptime * 1000000ULL;
+	uint64_t next, dur;
+	unsigned mixed = 0, bucket = 0;
+
+	pthread_mutex_lock(&mix->mutex);
+
+	if (!mix->srcl.head) {
+		mix->prompt = aumix_prompt_put(mix->prompt);
+		mix->deadline = 0;
+		pthread_mutex_unlock(&mix->mutex);
+		return 0;
+	}
+
+	if (!mix->deadline)
+		mix->deadline = now;
+
+	if (now < mix->deadline)
+		goto out;
+
+	/* woke up after the next deadline already passed */
+	if (now >= mix->deadline + period)
+		STAT_INC(mix->stats.late);
+
+	if (!scratch_ensure(sc, mix->frame_size, mix->rs_sampc,
+			    list_count(&mix->srcl)))
+		mixed = mix_tick(mix, sc);
+
+	STAT_INC(mix->stats.ticks);
+	STAT_SET(mix->stats.mixed, mixed);
+
+	/* the tick took longer than one frame */
+	dur = aumix_mono_ns() - now;
+	if (dur > period)
+		STAT_INC(mix->stats.overrun);
+
+	for (dur /= 1000; dur > 1 && bucket < AUMIX_STATS_HIST-1; dur >>= 1)
+		++bucket;
+
+	STAT_INC(mix->stats.hist[bucket]);
+
+	mix->deadline += period;
+
+ out:
+	next = mix->deadline;
+	pthread_mutex_unlock(&mix->mutex);
+
+	return next;
+}
 
-			aubuf_read_samp(src->aubuf, src->frame,
-					mix->frame_size);
+
+static void *aumix_thread(void *arg)
+{
+	struct aumix *mix = arg;
+	struct aumix_scratch sc;
+	uint64_t next = 0;
+
+	memset(&sc, 0, sizeof(sc));
+
+	pthread_mutex_lock(&mix->mutex);
+
+	while (mix->run) {
+
+		if (!mix->srcl.head) {
+			mix->prompt = aumix_prompt_put(mix->prompt);
+			mix->deadline = 0;
+			pthread_cond_wait(&mix->cond, &mix->mutex);
+			next = 0;
+			continue;
 		}
 
-		for (le=mix->srcl.head; le; le=le->next) {
+		pthread_mutex_unlock(&mix->mutex);
+
+		if (next)
+			aumix_sleep_until(next);
+
+		next = aumix_process(mix, &sc, aumix_mono_ns());
+
+		pthread_mutex_lock(&mix->mutex);
+	}
+
+	pthread_mutex_unlock(&mix->mutex);
+
+	aumix_scratch_reset(&sc);
+
+	return NULL;
+}
+
+
+static int mix_alloc(struct aumix **mixp, struct aumix_engine *engine,
+		     uint32_t srate, uint8_t ch, uint32_t ptime,
+		     enum aufmt fmt)
+{
+	struct aumix *mix;
+	int err;
+
+	if (!mixp || !srate || !ch || !ptime)
+		return EINVAL;
+
+	/* a frame must be a whole number of samples */
+	if ((uint64_t)srate * ptime % 1000)
+		return EINVAL;
+
+	if (fmt != AUFMT_S16LE && fmt != AUFMT_FLOAT)
+		return ENOTSUP;
+
+	mix = mem_zalloc(sizeof(*mix), destructor);
+	if (!mix)
+		return ENOMEM;
+
+	mix->ptime      = ptime;
+	mix->frame_size = srate * ch * ptime / 1000;
+	mix->srate      = srate;
+	mix->ch         = ch;
+	mix->kern       = aumix_kernel_select();
+	mix->fmt        = fmt;
+	mix->ssz        = fmt == AUFMT_FLOAT ? sizeof(float) : 2;
+
+	mix->silence = mem_zalloc(mix->frame_size * mix->ssz, NULL);
+	mix->frame   = mem_alloc(mix->frame_size * mix->ssz, NULL);
+	if (!mix->silence || !mix->frame) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	err = pthread_mutex_init(&mix->mutex, NULL);
+	if (err)
+		goto out;
+
+	err = pthread_cond_init(&mix->cond, NULL);
+	if (err)
+		goto out;
+
+	if (engine) {
+		err = aumix_worker_attach(&mix->worker, engine,
+					  &mix->wle, mix);
+		goto out;
+	}
+
+	mix->run = true;
+
+	err = pthread_create(&mix->thread, NULL, aumix_thread, mix);
+	if (err) {
+		mix->run = false;
+		goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(mix);
+	else
+		*mixp = mix;
+
+	return err;
+}
+
+
+/**
+ * Allocate a new Audio mixer
+ *
+ * @param mixp  Pointer to allocated audio mixer
+ * @param srate Sample rate in [Hz]
+ * @param ch    Number of channels
+ * @param ptime Packet time in [ms], a whole number of samples
+ *
+ * @return 0 for success, otherwise error code
+ */
+int aumix_alloc(struct aumix **mixp, uint32_t srate,
+		uint8_t ch, uint32_t ptime)
+{
+	return mix_alloc(mixp, NULL, srate, ch, ptime, AUFMT_S16LE);
+}
+
 
-			struct aumix_source *src = le->data;
-			struct le *cle;
+/**
+ * Allocate a new Audio mixer which is run by a shared mixing engine
+ *
+ * @param mixp   Pointer to allocated audio mixer
+ * @param engine Audio mixing engine
+ * @param srate  Sample rate in [Hz]
+ * @param ch     Number of channels
+ * @param ptime  Packet time in [ms], a whole number of samples
+ *
+ * @return 0 for success, otherwise error code
+ */
+int aumix_alloc_shared(struct aumix **mixp, struct aumix_engine *engine,
+		       uint32_t srate, uint8_t ch, uint32_t ptime)
+{
+	if (!engine)
+		return EINVAL;
 
-			memcpy(mix_frame, base_frame, mix->frame_size*2);
+	return mix_alloc(mixp, engine, srate, ch, ptime, AUFMT_S16LE);
+}
 
-			for (cle=mix->srcl.head; cle; cle=cle->next) {
 
-				struct aumix_source *csrc = cle->data;
-				size_t i;
-#if 1
-				/* skip self */
-				if (csrc == src)
-					continue;
-#endif
-				for (i=0; i<mix->frame_size; i++)
-					mix_frame[i] += csrc->frame[i];
-			}
+/**
+ * Allocate a new Audio mixer with a given sample format. A float mixer
+ * mixes and clips to [-1.0, 1.0] in float, and only takes float sources.
+ *
+ * @param mixp   Pointer to allocated audio mixer
+ * @param engine Audio mixing engine, or NULL for a mixer thread
+ * @param srate  Sample rate in [Hz]
+ * @param ch     Number of channels
+ * @param ptime  Packet time in [ms], a whole number of samples
+ * @param fmt    Sample format (AUFMT_S16LE or AUFMT_FLOAT)
+ *
+ * @return 0 for success, otherwise error code
+ */
+int aumix_alloc_fmt(struct aumix **mixp, struct aumix_engine *engine,
+		    uint32_t srate, uint8_t ch, uint32_t ptime,
+		    enum aufmt fmt)
+{
+	return mix_alloc(mixp, engine, srate, ch, ptime, fmt);
+}
 
-			src->fh(mix_frame, mix->frame_size, src->arg);
-		}
 
-		ts += mix->ptime;
-	}
+/**
+ * Limit mixing to the loudest sources (active speakers)
+ *
+ * @param mix      Audio mixer
+ * @param speakers Maximum number of mixed sources (0 to mix all)
+ */
+void aumix_set_speakers(struct aumix *mix, unsigned speakers)
+{
+	if (!mix)
+		return;
 
+	pthread_mutex_lock(&mix->mutex);
+	mix->speakers = speakers;
 	pthread_mutex_unlock(&mix->mutex);
+}
 
- out:
-	mem_deref(mix_frame);
-	mem_deref(silence);
-	mem_deref(frame);
 
-	return NULL;
+/**
+ * Use lock-free audio buffers for the sources allocated after this call
+ *
+ * By default the buffer of a source is locked, so aumix_source_put()
+ * may be called from any thread. A lock-free buffer avoids the lock and
+ * the memory allocation per write, and lets the mixer read the samples
+ * in place, but it has exactly one producer: aumix_source_put() of each
+ * source must then always be called from the same thread. Also, when the
+ * lock-free buffer is full, new samples are dropped instead of the
+ * oldest buffered ones.
+ *
+ * @param mix    Audio mixer
+ * @param enable True for lock-free source buffers, false for locked
+ */
+void aumix_set_lockfree(struct aumix *mix, bool enable)
+{
+	if (!mix)
+		return;
+
+	pthread_mutex_lock(&mix->mutex);
+	mix->lockfree = enable;
+	pthread_mutex_unlock(&mix->mutex);
 }
 
 
 /**
- * Allocate a new Audio mixer
+ * Get the statistics of an audio mixer. This does not take the mixer
+ * lock, so it can be polled without disturbing the mixer.
  *
- * @param mixp  Pointer to allocated audio mixer
- * @param srate Sample rate in [Hz]
- * @param ch    Number of channels
- * @param ptime Packet time in [ms]
+ * @param mix   Audio mixer
+ * @param stats Returned statistics
  *
  * @return 0 for success, otherwise error code
  */
-int aumix_alloc(struct aumix **mixp, uint32_t srate,
-		uint8_t ch, uint32_t ptime)
+int aumix_stats_get(const struct aumix *mix, struct aumix_stats *stats)
 {
-	struct aumix *mix;
-	int err;
+	unsigned i;
 
-	if (!mixp || !srate || !ch || !ptime)
+	if (!mix || !stats)
 		return EINVAL;
 
-	mix = mem_zalloc(sizeof(*mix), destructor);
-	if (!mix)
-		return ENOMEM;
-
-	mix->ptime      = ptime;
-	mix->frame_size = srate * ch * ptime / 1000;
-	mix->srate      = srate;
-	mix->ch         = ch;
+	stats->ticks   = STAT_GET(mix->stats.ticks);
+	stats->late    = STAT_GET(mix->stats.late);
+	stats->overrun = STAT_GET(mix->stats.overrun);
+	stats->mixed   = STAT_GET(mix->stats.mixed);
 
-	err = pthread_mutex_init(&mix->mutex, NULL);
-	if (err)
-		goto out;
+	for (i=0; i<AUMIX_STATS_HIST; i++)
+		stats->hist[i] = STAT_GET(mix->stats.hist[i]);
 
-	err = pthread_cond_init(&mix->cond, NULL);
-	if (err)
-		goto out;
+	return 0;
+}
 
-	mix->run = true;
 
-	err = pthread_create(&mix->thread, NULL, aumix_thread, mix);
-	if (err) {
-		mix->run = false;
-		goto out;
-	}
+/**
+ * Get the statistics of an audio mixer source, without locking
+ *
+ * @param src   Audio mixer source
+ * @param stats Returned overrun/underrun counters of the source buffer
+ *
+ * @return 0 for success, otherwise error code
+ */
+int aumix_source_stats_get(const struct aumix_source *src,
+			   struct aubuf_stats *stats)
+{
+	if (!src || !stats)
+		return EINVAL;
 
- out:
-	if (err)
-		mem_deref(mix);
-	else
-		*mixp = mix;
+	aubuf_stats_get(src->aubuf, stats);
 
-	return err;
+	return 0;
 }
 
 
 /**
  * Load audio file for mixer announcements
  *
+ * The file is decoded once to the mixer format and cached, and shared
+ * by all mixers playing the same file. Supported formats are 16-bit
+ * PCM, A-law and U-law, at any sample rate supported by auresamp.
+ *
  * @param mix      Audio mixer
  * @param filepath Filename of audio file with complete path
  *
@@ -252,28 +1055,24 @@ int aumix_alloc(struct aumix **mixp, uint32_t srate,
  */
 int aumix_playfile(struct aumix *mix, const char *filepath)
 {
-	struct aufile_prm prm;
-	struct aufile *af;
+	struct aumix_prompt *p, *old;
 	int err;
 
 	if (!mix || !filepath)
 		return EINVAL;
 
-	err = aufile_open(&af, &prm, filepath, AUFILE_READ);
+	err = aumix_prompt_get(&p, filepath, mix->srate, mix->ch);
 	if (err)
 		return err;
 
-	if (prm.fmt != AUFMT_S16LE || prm.srate != mix->srate ||
-	    prm.channels != mix->ch) {
-		mem_deref(af);
-		return EINVAL;
-	}
-
 	pthread_mutex_lock(&mix->mutex);
-	mem_deref(mix->af);
-	mix->af = af;
+	old = mix->prompt;
+	mix->prompt = p;
+	mix->prompt_pos = 0;
 	pthread_mutex_unlock(&mix->mutex);
 
+	aumix_prompt_put(old);
+
 	return 0;
 }
 
@@ -294,24 +1093,24 @@ uint32_t aumix_source_count(const struct aumix *mix)
 }
 
 
-/**
- * Allocate an audio mixer source
- *
- * @param srcp Pointer to allocated audio source
- * @param mix  Audio mixer
- * @param fh   Mixer frame handler
- * @param arg  Handler argument
- *
- * @return 0 for success, otherwise error code
- */
-int aumix_source_alloc(struct aumix_source **srcp, struct aumix *mix,
-		       aumix_frame_h *fh, void *arg)
+static int source_alloc(struct aumix_source **srcp, struct aumix *mix,
+			uint32_t srate, uint8_t ch, enum aufmt fmt,
+			aumix_frame_h *fh, aumix_float_h *ffh, void *arg)
 {
 	struct aumix_source *src;
+	bool lockfree;
 	size_t sz;
 	int err;
 
-	if (!srcp || !mix)
+	if (!srcp || !mix || !srate || !ch)
+		return EINVAL;
+
+	/* the source and mixer frames must have the same duration */
+	if ((uint64_t)srate * mix->ptime % 1000)
+		return EINVAL;
+
+	/* sources are not converted, they must match the mixer */
+	if (fmt != mix->fmt)
 		return EINVAL;
 
 	src = mem_zalloc(sizeof(*src), source_destructor);
@@ -319,21 +1118,63 @@ int aumix_source_alloc(struct aumix_source **srcp, struct aumix *mix,
 		return ENOMEM;
 
 	src->mix = mem_ref(mix);
-	src->fh  = fh ? fh : dummy_frame_handler;
+	src->fh  = fh  ? fh  : dummy_frame_handler;
+	src->ffh = ffh ? ffh : dummy_float_handler;
 	src->arg = arg;
+	src->gain     = GAIN_UNITY;
+	src->agc_gain = GAIN_UNITY;
+
+	src->sampc  = srate * ch * mix->ptime / 1000;
+	src->srate  = srate;
+	src->ch     = ch;
+	src->resamp = srate != mix->srate || ch != mix->ch;
+
+	if (src->resamp) {
+
+		auresamp_init(&src->rs_in);
+		auresamp_init(&src->rs_out);
 
-	sz = mix->frame_size*2;
+		err = auresamp_setup(&src->rs_in, srate, ch,
+				     mix->srate, mix->ch);
+		if (err)
+			goto out;
 
-	src->frame = mem_alloc(sz, NULL);
+		err = auresamp_setup(&src->rs_out, mix->srate, mix->ch,
+				     srate, ch);
+		if (err)
+			goto out;
+	}
+
+	/* large enough for in-place downsampling of the source frame */
+	src->frame = mem_alloc(max(src->sampc, mix->frame_size) * mix->ssz,
+			       NULL);
 	if (!src->frame) {
 		err = ENOMEM;
 		goto out;
 	}
 
-	err = aubuf_alloc(&src->aubuf, sz * 6, sz * 12);
+	sz = src->sampc * mix->ssz;
+
+	pthread_mutex_lock(&mix->mutex);
+	lockfree = mix->lockfree;
+	pthread_mutex_unlock(&mix->mutex);
+
+	src->lockfree = lockfree;
+
+	if (lockfree)
+		err = aubuf_alloc_ring(&src->aubuf, sz * 6, sz * 12);
+	else
+		err = aubuf_alloc(&src->aubuf, sz * 6, sz * 12);
 	if (err)
 		goto out;
 
+	if (src->resamp) {
+		pthread_mutex_lock(&mix->mutex);
+		mix->rs_sampc = max(mix->rs_sampc,
+				    max(src->sampc, mix->frame_size));
+		pthread_mutex_unlock(&mix->mutex);
+	}
+
  out:
 	if (err)
 		mem_deref(src);
@@ -344,6 +1185,72 @@ int aumix_source_alloc(struct aumix_source **srcp, struct aumix *mix,
 }
 
 
+/**
+ * Allocate an audio mixer source
+ *
+ * @param srcp Pointer to allocated audio source
+ * @param mix  Audio mixer
+ * @param fh   Mixer frame handler
+ * @param arg  Handler argument
+ *
+ * @return 0 for success, otherwise error code
+ */
+int aumix_source_alloc(struct aumix_source **srcp, struct aumix *mix,
+		       aumix_frame_h *fh, void *arg)
+{
+	if (!mix)
+		return EINVAL;
+
+	return source_alloc(srcp, mix, mix->srate, mix->ch, AUFMT_S16LE,
+			    fh, NULL, arg);
+}
+
+
+/**
+ * Allocate an audio mixer source with its own sample rate and channels.
+ * The source audio is resampled to and from the mixer format inside
+ * the mixer.
+ *
+ * @param srcp  Pointer to allocated audio source
+ * @param mix   Audio mixer
+ * @param srate Sample rate of the source in [Hz], with a whole number
+ *              of samples per packet time of the mixer
+ * @param ch    Number of channels of the source
+ * @param fh    Mixer frame handler
+ * @param arg   Handler argument
+ *
+ * @return 0 for success, otherwise error code
+ */
+int aumix_source_alloc_fmt(struct aumix_source **srcp, struct aumix *mix,
+			   uint32_t srate, uint8_t ch,
+			   aumix_frame_h *fh, void *arg)
+{
+	return source_alloc(srcp, mix, srate, ch, AUFMT_S16LE, fh, NULL, arg);
+}
+
+
+/**
+ * Allocate an audio mixer source of a float mixer, with its own sample
+ * rate and channels
+ *
+ * @param srcp  Pointer to allocated audio source
+ * @param mix   Audio mixer, allocated with AUFMT_FLOAT
+ * @param srate Sample rate of the source in [Hz], with a whole number
+ *              of samples per packet time of the mixer
+ * @param ch    Number of channels of the source
+ * @param fh    Mixer frame handler
+ * @param arg   Handler argument
+ *
+ * @return 0 for success, otherwise error code
+ */
+int aumix_source_alloc_float(struct aumix_source **srcp, struct aumix *mix,
+			     uint32_t srate, uint8_t ch,
+			     aumix_float_h *fh, void *arg)
+{
+	return source_alloc(srcp, mix, srate, ch, AUFMT_FLOAT, NULL, fh, arg);
+}
+
+
 /**
  * Enable/disable aumix source
  *
@@ -376,6 +1283,136 @@ void aumix_source_enable(struct aumix_source *src, bool enable)
 	}
 
 	pthread_mutex_unlock(&mix->mutex);
+
+	if (enable && mix->worker)
+		aumix_worker_wakeup(mix->worker);
+}
+
+
+/**
+ * Set the gain of an audio mixer source
+ *
+ * @param src  Audio mixer source
+ * @param gain Linear gain (1.0 is unity gain, max 16.0)
+ */
+void aumix_source_set_gain(struct aumix_source *src, float gain)
+{
+	int32_t g;
+
+	if (!src)
+		return;
+
+	if (gain <= 0)
+		g = 0;
+	else if (gain >= (float)GAIN_MAX / GAIN_UNITY)
+		g = GAIN_MAX;
+	else
+		g = (int32_t)(gain * GAIN_UNITY + 0.5f);
+
+	pthread_mutex_lock(&src->mix->mutex);
+	src->gain = g;
+	pthread_mutex_unlock(&src->mix->mutex);
+}
+
+
+/**
+ * Mute/unmute an audio mixer source. A muted source is not mixed into
+ * the output of the other sources, but still receives the mix.
+ *
+ * @param src  Audio mixer source
+ * @param mute True to mute, false to unmute
+ */
+void aumix_source_mute(struct aumix_source *src, bool mute)
+{
+	if (!src)
+		return;
+
+	pthread_mutex_lock(&src->mix->mutex);
+	src->muted = mute;
+	pthread_mutex_unlock(&src->mix->mutex);
+}
+
+
+/**
+ * Enable/disable automatic gain control of an audio mixer source
+ *
+ * @param src    Audio mixer source
+ * @param enable True to enable, false to disable
+ */
+void aumix_source_set_agc(struct aumix_source *src, bool enable)
+{
+	if (!src)
+		return;
+
+	pthread_mutex_lock(&src->mix->mutex);
+	src->agc      = enable;
+	src->agc_gain = GAIN_UNITY;
+	pthread_mutex_unlock(&src->mix->mutex);
+}
+
+
+/**
+ * Enable/disable adaptive jitter buffer sizing of an audio mixer source
+ *
+ * @param src    Audio mixer source
+ * @param enable True to enable, false to disable
+ *
+ * @note Must be called from the thread calling aumix_source_put()
+ */
+void aumix_source_set_adaptive(struct aumix_source *src, bool enable)
+{
+	if (!src)
+		return;
+
+	aubuf_set_adaptive(src->aubuf, enable);
+}
+
+
+/**
+ * Enable/disable drift compensation by time-stretching of an audio
+ * mixer source
+ *
+ * @param src    Audio mixer source
+ * @param enable True to enable, false to disable
+ *
+ * @note Time-stretching works on int16 samples, and is not done for
+ *       sources of float mixers
+ */
+void aumix_source_set_stretch(struct aumix_source *src, bool enable)
+{
+	if (!src || src->mix->fmt == AUFMT_FLOAT)
+		return;
+
+	pthread_mutex_lock(&src->mix->mutex);
+	aubuf_set_stretch(src->aubuf, enable ? src->ch : 0);
+	pthread_mutex_unlock(&src->mix->mutex);
+}
+
+
+/**
+ * Enable/disable packet-loss concealment of an audio mixer source
+ *
+ * @param src    Audio mixer source
+ * @param enable True to enable, false to disable
+ *
+ * @return 0 for success, otherwise error code
+ */
+int aumix_source_set_plc(struct aumix_source *src, bool enable)
+{
+	int err;
+
+	if (!src)
+		return EINVAL;
+
+	/* the concealment works on int16 samples */
+	if (src->mix->fmt == AUFMT_FLOAT)
+		return ENOTSUP;
+
+	pthread_mutex_lock(&src->mix->mutex);
+	err = aubuf_set_plc(src->aubuf, src->srate, enable ? src->ch : 0);
+	pthread_mutex_unlock(&src->mix->mutex);
+
+	return err;
 }
 
 
@@ -386,18 +1423,44 @@ void aumix_source_enable(struct aumix_source *src, bool enable)
  * @param sampv PCM samples
  * @param sampc Number of samples
  *
+ * @note Must always be called from the same thread, if the mixer uses
+ *       lock-free source buffers (see aumix_set_lockfree())
+ *
  * @return 0 for success, otherwise error code
  */
 int aumix_source_put(struct aumix_source *src, const int16_t *sampv,
 		     size_t sampc)
 {
-	if (!src || !sampv)
+	if (!src || !sampv || src->mix->fmt != AUFMT_S16LE)
 		return EINVAL;
 
 	return aubuf_write_samp(src->aubuf, sampv, sampc);
 }
 
 
+/**
+ * Write float samples for a given source to a float audio mixer
+ *
+ * @param src   Audio mixer source
+ * @param sampv Float samples
+ * @param sampc Number of samples
+ *
+ * @note Must always be called from the same thread, if the mixer uses
+ *       lock-free source buffers (see aumix_set_lockfree())
+ *
+ * @return 0 for success, otherwise error code
+ */
+int aumix_source_put_float(struct aumix_source *src, const float *sampv,
+			   size_t sampc)
+{
+	if (!src || !sampv || src->mix->fmt != AUFMT_FLOAT)
+		return EINVAL;
+
+	return aubuf_write(src->aubuf, (const uint8_t *)sampv,
+			   sampc * sizeof(float));
+}
+
+
 /**
  * Flush the audio buffer of a given audio mixer source
  *
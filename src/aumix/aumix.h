@@ -0,0 +1,89 @@
+/**
+ * @file aumix.h  Audio Mixer -- internal API
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+
+/*
+ * Mixing kernels
+ */
+
+typedef void (aumix_load_h)(int32_t *accv, const int16_t *sampv, size_t n);
+typedef void (aumix_accum_h)(int32_t *accv, const int16_t *sampv, size_t n);
+typedef void (aumix_minus_h)(int16_t *outv, const int32_t *accv,
+			     const int16_t *sampv, size_t n);
+typedef void (aumix_accumf_h)(float *accv, const float *sampv, size_t n);
+typedef void (aumix_minusf_h)(float *outv, const float *accv,
+			      const float *sampv, size_t n);
+
+/** Defines a set of mixing kernels */
+struct aumix_kernel {
+	const char *name;      /**< Name of the instruction set          */
+	aumix_load_h *load;    /**< accv[i]  = sampv[i]                   */
+	aumix_accum_h *accum;  /**< accv[i] += sampv[i]                   */
+	aumix_minus_h *minus;  /**< outv[i]  = sat16(accv[i] - sampv[i])  */
+	aumix_accumf_h *accumf;  /**< accv[i] += sampv[i], float          */
+	aumix_minusf_h *minusf;  /**< outv[i]  = clip(accv[i] - sampv[i]) */
+};
+
+extern const struct aumix_kernel aumix_kernel_scalar;
+
+const struct aumix_kernel *aumix_kernel_get(unsigned i);
+const struct aumix_kernel *aumix_kernel_select(void);
+
+
+/*
+ * Mixer
+ */
+
+/** Scratch buffers of a mixing thread, large enough for float */
+struct aumix_scratch {
+	void *frame;     /**< Output frame                          */
+	void *acc;       /**< 32-bit integer or float accumulator   */
+	void *rsamp;     /**< Resampler input/output buffer         */
+	struct aubuf **abv;  /**< Audio buffers to read in one batch */
+	int16_t **outv;  /**< Frames to read the batch into         */
+	size_t sampc;    /**< Number of frame/accumulator samples   */
+	size_t rsampc;   /**< Number of resampler buffer samples    */
+	size_t batchc;   /**< Number of batch entries               */
+};
+
+uint64_t aumix_mono_ns(void);
+void     aumix_sleep_until(uint64_t deadline);
+void     aumix_scratch_reset(struct aumix_scratch *sc);
+uint64_t aumix_process(struct aumix *mix, struct aumix_scratch *sc,
+		       uint64_t now);
+
+
+/*
+ * Engine
+ */
+
+struct aumix_worker;
+
+int  aumix_worker_attach(struct aumix_worker **wp, struct aumix_engine *eng,
+			 struct le *le, struct aumix *mix);
+void aumix_worker_detach(struct aumix_worker *w, struct le *le);
+void aumix_worker_wakeup(struct aumix_worker *w);
+
+
+/*
+ * Prompt cache
+ */
+
+/** Defines a decoded prompt, in the mixer format */
+struct aumix_prompt {
+	struct le le;     /**< Linked list element, owned by the cache */
+	char *path;       /**< Filename of audio file                  */
+	int16_t *sampv;   /**< Decoded samples                         */
+	size_t sampc;     /**< Number of samples                       */
+	uint32_t srate;   /**< Sample rate                             */
+	uint8_t ch;       /**< Number of channels                      */
+	int64_t mtime;    /**< Modification time of the file           */
+	int64_t fsize;    /**< Size of the file in [bytes]             */
+};
+
+int   aumix_prompt_get(struct aumix_prompt **pp, const char *filepath,
+		       uint32_t srate, uint8_t ch);
+void *aumix_prompt_put(struct aumix_prompt *p);
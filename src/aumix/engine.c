@@ -0,0 +1,382 @@
+/**
+ * @file engine.c  Audio Mixer -- shared mixing engine
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#define _GNU_SOURCE 1
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <re.h>
+#include <rem_au.h>
+#include <rem_aumix.h>
+#include "aumix.h"
+
+
+/**
+ * Defines a mixing worker thread. Each mixer is assigned to one worker
+ * for its whole lifetime, so its buffers stay in the same CPU cache.
+ *
+ * The worker runs the mixers from a snapshot of its mixer list, without
+ * holding its lock, so that the frame handlers may use the other mixers
+ * of the same worker. A mixer that is detached meanwhile is cleared
+ * from the snapshot, and the detach waits while the worker is still
+ * running it.
+ *
+ * The last engine reference may be released on a worker thread, by a
+ * frame handler. That worker is then detached, and frees the worker
+ * array when it exits.
+ */
+struct aumix_worker {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_cond_t idle;
+	pthread_t thread;
+	struct list mixl;
+	struct aumix_engine *eng;
+	struct aumix_worker *freev;  /**< Worker array to free on exit */
+	struct aumix **snapv;   /**< Mixers of the current round    */
+	uint32_t snapc;         /**< Number of snapshot entries     */
+	uint32_t snapsz;        /**< Size of the snapshot array     */
+	const struct aumix *cur;  /**< Mixer being run, or NULL     */
+	unsigned cpu;
+	bool wake;
+	bool run;
+};
+
+/** Defines an Audio mixing engine */
+struct aumix_engine {
+	struct aumix_worker *workerv;
+	unsigned workerc;
+};
+
+
+/* Run all mixers of the worker once, with the worker lock held on entry */
+static uint64_t worker_round(struct aumix_worker *w,
+			     struct aumix_scratch *sc)
+{
+	uint64_t next = 0;
+	struct le *le;
+	uint32_t i;
+
+	w->snapc = 0;
+	for (le=w->mixl.head; le && w->snapc < w->snapsz; le=le->next)
+		w->snapv[w->snapc++] = le->data;
+
+	for (i=0; i<w->snapc; i++) {
+
+		struct aumix *mix = w->snapv[i];
+		uint64_t t;
+
+		if (!mix)
+			continue;
+
+		w->cur = mix;
+		pthread_mutex_unlock(&w->mutex);
+
+		t = aumix_process(mix, sc, aumix_mono_ns());
+
+		pthread_mutex_lock(&w->mutex);
+		w->cur = NULL;
+		pthread_cond_broadcast(&w->idle);
+
+		if (t && (!next || t < next))
+			next = t;
+	}
+
+	w->snapc = 0;
+
+	return next;
+}
+
+
+static void *worker_thread(void *arg)
+{
+	struct aumix_worker *w = arg;
+	struct aumix_scratch sc;
+
+	memset(&sc, 0, sizeof(sc));
+
+#ifdef __linux__
+	{
+		cpu_set_t cpuset;
+
+		CPU_ZERO(&cpuset);
+		CPU_SET(w->cpu, &cpuset);
+
+		(void)pthread_setaffinity_np(pthread_self(), sizeof(cpuset),
+					     &cpuset);
+	}
+#endif
+
+	pthread_mutex_lock(&w->mutex);
+
+	while (w->run) {
+
+		uint64_t next;
+
+		w->wake = false;
+
+		next = worker_round(w, &sc);
+
+		if (!next) {
+			/* a source was enabled during the round */
+			if (!w->wake && w->run)
+				pthread_cond_wait(&w->cond, &w->mutex);
+			continue;
+		}
+
+		pthread_mutex_unlock(&w->mutex);
+		aumix_sleep_until(next);
+		pthread_mutex_lock(&w->mutex);
+	}
+
+	pthread_mutex_unlock(&w->mutex);
+
+	aumix_scratch_reset(&sc);
+
+	/* the engine was released on this thread */
+	if (w->freev) {
+		mem_deref(w->snapv);
+		mem_deref(w->freev);
+	}
+
+	return NULL;
+}
+
+
+static void destructor(void *arg)
+{
+	struct aumix_engine *eng = arg;
+	struct aumix_worker *selfw = NULL;
+	unsigned i;
+
+	for (i=0; i<eng->workerc; i++) {
+
+		struct aumix_worker *w = &eng->workerv[i];
+		const bool self = pthread_equal(pthread_self(), w->thread);
+
+		if (!w->run)
+			continue;
+
+		pthread_mutex_lock(&w->mutex);
+		w->run = false;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->mutex);
+
+		/* a worker cannot join itself, it exits on its own */
+		if (self) {
+			pthread_detach(w->thread);
+			selfw = w;
+			continue;
+		}
+
+		pthread_join(w->thread, NULL);
+	}
+
+	for (i=0; i<eng->workerc; i++) {
+		if (&eng->workerv[i] != selfw)
+			eng->workerv[i].snapv = mem_deref(eng->workerv[i].snapv);
+	}
+
+	if (selfw)
+		selfw->freev = eng->workerv;
+	else
+		mem_deref(eng->workerv);
+}
+
+
+/**
+ * Allocate a new Audio mixing engine, with a fixed pool of worker
+ * threads that run all mixers allocated with aumix_alloc_shared()
+ *
+ * @param engp     Pointer to allocated mixing engine
+ * @param nworkers Number of worker threads (0 for one per CPU)
+ *
+ * @return 0 for success, otherwise error code
+ */
+int aumix_engine_alloc(struct aumix_engine **engp, unsigned nworkers)
+{
+	struct aumix_engine *eng;
+	unsigned i, ncpu = 1;
+	int err = 0;
+
+	if (!engp)
+		return EINVAL;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	{
+		const long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		if (n > 0)
+			ncpu = (unsigned)n;
+	}
+#endif
+
+	if (!nworkers)
+		nworkers = ncpu;
+
+	eng = mem_zalloc(sizeof(*eng), destructor);
+	if (!eng)
+		return ENOMEM;
+
+	eng->workerv = mem_zalloc(nworkers * sizeof(*eng->workerv), NULL);
+	if (!eng->workerv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i=0; i<nworkers; i++) {
+
+		struct aumix_worker *w = &eng->workerv[i];
+
+		w->eng = eng;
+		w->cpu = i % ncpu;
+
+		err = pthread_mutex_init(&w->mutex, NULL);
+		if (err)
+			goto out;
+
+		err = pthread_cond_init(&w->cond, NULL);
+		if (err)
+			goto out;
+
+		err = pthread_cond_init(&w->idle, NULL);
+		if (err)
+			goto out;
+
+		w->run = true;
+
+		err = pthread_create(&w->thread, NULL, worker_thread, w);
+		if (err) {
+			w->run = false;
+			goto out;
+		}
+
+		++eng->workerc;
+	}
+
+ out:
+	if (err)
+		mem_deref(eng);
+	else
+		*engp = eng;
+
+	return err;
+}
+
+
+/**
+ * Get the number of worker threads of an Audio mixing engine
+ *
+ * @param eng Audio mixing engine
+ *
+ * @return Number of worker threads
+ */
+unsigned aumix_engine_workers(const struct aumix_engine *eng)
+{
+	return eng ? eng->workerc : 0;
+}
+
+
+/* Assign a mixer to the worker with the fewest mixers */
+int aumix_worker_attach(struct aumix_worker **wp, struct aumix_engine *eng,
+			struct le *le, struct aumix *mix)
+{
+	struct aumix_worker *w = NULL;
+	uint32_t n = 0;
+	unsigned i;
+
+	if (!wp || !eng || !eng->workerc || !le || !mix)
+		return EINVAL;
+
+	for (i=0; i<eng->workerc; i++) {
+
+		struct aumix_worker *cw = &eng->workerv[i];
+		uint32_t cn;
+
+		pthread_mutex_lock(&cw->mutex);
+		cn = list_count(&cw->mixl);
+		pthread_mutex_unlock(&cw->mutex);
+
+		if (!w || cn < n) {
+			w = cw;
+			n = cn;
+		}
+	}
+
+	pthread_mutex_lock(&w->mutex);
+
+	/* the snapshot has room for every mixer of the worker */
+	n = list_count(&w->mixl);
+	if (w->snapsz <= n) {
+
+		struct aumix **snapv;
+
+		snapv = mem_realloc(w->snapv, (n + 1) * sizeof(*snapv));
+		if (!snapv) {
+			pthread_mutex_unlock(&w->mutex);
+			return ENOMEM;
+		}
+
+		w->snapv  = snapv;
+		w->snapsz = n + 1;
+	}
+
+	list_append(&w->mixl, le, mix);
+	pthread_mutex_unlock(&w->mutex);
+
+	/* the worker holds the engine through the mixer */
+	mem_ref(eng);
+	*wp = w;
+
+	return 0;
+}
+
+
+/*
+ * Remove a mixer from its worker. The mixer may also be released by a
+ * frame handler of another mixer, on the worker thread itself.
+ */
+void aumix_worker_detach(struct aumix_worker *w, struct le *le)
+{
+	const struct aumix *mix;
+	uint32_t i;
+	bool self;
+
+	if (!w || !le)
+		return;
+
+	mix  = le->data;
+	self = pthread_equal(pthread_self(), w->thread);
+
+	pthread_mutex_lock(&w->mutex);
+
+	list_unlink(le);
+
+	for (i=0; i<w->snapc; i++) {
+		if (w->snapv[i] == mix)
+			w->snapv[i] = NULL;
+	}
+
+	while (!self && w->cur == mix)
+		pthread_cond_wait(&w->idle, &w->mutex);
+
+	pthread_mutex_unlock(&w->mutex);
+
+	mem_deref(w->eng);
+}
+
+
+void aumix_worker_wakeup(struct aumix_worker *w)
+{
+	if (!w)
+		return;
+
+	pthread_mutex_lock(&w->mutex);
+	w->wake = true;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+}
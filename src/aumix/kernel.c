@@ -0,0 +1,465 @@
+/**
+ * @file kernel.c  Audio Mixer -- mixing kernels
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include <rem_au.h>
+#include <rem_aumix.h>
+#include <rem_dsp.h>
+#include "aumix.h"
+
+
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__)
+#define USE_X86 1
+#include <immintrin.h>
+#endif
+
+#ifdef HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+
+/*
+ * Scalar reference kernels, all other kernels must be bit-exact with these
+ */
+
+static void load_scalar(int32_t *accv, const int16_t *sampv, size_t n)
+{
+	size_t i;
+
+	for (i=0; i<n; i++)
+		accv[i] = sampv[i];
+}
+
+
+static void accum_scalar(int32_t *accv, const int16_t *sampv, size_t n)
+{
+	size_t i;
+
+	for (i=0; i<n; i++)
+		accv[i] += sampv[i];
+}
+
+
+static void minus_scalar(int16_t *outv, const int32_t *accv,
+			 const int16_t *sampv, size_t n)
+{
+	size_t i;
+
+	for (i=0; i<n; i++)
+		outv[i] = saturate_s16(accv[i] - sampv[i]);
+}
+
+
+static void accumf_scalar(float *accv, const float *sampv, size_t n)
+{
+	size_t i;
+
+	for (i=0; i<n; i++)
+		accv[i] += sampv[i];
+}
+
+
+/*
+ * A NaN is passed through unclipped. The SSE2 and AVX2 kernels give the
+ * clip bound as the first operand of min and max, which then return the
+ * second operand, the NaN. NEON min and max return a NaN anyway.
+ */
+static void minusf_scalar(float *outv, const float *accv,
+			  const float *sampv, size_t n)
+{
+	size_t i;
+
+	for (i=0; i<n; i++) {
+
+		const float v = accv[i] - sampv[i];
+
+		outv[i] = v > 1.0f ? 1.0f : v < -1.0f ? -1.0f : v;
+	}
+}
+
+
+const struct aumix_kernel aumix_kernel_scalar = {
+	"scalar", load_scalar, accum_scalar, minus_scalar,
+	accumf_scalar, minusf_scalar
+};
+
+
+#ifdef USE_X86
+
+__attribute__((target("sse2")))
+static inline __m128i sext_lo(__m128i v)
+{
+	return _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+}
+
+
+__attribute__((target("sse2")))
+static inline __m128i sext_hi(__m128i v)
+{
+	return _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+}
+
+
+__attribute__((target("sse2")))
+static void load_sse2(int32_t *accv, const int16_t *sampv, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+
+		const __m128i s = _mm_loadu_si128((const __m128i *)&sampv[i]);
+
+		_mm_storeu_si128((__m128i *)&accv[i],   sext_lo(s));
+		_mm_storeu_si128((__m128i *)&accv[i+4], sext_hi(s));
+	}
+
+	load_scalar(&accv[i], &sampv[i], n - i);
+}
+
+
+__attribute__((target("sse2")))
+static void accum_sse2(int32_t *accv, const int16_t *sampv, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+
+		const __m128i s = _mm_loadu_si128((const __m128i *)&sampv[i]);
+		__m128i a0 = _mm_loadu_si128((__m128i *)&accv[i]);
+		__m128i a1 = _mm_loadu_si128((__m128i *)&accv[i+4]);
+
+		a0 = _mm_add_epi32(a0, sext_lo(s));
+		a1 = _mm_add_epi32(a1, sext_hi(s));
+
+		_mm_storeu_si128((__m128i *)&accv[i],   a0);
+		_mm_storeu_si128((__m128i *)&accv[i+4], a1);
+	}
+
+	accum_scalar(&accv[i], &sampv[i], n - i);
+}
+
+
+__attribute__((target("sse2")))
+static void minus_sse2(int16_t *outv, const int32_t *accv,
+		       const int16_t *sampv, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+
+		const __m128i s = _mm_loadu_si128((const __m128i *)&sampv[i]);
+		__m128i a0 = _mm_loadu_si128((const __m128i *)&accv[i]);
+		__m128i a1 = _mm_loadu_si128((const __m128i *)&accv[i+4]);
+
+		a0 = _mm_sub_epi32(a0, sext_lo(s));
+		a1 = _mm_sub_epi32(a1, sext_hi(s));
+
+		_mm_storeu_si128((__m128i *)&outv[i], _mm_packs_epi32(a0, a1));
+	}
+
+	minus_scalar(&outv[i], &accv[i], &sampv[i], n - i);
+}
+
+
+__attribute__((target("sse2")))
+static void accumf_sse2(float *accv, const float *sampv, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+4<=n; i+=4) {
+
+		const __m128 s = _mm_loadu_ps(&sampv[i]);
+
+		_mm_storeu_ps(&accv[i], _mm_add_ps(_mm_loadu_ps(&accv[i]), s));
+	}
+
+	accumf_scalar(&accv[i], &sampv[i], n - i);
+}
+
+
+__attribute__((target("sse2")))
+static void minusf_sse2(float *outv, const float *accv,
+			const float *sampv, size_t n)
+{
+	const __m128 hi = _mm_set1_ps(1.0f), lo = _mm_set1_ps(-1.0f);
+	size_t i;
+
+	for (i=0; i+4<=n; i+=4) {
+
+		__m128 v = _mm_sub_ps(_mm_loadu_ps(&accv[i]),
+				      _mm_loadu_ps(&sampv[i]));
+
+		v = _mm_min_ps(hi, _mm_max_ps(lo, v));
+
+		_mm_storeu_ps(&outv[i], v);
+	}
+
+	minusf_scalar(&outv[i], &accv[i], &sampv[i], n - i);
+}
+
+
+static const struct aumix_kernel kernel_sse2 = {
+	"sse2", load_sse2, accum_sse2, minus_sse2,
+	accumf_sse2, minusf_sse2
+};
+
+
+__attribute__((target("avx2")))
+static void load_avx2(int32_t *accv, const int16_t *sampv, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+
+		const __m128i s = _mm_loadu_si128((const __m128i *)&sampv[i]);
+
+		_mm256_storeu_si256((__m256i *)&accv[i],
+				    _mm256_cvtepi16_epi32(s));
+	}
+
+	load_scalar(&accv[i], &sampv[i], n - i);
+}
+
+
+__attribute__((target("avx2")))
+static void accum_avx2(int32_t *accv, const int16_t *sampv, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+16<=n; i+=16) {
+
+		const __m128i s0 = _mm_loadu_si128((const __m128i *)&sampv[i]);
+		const __m128i s1 = _mm_loadu_si128((const __m128i *)
+						   &sampv[i+8]);
+		__m256i a0 = _mm256_loadu_si256((__m256i *)&accv[i]);
+		__m256i a1 = _mm256_loadu_si256((__m256i *)&accv[i+8]);
+
+		a0 = _mm256_add_epi32(a0, _mm256_cvtepi16_epi32(s0));
+		a1 = _mm256_add_epi32(a1, _mm256_cvtepi16_epi32(s1));
+
+		_mm256_storeu_si256((__m256i *)&accv[i],   a0);
+		_mm256_storeu_si256((__m256i *)&accv[i+8], a1);
+	}
+
+	accum_scalar(&accv[i], &sampv[i], n - i);
+}
+
+
+__attribute__((target("avx2")))
+static void minus_avx2(int16_t *outv, const int32_t *accv,
+		       const int16_t *sampv, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+16<=n; i+=16) {
+
+		const __m128i s0 = _mm_loadu_si128((const __m128i *)&sampv[i]);
+		const __m128i s1 = _mm_loadu_si128((const __m128i *)
+						   &sampv[i+8]);
+		__m256i a0 = _mm256_loadu_si256((const __m256i *)&accv[i]);
+		__m256i a1 = _mm256_loadu_si256((const __m256i *)&accv[i+8]);
+		__m256i r;
+
+		a0 = _mm256_sub_epi32(a0, _mm256_cvtepi16_epi32(s0));
+		a1 = _mm256_sub_epi32(a1, _mm256_cvtepi16_epi32(s1));
+
+		/* packs works per 128-bit lane, restore the sample order */
+		r = _mm256_packs_epi32(a0, a1);
+		r = _mm256_permute4x64_epi64(r, 0xd8);
+
+		_mm256_storeu_si256((__m256i *)&outv[i], r);
+	}
+
+	minus_scalar(&outv[i], &accv[i], &sampv[i], n - i);
+}
+
+
+__attribute__((target("avx2")))
+static void accumf_avx2(float *accv, const float *sampv, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+
+		const __m256 s = _mm256_loadu_ps(&sampv[i]);
+
+		_mm256_storeu_ps(&accv[i],
+				 _mm256_add_ps(_mm256_loadu_ps(&accv[i]), s));
+	}
+
+	accumf_scalar(&accv[i], &sampv[i], n - i);
+}
+
+
+__attribute__((target("avx2")))
+static void minusf_avx2(float *outv, const float *accv,
+			const float *sampv, size_t n)
+{
+	const __m256 hi = _mm256_set1_ps(1.0f), lo = _mm256_set1_ps(-1.0f);
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+
+		__m256 v = _mm256_sub_ps(_mm256_loadu_ps(&accv[i]),
+					 _mm256_loadu_ps(&sampv[i]));
+
+		v = _mm256_min_ps(hi, _mm256_max_ps(lo, v));
+
+		_mm256_storeu_ps(&outv[i], v);
+	}
+
+	minusf_scalar(&outv[i], &accv[i], &sampv[i], n - i);
+}
+
+
+static const struct aumix_kernel kernel_avx2 = {
+	"avx2", load_avx2, accum_avx2, minus_avx2,
+	accumf_avx2, minusf_avx2
+};
+
+#endif
+
+
+#ifdef HAVE_NEON
+
+static void load_neon(int32_t *accv, const int16_t *sampv, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+
+		const int16x8_t s = vld1q_s16(&sampv[i]);
+
+		vst1q_s32(&accv[i],   vmovl_s16(vget_low_s16(s)));
+		vst1q_s32(&accv[i+4], vmovl_s16(vget_high_s16(s)));
+	}
+
+	load_scalar(&accv[i], &sampv[i], n - i);
+}
+
+
+static void accum_neon(int32_t *accv, const int16_t *sampv, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+
+		const int16x8_t s = vld1q_s16(&sampv[i]);
+		int32x4_t a0 = vld1q_s32(&accv[i]);
+		int32x4_t a1 = vld1q_s32(&accv[i+4]);
+
+		a0 = vaddw_s16(a0, vget_low_s16(s));
+		a1 = vaddw_s16(a1, vget_high_s16(s));
+
+		vst1q_s32(&accv[i],   a0);
+		vst1q_s32(&accv[i+4], a1);
+	}
+
+	accum_scalar(&accv[i], &sampv[i], n - i);
+}
+
+
+static void minus_neon(int16_t *outv, const int32_t *accv,
+		       const int16_t *sampv, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+
+		const int16x8_t s = vld1q_s16(&sampv[i]);
+		int32x4_t a0 = vld1q_s32(&accv[i]);
+		int32x4_t a1 = vld1q_s32(&accv[i+4]);
+
+		a0 = vsubw_s16(a0, vget_low_s16(s));
+		a1 = vsubw_s16(a1, vget_high_s16(s));
+
+		vst1q_s16(&outv[i], vcombine_s16(vqmovn_s32(a0),
+						 vqmovn_s32(a1)));
+	}
+
+	minus_scalar(&outv[i], &accv[i], &sampv[i], n - i);
+}
+
+
+static void accumf_neon(float *accv, const float *sampv, size_t n)
+{
+	size_t i;
+
+	for (i=0; i+4<=n; i+=4)
+		vst1q_f32(&accv[i], vaddq_f32(vld1q_f32(&accv[i]),
+					      vld1q_f32(&sampv[i])));
+
+	accumf_scalar(&accv[i], &sampv[i], n - i);
+}
+
+
+static void minusf_neon(float *outv, const float *accv,
+			const float *sampv, size_t n)
+{
+	const float32x4_t hi = vdupq_n_f32(1.0f), lo = vdupq_n_f32(-1.0f);
+	size_t i;
+
+	for (i=0; i+4<=n; i+=4) {
+
+		float32x4_t v = vsubq_f32(vld1q_f32(&accv[i]),
+					  vld1q_f32(&sampv[i]));
+
+		vst1q_f32(&outv[i], vminq_f32(hi, vmaxq_f32(lo, v)));
+	}
+
+	minusf_scalar(&outv[i], &accv[i], &sampv[i], n - i);
+}
+
+
+static const struct aumix_kernel kernel_neon = {
+	"neon", load_neon, accum_neon, minus_neon,
+	accumf_neon, minusf_neon
+};
+
+#endif
+
+
+/**
+ * Get a set of mixing kernels supported by the running CPU
+ *
+ * @param i Index of the kernel set, 0 is the fastest
+ *
+ * @return Mixing kernels, or NULL if there are no more kernel sets. The
+ *         last set is aumix_kernel_scalar.
+ */
+const struct aumix_kernel *aumix_kernel_get(unsigned i)
+{
+	const struct aumix_kernel *kv[4];
+	unsigned n = 0;
+
+#ifdef USE_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		kv[n++] = &kernel_avx2;
+
+	if (__builtin_cpu_supports("sse2"))
+		kv[n++] = &kernel_sse2;
+#endif
+
+#ifdef HAVE_NEON
+	kv[n++] = &kernel_neon;
+#endif
+
+	kv[n++] = &aumix_kernel_scalar;
+
+	return i < n ? kv[i] : NULL;
+}
+
+
+/**
+ * Select the fastest mixing kernels supported by the running CPU
+ *
+ * @return Mixing kernels
+ */
+const struct aumix_kernel *aumix_kernel_select(void)
+{
+	return aumix_kernel_get(0);
+}
@@ -5,3 +5,6 @@
 #
 
 SRCS	+= aumix/aumix.c
+SRCS	+= aumix/kernel.c
+SRCS	+= aumix/engine.c
+SRCS	+= aumix/prompt.c
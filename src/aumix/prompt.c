@@ -0,0 +1,362 @@
+/**
+ * @file prompt.c  Audio Mixer -- shared cache of decoded prompts
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <string.h>
+#include <re.h>
+#include <rem_au.h>
+#include <rem_aufile.h>
+#include <rem_g711.h>
+#include <rem_fir.h>
+#include <rem_auresamp.h>
+#include <rem_aumix.h>
+#include "aumix.h"
+
+
+/*
+ * Prompts are decoded once into S16 PCM in the mixer format, and shared
+ * by all mixers playing them. The cache holds a reference to each
+ * prompt until the file changes, until it is evicted as the least
+ * recently used prompt when the cache is full, or until
+ * aumix_prompt_flush() is called.
+ *
+ * All references to prompts are taken and released with the cache lock
+ * held, since the mixer threads release them as well.
+ */
+
+enum {
+	PROMPT_CACHE_SZ = 16 * 1024 * 1024,  /**< Cache size in [bytes]   */
+	PROMPT_TAIL     = 128,  /**< Input frames flushed from resampler */
+};
+
+static pthread_mutex_t prompt_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct list promptl;
+static size_t prompt_sz;
+
+
+static void destructor(void *arg)
+{
+	struct aumix_prompt *p = arg;
+
+	list_unlink(&p->le);
+	mem_deref(p->path);
+	mem_deref(p->sampv);
+}
+
+
+static int read_file(struct mbuf *mb, struct aufile_prm *prm,
+		     const char *filepath)
+{
+	struct aufile *af;
+	uint8_t buf[4096];
+	int err;
+
+	err = aufile_open(&af, prm, filepath, AUFILE_READ);
+	if (err)
+		return err;
+
+	for (;;) {
+		size_t n = sizeof(buf);
+		size_t i;
+
+		err = aufile_read(af, buf, &n);
+		if (err || !n)
+			break;
+
+		switch (prm->fmt) {
+
+		case AUFMT_S16LE:
+			err = mbuf_write_mem(mb, buf, n);
+			break;
+
+		case AUFMT_PCMA:
+			for (i=0; i<n && !err; i++) {
+				const int16_t s = g711_alaw2pcm(buf[i]);
+
+				err = mbuf_write_mem(mb, (const uint8_t *)&s,
+						     sizeof(s));
+			}
+			break;
+
+		case AUFMT_PCMU:
+			for (i=0; i<n && !err; i++) {
+				const int16_t s = g711_ulaw2pcm(buf[i]);
+
+				err = mbuf_write_mem(mb, (const uint8_t *)&s,
+						     sizeof(s));
+			}
+			break;
+
+		default:
+			err = ENOTSUP;
+			break;
+		}
+
+		if (err)
+			break;
+	}
+
+	mem_deref(af);
+
+	return err;
+}
+
+
+static int prompt_load(struct aumix_prompt **pp, const char *filepath,
+		       const struct stat *st, uint32_t srate, uint8_t ch)
+{
+	struct aumix_prompt *p = NULL;
+	struct aufile_prm prm;
+	struct mbuf *mb;
+	const int16_t *inv;
+	size_t inc;
+	int err;
+
+	mb = mbuf_alloc(65536);
+	if (!mb)
+		return ENOMEM;
+
+	err = read_file(mb, &prm, filepath);
+	if (err)
+		goto out;
+
+	p = mem_zalloc(sizeof(*p), destructor);
+	if (!p) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	p->srate = srate;
+	p->ch    = ch;
+	p->mtime = (int64_t)st->st_mtime;
+	p->fsize = (int64_t)st->st_size;
+
+	err = str_dup(&p->path, filepath);
+	if (err)
+		goto out;
+
+	inv = (const int16_t *)mb->buf;
+	inc = mb->end / 2;
+
+	if (prm.srate == srate && prm.channels == ch) {
+
+		p->sampv = mem_alloc(inc * 2, NULL);
+		if (!p->sampv) {
+			err = ENOMEM;
+			goto out;
+		}
+
+		memcpy(p->sampv, inv, inc * 2);
+		p->sampc = inc;
+	}
+	else {
+		struct auresamp rs;
+		size_t outc, tailc;
+
+		auresamp_init(&rs);
+
+		err = auresamp_setup(&rs, prm.srate, prm.channels,
+				     srate, ch);
+		if (err)
+			goto out;
+
+		/* whole frames, divisible by the downsampling ratio */
+		if (!rs.up)
+			inc -= inc % (rs.ratio * prm.channels);
+
+		/* silence to flush the end of the prompt out of the filter */
+		tailc = PROMPT_TAIL + rs.ratio - 1;
+		tailc = (rs.up ? PROMPT_TAIL : tailc - tailc % rs.ratio) *
+			prm.channels;
+
+		mb->pos = inc * 2;
+		err = mbuf_fill(mb, 0, tailc * 2);
+		if (err) {
+			auresamp_reset(&rs);
+			goto out;
+		}
+
+		inv  = (const int16_t *)mb->buf;
+		inc += tailc;
+
+		outc = (size_t)((uint64_t)inc / prm.channels * srate /
+				prm.srate + 1) * ch;
+		outc = max(outc, inc);
+
+		p->sampv = mem_alloc(outc * 2, NULL);
+		if (p->sampv)
+			err = auresamp(&rs, p->sampv, &outc, inv, inc);
+		else
+			err = ENOMEM;
+
+		auresamp_reset(&rs);
+		if (err)
+			goto out;
+
+		p->sampc = outc;
+	}
+
+ out:
+	mem_deref(mb);
+
+	if (err)
+		mem_deref(p);
+	else
+		*pp = p;
+
+	return err;
+}
+
+
+/* Remove a prompt from the cache, with the lock held */
+static void prompt_evict(struct aumix_prompt *p)
+{
+	prompt_sz -= p->sampc * 2;
+	list_unlink(&p->le);
+	mem_deref(p);
+}
+
+
+static bool prompt_stale(const struct aumix_prompt *p,
+			 const struct stat *st)
+{
+	return p->mtime != (int64_t)st->st_mtime ||
+		p->fsize != (int64_t)st->st_size;
+}
+
+
+static struct aumix_prompt *prompt_find(const char *filepath,
+					uint32_t srate, uint8_t ch)
+{
+	struct le *le;
+
+	for (le=promptl.head; le; le=le->next) {
+
+		struct aumix_prompt *p = le->data;
+
+		if (p->srate == srate && p->ch == ch &&
+		    !str_cmp(p->path, filepath))
+			return p;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Get a decoded prompt from the cache, loading it if needed. A prompt
+ * is loaded again when the modification time or the size of the file
+ * has changed.
+ *
+ * @param pp       Pointer to referenced prompt
+ * @param filepath Filename of audio file with complete path
+ * @param srate    Sample rate of the mixer
+ * @param ch       Number of channels of the mixer
+ *
+ * @return 0 for success, otherwise error code
+ */
+int aumix_prompt_get(struct aumix_prompt **pp, const char *filepath,
+		     uint32_t srate, uint8_t ch)
+{
+	struct aumix_prompt *p, *np;
+	struct stat st;
+	int err;
+
+	if (!pp || !filepath)
+		return EINVAL;
+
+	if (stat(filepath, &st) < 0)
+		return errno;
+
+	pthread_mutex_lock(&prompt_lock);
+
+	p = prompt_find(filepath, srate, ch);
+	if (p && prompt_stale(p, &st)) {
+		prompt_evict(p);
+		p = NULL;
+	}
+
+	/* most recently used last */
+	if (p) {
+		list_unlink(&p->le);
+		list_append(&promptl, &p->le, p);
+	}
+
+	p = mem_ref(p);
+
+	pthread_mutex_unlock(&prompt_lock);
+
+	if (p) {
+		*pp = p;
+		return 0;
+	}
+
+	/* decode without holding the lock */
+	err = prompt_load(&np, filepath, &st, srate, ch);
+	if (err)
+		return err;
+
+	pthread_mutex_lock(&prompt_lock);
+
+	p = prompt_find(filepath, srate, ch);
+	if (p && prompt_stale(p, &st)) {
+		prompt_evict(p);
+		p = NULL;
+	}
+
+	if (p) {
+		mem_deref(np);
+	}
+	else {
+		p = np;
+		list_append(&promptl, &p->le, p);
+		prompt_sz += p->sampc * 2;
+
+		/* prompts that are playing are freed when they end */
+		while (prompt_sz > PROMPT_CACHE_SZ && promptl.head->data != p)
+			prompt_evict(promptl.head->data);
+	}
+
+	*pp = mem_ref(p);
+
+	pthread_mutex_unlock(&prompt_lock);
+
+	return 0;
+}
+
+
+/**
+ * Release a prompt reference
+ *
+ * @param p Prompt
+ *
+ * @return NULL
+ */
+void *aumix_prompt_put(struct aumix_prompt *p)
+{
+	if (!p)
+		return NULL;
+
+	pthread_mutex_lock(&prompt_lock);
+	mem_deref(p);
+	pthread_mutex_unlock(&prompt_lock);
+
+	return NULL;
+}
+
+
+/**
+ * Flush the prompt cache. Prompts that are currently playing are freed
+ * when they have finished.
+ */
+void aumix_prompt_flush(void)
+{
+	pthread_mutex_lock(&prompt_lock);
+	list_flush(&promptl);
+	prompt_sz = 0;
+	pthread_mutex_unlock(&prompt_lock);
+}
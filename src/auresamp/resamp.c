@@ -4,10 +4,56 @@
  * Copyright (C) 2010 Creytiv.com
  */
 
+#include <math.h>
 #include <string.h>
 #include <re.h>
 #include <rem_fir.h>
 #include <rem_auresamp.h>
+#include <rem_dsp.h>
+
+
+#if !defined (M_PI)
+#define M_PI 3.14159265358979323846264338327
+#endif
+
+enum {
+	POLY_ZC    = 12,     /**< Zero-crossings of the sinc on each side */
+	POLY_CHUNK = 128,    /**< Input frames copied per pass            */
+	POLY_TAPS  = 256,    /**< Maximum number of taps per phase        */
+	POLY_MAX   = 65536,  /**< Maximum size of the filter bank         */
+};
+
+#define POLY_CUTOFF 0.9  /**< Cutoff relative to the lower Nyquist    */
+#define POLY_BETA   8.0  /**< Kaiser window shape                     */
+
+
+/**
+ * Polyphase filter bank and state for rational resampling. The output
+ * is computed at L/M times the input rate; output n is at input
+ * position n*M/L and is filtered with phase (n*M mod L) of the bank.
+ */
+struct auresamp_bank {
+	int16_t *tapv;   /**< Filter taps, tapc per phase              */
+	int16_t *buf;    /**< Input frames not yet consumed            */
+	size_t tapc;     /**< Number of taps per phase                 */
+	size_t fill;     /**< Number of frames in buffer               */
+	uint32_t up;     /**< Interpolation factor L (number of phases) */
+	uint32_t down;   /**< Decimation factor M                      */
+	uint32_t phase;  /**< Phase of the next output                 */
+};
+
+
+/**
+ * State of the float path. The taps are the int16 taps scaled to 1.0,
+ * so that both paths have the same response. The position in the input
+ * is shared with the int16 path, so a resampler must only be used with
+ * one sample format until it is set up again.
+ */
+struct auresamp_fstate {
+	float *tapv;     /**< Filter taps, in the layout of the int16 taps */
+	float *buf;      /**< History, or input frames not yet consumed    */
+	unsigned index;  /**< History index, for integer ratios            */
+};
 
 
 /* 48kHz sample-rate, 4kHz cutoff (pass 0-3kHz, stop 5-24kHz) */
@@ -27,6 +73,47 @@ static const int16_t fir_48_8[] = {
 };
 
 
+/*
+ * Integer ratios, as polyphase filters so that only the output samples
+ * are computed. The filter runs on min(ich, och) channels: stereo input
+ * is mixed to mono before filtering, and mono output is duplicated to
+ * stereo after filtering. The history is kept in the FIR state.
+ */
+
+static inline unsigned filter_ch(const struct auresamp *rs)
+{
+	return min(rs->ich, rs->och);
+}
+
+
+static inline void hist_push(struct auresamp *rs, const int16_t *inv,
+			     unsigned mask)
+{
+	struct fir *fir = &rs->fir;
+
+	if (rs->ich == 2 && rs->och == 1) {
+		fir->history[fir->index++ & mask] = inv[0]/2 + inv[1]/2;
+	}
+	else {
+		unsigned c;
+
+		for (c=0; c<rs->ich; c++)
+			fir->history[fir->index++ & mask] = inv[c];
+	}
+}
+
+
+static inline int16_t filter_out(int64_t acc)
+{
+	if (acc > 0x3fffffff)
+		acc = 0x3fffffff;
+	else if (acc < -0x40000000)
+		acc = -0x40000000;
+
+	return (int16_t)(acc>>15);
+}
+
+
 static void upsample_mono2mono(int16_t *outv, const int16_t *inv,
 			       size_t inc, unsigned ratio)
 {
@@ -155,10 +242,560 @@ static void downsample_stereo2stereo(int16_t *outv, const int16_t *inv,
 }
 
 
+/*
+ * The resample handler of a configured resampler, as before the
+ * filters were merged into the resampling. The handler does not
+ * filter; auresamp() uses it only for channel conversion at the same
+ * rate.
+ */
+static auresamp_h *resample_handler(bool up, unsigned ich, unsigned och)
+{
+	if (up) {
+		if (ich == 1)
+			return och == 1 ? upsample_mono2mono
+				: upsample_mono2stereo;
+		else
+			return och == 1 ? upsample_stereo2mono
+				: upsample_stereo2stereo;
+	}
+	else {
+		if (ich == 1)
+			return och == 1 ? downsample_mono2mono
+				: downsample_mono2stereo;
+		else
+			return och == 1 ? downsample_stereo2mono
+				: downsample_stereo2stereo;
+	}
+}
+
+
+/*
+ * Interpolation: output phase p of input n is the zero-stuffed signal
+ * filtered with taps p, p+R, p+2R, ..., scaled by R for the lost energy
+ */
+static void upsample(struct auresamp *rs, int16_t *outv, const int16_t *inv,
+		     size_t inc)
+{
+	const unsigned fch = filter_ch(rs);
+	const unsigned mask = fch * (unsigned)rs->tapc - 1;
+	const int16_t *history = rs->fir.history;
+
+	while (inc >= rs->ich) {
+
+		unsigned p, c;
+
+		hist_push(rs, inv, mask);
+
+		inv += rs->ich;
+		inc -= rs->ich;
+
+		for (p=0; p<rs->ratio; p++) {
+
+			for (c=0; c<fch; c++) {
+
+				unsigned i, j = rs->fir.index - fch + c;
+				int64_t acc = 0;
+
+				for (i=p; i<rs->tapc; i+=rs->ratio, j-=fch)
+					acc += (int64_t)history[j & mask] *
+						rs->tapv[i];
+
+				*outv++ = filter_out(acc * rs->ratio);
+			}
+
+			if (rs->och > fch) {
+				*outv = outv[-1];
+				++outv;
+			}
+		}
+	}
+}
+
+
+/* Decimation: filter only every R-th input, the rest is just stored */
+static void downsample(struct auresamp *rs, int16_t *outv,
+		       const int16_t *inv, size_t inc)
+{
+	const unsigned fch = filter_ch(rs);
+	const unsigned mask = fch * (unsigned)rs->tapc - 1;
+	const int16_t *history = rs->fir.history;
+	unsigned n = 0;
+
+	while (inc >= rs->ich) {
+
+		unsigned c;
+
+		hist_push(rs, inv, mask);
+
+		inv += rs->ich;
+		inc -= rs->ich;
+
+		if (n++ % rs->ratio)
+			continue;
+
+		for (c=0; c<fch; c++) {
+
+			unsigned i, j = rs->fir.index - fch + c;
+			int64_t acc = 0;
+
+			for (i=0; i<rs->tapc; i++, j-=fch) {
+				acc += (int64_t)history[j & mask] *
+					rs->tapv[i];
+			}
+
+			*outv++ = filter_out(acc);
+		}
+
+		if (rs->och > fch) {
+			*outv = outv[-1];
+			++outv;
+		}
+	}
+}
+
+
+static inline void hist_push_float(struct auresamp *rs, const float *inv,
+				   unsigned mask)
+{
+	struct auresamp_fstate *fst = rs->fst;
+
+	if (rs->ich == 2 && rs->och == 1) {
+		fst->buf[fst->index++ & mask] = (inv[0] + inv[1]) * 0.5f;
+	}
+	else {
+		unsigned c;
+
+		for (c=0; c<rs->ich; c++)
+			fst->buf[fst->index++ & mask] = inv[c];
+	}
+}
+
+
+static void upsample_float(struct auresamp *rs, float *outv, const float *inv,
+			   size_t inc)
+{
+	const unsigned fch = filter_ch(rs);
+	const unsigned mask = fch * (unsigned)rs->tapc - 1;
+	const float *history = rs->fst->buf;
+	const float *tapv = rs->fst->tapv;
+
+	while (inc >= rs->ich) {
+
+		unsigned p, c;
+
+		/* same rate, channel conversion only */
+		if (!rs->tapc) {
+			if (rs->ich == 2 && rs->och == 1) {
+				*outv++ = (inv[0] + inv[1]) * 0.5f;
+			}
+			else {
+				*outv++ = inv[0];
+				*outv++ = inv[0];
+			}
+
+			inv += rs->ich;
+			inc -= rs->ich;
+			continue;
+		}
+
+		hist_push_float(rs, inv, mask);
+
+		inv += rs->ich;
+		inc -= rs->ich;
+
+		for (p=0; p<rs->ratio; p++) {
+
+			for (c=0; c<fch; c++) {
+
+				unsigned i, j = rs->fst->index - fch + c;
+				float acc = 0;
+
+				for (i=p; i<rs->tapc; i+=rs->ratio, j-=fch)
+					acc += history[j & mask] * tapv[i];
+
+				*outv++ = acc * (float)rs->ratio;
+			}
+
+			if (rs->och > fch) {
+				*outv = outv[-1];
+				++outv;
+			}
+		}
+	}
+}
+
+
+static void downsample_float(struct auresamp *rs, float *outv,
+			     const float *inv, size_t inc)
+{
+	const unsigned fch = filter_ch(rs);
+	const unsigned mask = fch * (unsigned)rs->tapc - 1;
+	const float *history = rs->fst->buf;
+	const float *tapv = rs->fst->tapv;
+	unsigned n = 0;
+
+	while (inc >= rs->ich) {
+
+		unsigned c;
+
+		hist_push_float(rs, inv, mask);
+
+		inv += rs->ich;
+		inc -= rs->ich;
+
+		if (n++ % rs->ratio)
+			continue;
+
+		for (c=0; c<fch; c++) {
+
+			unsigned i, j = rs->fst->index - fch + c;
+			float acc = 0;
+
+			for (i=0; i<rs->tapc; i++, j-=fch)
+				acc += history[j & mask] * tapv[i];
+
+			*outv++ = acc;
+		}
+
+		if (rs->och > fch) {
+			*outv = outv[-1];
+			++outv;
+		}
+	}
+}
+
+
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+	while (b) {
+		const uint32_t t = a % b;
+
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+
+/* Zeroth-order modified Bessel function of the first kind */
+static double bessel_i0(double x)
+{
+	double sum = 1.0, term = 1.0;
+	int k;
+
+	for (k=1; k<32; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum  += term;
+	}
+
+	return sum;
+}
+
+
+/* Kaiser-windowed sinc, u in zero-crossings */
+static double sinc_kaiser(double u)
+{
+	const double x = u / POLY_ZC;
+
+	if (fabs(x) >= 1.0)
+		return 0.0;
+
+	if (u == 0.0)
+		return 1.0;
+
+	return sin(M_PI * u) / (M_PI * u) *
+		bessel_i0(POLY_BETA * sqrt(1.0 - x * x)) /
+		bessel_i0(POLY_BETA);
+}
+
+
+static void bank_destructor(void *arg)
+{
+	struct auresamp_bank *bank = arg;
+
+	mem_deref(bank->tapv);
+	mem_deref(bank->buf);
+}
+
+
+/*
+ * Design the filter bank for resampling by up/down, with the cutoff
+ * below the Nyquist frequency of the lower of the two rates.
+ */
+static int bank_alloc(struct auresamp_bank **bankp, uint32_t up,
+		      uint32_t down, unsigned ch)
+{
+	struct auresamp_bank *bank;
+	const double scale = POLY_CUTOFF * (up < down ? (double)up / down : 1);
+	const double span = ceil(2 * POLY_ZC / scale);
+	size_t tapc, p, k;
+	int err = 0;
+
+	tapc = (size_t)span;
+	tapc += tapc & 1;
+
+	if (tapc > POLY_TAPS || (size_t)up * tapc > POLY_MAX)
+		return ENOTSUP;
+
+	bank = mem_zalloc(sizeof(*bank), bank_destructor);
+	if (!bank)
+		return ENOMEM;
+
+	bank->tapv = mem_alloc(up * tapc * sizeof(int16_t), NULL);
+	bank->buf  = mem_zalloc((tapc - 1 + POLY_CHUNK) * ch *
+				sizeof(int16_t), NULL);
+	if (!bank->tapv || !bank->buf) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (p=0; p<up; p++) {
+
+		int16_t *tapv = &bank->tapv[p * tapc];
+		double h[POLY_TAPS], sum = 0.0;
+
+		for (k=0; k<tapc; k++) {
+
+			const double d = (double)k - (double)(tapc / 2 - 1) -
+				(double)p / up;
+
+			h[k] = sinc_kaiser(d * scale);
+			sum += h[k];
+		}
+
+		for (k=0; k<tapc; k++)
+			tapv[k] = (int16_t)lrint(h[k] / sum * 32767.0);
+	}
+
+	bank->tapc  = tapc;
+	bank->up    = up;
+	bank->down  = down;
+	bank->fill  = tapc - 1;
+
+ out:
+	if (err)
+		mem_deref(bank);
+	else
+		*bankp = bank;
+
+	return err;
+}
+
+
+/* Number of output frames for the given number of new input frames */
+static size_t poly_outcount(const struct auresamp_bank *bank, size_t incc)
+{
+	const uint64_t avail = bank->fill + incc;
+	uint64_t num;
+
+	if (avail < bank->tapc)
+		return 0;
+
+	num = (avail - bank->tapc + 1) * bank->up - bank->phase;
+
+	return (size_t)((num + bank->down - 1) / bank->down);
+}
+
+
+static int16_t *poly_process(struct auresamp_bank *bank, int16_t *outv,
+			     unsigned och, const int16_t *x, unsigned ich)
+{
+	const int16_t *tapv = &bank->tapv[bank->phase * bank->tapc];
+	int32_t acc0 = 0, acc1 = 0;
+	size_t k;
+
+	if (ich == 1) {
+		for (k=0; k<bank->tapc; k++)
+			acc0 += (int32_t)x[k] * tapv[k];
+
+		acc1 = acc0;
+	}
+	else {
+		for (k=0; k<bank->tapc; k++) {
+			acc0 += (int32_t)x[2*k]   * tapv[k];
+			acc1 += (int32_t)x[2*k+1] * tapv[k];
+		}
+	}
+
+	if (och == 1) {
+		*outv++ = saturate_s16(((acc0 >> 1) + (acc1 >> 1)) >> 15);
+	}
+	else {
+		*outv++ = saturate_s16(acc0 >> 15);
+		*outv++ = saturate_s16(acc1 >> 15);
+	}
+
+	return outv;
+}
+
+
+static void poly_resample(struct auresamp *rs, int16_t *outv,
+			  const int16_t *inv, size_t inc)
+{
+	struct auresamp_bank *bank = rs->bank;
+	const size_t cap = bank->tapc - 1 + POLY_CHUNK;
+	const unsigned ich = rs->ich;
+	size_t incc = inc / ich;
+
+	while (incc) {
+
+		const size_t n = min(incc, cap - bank->fill);
+		size_t i = 0;
+
+		memcpy(&bank->buf[bank->fill * ich], inv,
+		       n * ich * sizeof(int16_t));
+		bank->fill += n;
+		inv  += n * ich;
+		incc -= n;
+
+		while (i + bank->tapc <= bank->fill) {
+
+			outv = poly_process(bank, outv, rs->och,
+					    &bank->buf[i * ich], ich);
+
+			bank->phase += bank->down;
+			i += bank->phase / bank->up;
+			bank->phase %= bank->up;
+		}
+
+		memmove(bank->buf, &bank->buf[i * ich],
+			(bank->fill - i) * ich * sizeof(int16_t));
+		bank->fill -= i;
+	}
+}
+
+
+static float *poly_process_float(const struct auresamp_bank *bank,
+				 const float *tapv, float *outv, unsigned och,
+				 const float *x, unsigned ich)
+{
+	float acc0 = 0, acc1 = 0;
+	size_t k;
+
+	tapv += bank->phase * bank->tapc;
+
+	if (ich == 1) {
+		for (k=0; k<bank->tapc; k++)
+			acc0 += x[k] * tapv[k];
+
+		acc1 = acc0;
+	}
+	else {
+		for (k=0; k<bank->tapc; k++) {
+			acc0 += x[2*k]   * tapv[k];
+			acc1 += x[2*k+1] * tapv[k];
+		}
+	}
+
+	if (och == 1) {
+		*outv++ = (acc0 + acc1) * 0.5f;
+	}
+	else {
+		*outv++ = acc0;
+		*outv++ = acc1;
+	}
+
+	return outv;
+}
+
+
+static void poly_resample_float(struct auresamp *rs, float *outv,
+				const float *inv, size_t inc)
+{
+	struct auresamp_bank *bank = rs->bank;
+	struct auresamp_fstate *fst = rs->fst;
+	const size_t cap = bank->tapc - 1 + POLY_CHUNK;
+	const unsigned ich = rs->ich;
+	size_t incc = inc / ich;
+
+	while (incc) {
+
+		const size_t n = min(incc, cap - bank->fill);
+		size_t i = 0;
+
+		memcpy(&fst->buf[bank->fill * ich], inv,
+		       n * ich * sizeof(float));
+		bank->fill += n;
+		inv  += n * ich;
+		incc -= n;
+
+		while (i + bank->tapc <= bank->fill) {
+
+			outv = poly_process_float(bank, fst->tapv, outv,
+						  rs->och,
+						  &fst->buf[i * ich], ich);
+
+			bank->phase += bank->down;
+			i += bank->phase / bank->up;
+			bank->phase %= bank->up;
+		}
+
+		memmove(fst->buf, &fst->buf[i * ich],
+			(bank->fill - i) * ich * sizeof(float));
+		bank->fill -= i;
+	}
+}
+
+
+static void fstate_destructor(void *arg)
+{
+	struct auresamp_fstate *fst = arg;
+
+	mem_deref(fst->tapv);
+	mem_deref(fst->buf);
+}
+
+
+static int fstate_alloc(struct auresamp *rs)
+{
+	struct auresamp_fstate *fst;
+	const int16_t *tapv;
+	size_t tapc, bufc, i;
+	int err = 0;
+
+	if (rs->bank) {
+		tapv = rs->bank->tapv;
+		tapc = rs->bank->up * rs->bank->tapc;
+		bufc = (rs->bank->tapc - 1 + POLY_CHUNK) * rs->ich;
+	}
+	else {
+		tapv = rs->tapv;
+		tapc = rs->tapc;
+		bufc = filter_ch(rs) * rs->tapc;
+	}
+
+	fst = mem_zalloc(sizeof(*fst), fstate_destructor);
+	if (!fst)
+		return ENOMEM;
+
+	fst->tapv = mem_alloc(max(tapc, 1) * sizeof(float), NULL);
+	fst->buf  = mem_zalloc(max(bufc, 1) * sizeof(float), NULL);
+	if (!fst->tapv || !fst->buf) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i=0; i<tapc; i++)
+		fst->tapv[i] = tapv[i] / 32768.0f;
+
+ out:
+	if (err)
+		mem_deref(fst);
+	else
+		rs->fst = fst;
+
+	return err;
+}
+
+
 /**
  * Initialize a resampler object
  *
  * @param rs Resampler to initialize
+ *
+ * @note A resampler that has been set up may hold memory, so it must be
+ *       released with auresamp_reset() instead
  */
 void auresamp_init(struct auresamp *rs)
 {
@@ -170,10 +807,51 @@ void auresamp_init(struct auresamp *rs)
 }
 
 
+/**
+ * Reset a resampler object, and free the memory it holds
+ *
+ * @param rs Resampler to reset
+ */
+void auresamp_reset(struct auresamp *rs)
+{
+	if (!rs)
+		return;
+
+	mem_deref(rs->bank);
+	mem_deref(rs->fst);
+	auresamp_init(rs);
+}
+
+
+static int setup_rational(struct auresamp *rs, uint32_t irate, unsigned ich,
+			  uint32_t orate, unsigned och)
+{
+	const uint32_t g = gcd(irate, orate);
+	struct auresamp_bank *bank;
+	int err;
+
+	err = bank_alloc(&bank, orate / g, irate / g, ich);
+	if (err)
+		return err;
+
+	auresamp_reset(rs);
+
+	rs->bank  = bank;
+	rs->ratio = 1;
+	rs->up    = orate > irate;
+	rs->resample = resample_handler(rs->up, ich, och);
+
+	return 0;
+}
+
+
 /**
  * Configure a resampler object
  *
- * @note The sample rate ratio must be an integer
+ * Integer ratios use the fixed FIR filters. Other ratios use a
+ * polyphase filter bank for the reduced ratio L/M, designed here, which
+ * is freed with auresamp_reset(). Setting up a resampler again with the
+ * same rates and channels keeps its filter and history.
  *
  * @param rs    Resampler
  * @param irate Input sample rate
@@ -186,32 +864,42 @@ void auresamp_init(struct auresamp *rs)
 int auresamp_setup(struct auresamp *rs, uint32_t irate, unsigned ich,
 		   uint32_t orate, unsigned och)
 {
+	int err;
+
 	if (!rs || !irate || !ich || !orate || !och)
 		return EINVAL;
 
 	if (orate == irate && och == ich) {
-		auresamp_init(rs);
+		auresamp_reset(rs);
 		return 0;
 	}
 
-	if (orate >= irate) {
+	if (ich > 2 || och > 2)
+		return ENOTSUP;
 
-		if (orate % irate)
-			return ENOTSUP;
-
-		if (ich == 1 && och == 1)
-			rs->resample = upsample_mono2mono;
-		else if (ich == 1 && och == 2)
-			rs->resample = upsample_mono2stereo;
-		else if (ich == 2 && och == 1)
-			rs->resample = upsample_stereo2mono;
-		else if (ich == 2 && och == 2)
-			rs->resample = upsample_stereo2stereo;
-		else
-			return ENOTSUP;
+	/* nothing changed, keep the filter bank and the history */
+	if (rs->ratio && orate == rs->orate && irate == rs->irate &&
+	    och == rs->och && ich == rs->ich)
+		return 0;
+
+	if (orate % irate && irate % orate) {
+		err = setup_rational(rs, irate, ich, orate, och);
+		if (err)
+			return err;
+
+		goto out;
+	}
 
-		if (!rs->up || orate != rs->orate || och != rs->och)
-			fir_reset(&rs->fir);
+	if (rs->bank || rs->up != (orate >= irate) || orate != rs->orate ||
+	    irate != rs->irate || och != rs->och || ich != rs->ich) {
+		fir_reset(&rs->fir);
+		rs->fst = mem_deref(rs->fst);
+	}
+
+	rs->bank     = mem_deref(rs->bank);
+	rs->resample = resample_handler(orate >= irate, ich, och);
+
+	if (orate >= irate) {
 
 		rs->ratio = orate / irate;
 		rs->up    = true;
@@ -230,23 +918,6 @@ int auresamp_setup(struct auresamp *rs, uint32_t irate, unsigned ich,
 		}
 	}
 	else {
-		if (irate % orate)
-			return ENOTSUP;
-
-		if (ich == 1 && och == 1)
-			rs->resample = downsample_mono2mono;
-		else if (ich == 1 && och == 2)
-			rs->resample = downsample_mono2stereo;
-		else if (ich == 2 && och == 1)
-			rs->resample = downsample_stereo2mono;
-		else if (ich == 2 && och == 2)
-			rs->resample = downsample_stereo2stereo;
-		else
-			return ENOTSUP;
-
-		if (rs->up || irate != rs->irate || ich != rs->ich)
-			fir_reset(&rs->fir);
-
 		rs->ratio = irate / orate;
 		rs->up    = false;
 
@@ -260,6 +931,7 @@ int auresamp_setup(struct auresamp *rs, uint32_t irate, unsigned ich,
 		}
 	}
 
+ out:
 	rs->orate = orate;
 	rs->och   = och;
 	rs->irate = irate;
@@ -269,10 +941,26 @@ int auresamp_setup(struct auresamp *rs, uint32_t irate, unsigned ich,
 }
 
 
+/* Number of output frames for inc input samples */
+static size_t out_frames(const struct auresamp *rs, size_t inc)
+{
+	const size_t incc = inc / rs->ich;
+
+	if (rs->bank)
+		return poly_outcount(rs->bank, incc);
+	else if (rs->up)
+		return incc * rs->ratio;
+	else
+		return incc / rs->ratio;
+}
+
+
 /**
  * Resample
  *
- * @note When downsampling, the input count must be divisible by rate ratio
+ * @note When downsampling by an integer ratio, the input count must be
+ *       divisible by the ratio. With other ratios the number of output
+ *       samples varies by one frame between calls.
  *
  * @param rs   Resampler
  * @param outv Output samples
@@ -285,40 +973,73 @@ int auresamp_setup(struct auresamp *rs, uint32_t irate, unsigned ich,
 int auresamp(struct auresamp *rs, int16_t *outv, size_t *outc,
 	     const int16_t *inv, size_t inc)
 {
-	size_t incc, outcc;
+	size_t outcc;
 
-	if (!rs || !rs->resample || !outv || !outc || !inv)
+	if (!rs || !rs->ratio || !outv || !outc || !inv)
 		return EINVAL;
 
-	incc = inc / rs->ich;
-
-	if (rs->up) {
-		outcc = incc * rs->ratio;
+	outcc = out_frames(rs, inc);
 
-		if (*outc < outcc * rs->och)
-			return ENOMEM;
+	if (*outc < outcc * rs->och)
+		return ENOMEM;
 
+	if (rs->bank)
+		poly_resample(rs, outv, inv, inc);
+	else if (!rs->tapc)
 		rs->resample(outv, inv, inc, rs->ratio);
+	else if (rs->up)
+		upsample(rs, outv, inv, inc);
+	else
+		downsample(rs, outv, inv, inc);
 
-		*outc = outcc * rs->och;
+	*outc = outcc * rs->och;
 
-		if (rs->tapv)
-			fir_filter(&rs->fir, outv, outv, *outc, rs->och,
-				   rs->tapv, rs->tapc);
-	}
-	else {
-		outcc = incc / rs->ratio;
+	return 0;
+}
 
-		if (*outc < outcc * rs->och || *outc < inc)
-			return ENOMEM;
 
-		fir_filter(&rs->fir, outv, inv, inc, rs->ich,
-			   rs->tapv, rs->tapc);
+/**
+ * Resample float samples
+ *
+ * The float path has the same filters and the same rules for the
+ * input count as auresamp(). The output is not clipped.
+ *
+ * @param rs   Resampler
+ * @param outv Output samples
+ * @param outc Output sample count (in/out)
+ * @param inv  Input samples
+ * @param inc  Input sample count
+ *
+ * @return 0 if success, otherwise error code
+ */
+int auresamp_float(struct auresamp *rs, float *outv, size_t *outc,
+		   const float *inv, size_t inc)
+{
+	size_t outcc;
+	int err;
 
-		rs->resample(outv, outv, inc, rs->ratio);
+	if (!rs || !rs->ratio || !outv || !outc || !inv)
+		return EINVAL;
 
-		*outc = outcc * rs->och;
+	outcc = out_frames(rs, inc);
+
+	if (*outc < outcc * rs->och)
+		return ENOMEM;
+
+	if (!rs->fst) {
+		err = fstate_alloc(rs);
+		if (err)
+			return err;
 	}
 
+	if (rs->bank)
+		poly_resample_float(rs, outv, inv, inc);
+	else if (rs->up)
+		upsample_float(rs, outv, inv, inc);
+	else
+		downsample_float(rs, outv, inv, inc);
+
+	*outc = outcc * rs->och;
+
 	return 0;
 }
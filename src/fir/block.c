@@ -0,0 +1,348 @@
+/**
+ * @file block.c FIR -- block based filtering
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <string.h>
+#include <re.h>
+#include <rem_fir.h>
+#include "fir.h"
+
+
+/*
+ * Each channel has a contiguous scratch area of [history | input], where
+ * the history is the last tapc - 1 samples of the previous call. A whole
+ * block of input is staged behind the history, every output sample is
+ * one dot product against the reversed taps, and the tail of the block
+ * is moved down as the history for the next call.
+ *
+ * There is no limit on the number of taps or channels.
+ *
+ * Long filters use FFT convolution on the same scratch instead, with
+ * one convolver for each pair of channels, and the block size of the
+ * call that allocated the scratch. Calls that are not a multiple of
+ * that block size are filtered in direct form, after which the
+ * convolvers resynchronize from the history.
+ */
+
+enum {
+	FFT_MIN_TAPS  = 64,  /* direct form below this number of taps   */
+	DIRECT_SCALAR = 3,   /* MACs per FFT cost unit, scalar kernel   */
+	DIRECT_VECTOR = 10,  /* MACs per FFT cost unit, vector kernels  */
+};
+
+/** Defines a block FIR filter */
+struct fir_block {
+	int16_t *tapv;          /**< Filter taps, reversed           */
+	size_t tapc;            /**< Number of taps                  */
+	unsigned ch;            /**< Number of channels              */
+	int16_t *buf;           /**< History and input per channel   */
+	size_t frames;          /**< Input capacity per channel      */
+	fir_dot_h *dot;         /**< Dot product kernel              */
+	struct fir_fft **fftv;  /**< FFT convolvers per channel pair */
+	size_t fftc;            /**< Number of FFT convolvers        */
+};
+
+
+static void fft_flush(struct fir_block *fb)
+{
+	size_t i;
+
+	for (i=0; i<fb->fftc; i++)
+		mem_deref(fb->fftv[i]);
+
+	fb->fftv = mem_deref(fb->fftv);
+	fb->fftc = 0;
+}
+
+
+static void destructor(void *arg)
+{
+	struct fir_block *fb = arg;
+
+	fft_flush(fb);
+	mem_deref(fb->tapv);
+	mem_deref(fb->buf);
+}
+
+
+/*
+ * Compare the cost of one block of hop frames for a pair of channels.
+ * The weights are measured on x86-64, with the SSE/AVX2 dot products
+ * for the vector kernels. The benchmark "remtest -p fir_block" shows
+ * both forms and the one that is picked.
+ */
+static bool fft_cheaper(const struct fir_block *fb, size_t hop)
+{
+	const uint64_t chc = min(fb->ch, 2);
+	const size_t partc = (fb->tapc + hop - 1) / hop;
+	uint64_t direct, fft;
+	size_t n = 2, bits = 1;
+
+	if (fb->tapc < FFT_MIN_TAPS)
+		return false;
+
+	while (n < 2 * hop) {
+		n <<= 1;
+		++bits;
+	}
+
+	direct = chc * hop * fb->tapc;
+	fft    = 3 * n * bits + 2 * n * partc;
+
+	if (fb->dot == fir_dot_scalar)
+		direct /= DIRECT_SCALAR;
+	else
+		direct /= DIRECT_VECTOR;
+
+	return fft < direct;
+}
+
+
+static int fft_alloc(struct fir_block *fb, size_t hop)
+{
+	const size_t fftc = (fb->ch + 1) / 2;
+	struct fir_fft **fftv;
+	size_t i;
+	int err = 0;
+
+	fftv = mem_zalloc(fftc * sizeof(*fftv), NULL);
+	if (!fftv)
+		return ENOMEM;
+
+	for (i=0; i<fftc && !err; i++)
+		err = fir_fft_alloc(&fftv[i], fb->tapv, fb->tapc, hop);
+
+	fft_flush(fb);
+
+	fb->fftv = fftv;
+	fb->fftc = fftc;
+
+	if (err) {
+		fft_flush(fb);
+		return err;
+	}
+
+	/* the history is not empty */
+	for (i=0; i<fftc; i++)
+		fir_fft_invalidate(fftv[i]);
+
+	return 0;
+}
+
+
+static int scratch_ensure(struct fir_block *fb, size_t frames)
+{
+	const size_t hlen = fb->tapc - 1;
+	int16_t *buf;
+	unsigned c;
+	int err;
+
+	if (frames <= fb->frames)
+		return 0;
+
+	buf = mem_zalloc(fb->ch * (hlen + frames) * sizeof(*buf), NULL);
+	if (!buf)
+		return ENOMEM;
+
+	if (fb->buf) {
+		for (c=0; c<fb->ch; c++) {
+			memcpy(&buf[c * (hlen + frames)],
+			       &fb->buf[c * (hlen + fb->frames)],
+			       hlen * sizeof(*buf));
+		}
+	}
+
+	mem_deref(fb->buf);
+	fb->buf    = buf;
+	fb->frames = frames;
+
+	if (fft_cheaper(fb, frames)) {
+		err = fft_alloc(fb, frames);
+		if (err)
+			return err;
+	}
+	else {
+		fft_flush(fb);
+	}
+
+	return 0;
+}
+
+
+static void filter_direct(const struct fir_block *fb, int16_t *outv,
+			  const int16_t *s, size_t n)
+{
+	size_t k;
+
+	for (k=0; k<n; k++) {
+
+		int64_t acc = fb->dot(&s[k], fb->tapv, fb->tapc);
+
+		if (acc > 0x3fffffff)
+			acc = 0x3fffffff;
+		else if (acc < -0x40000000)
+			acc = -0x40000000;
+
+		outv[k * fb->ch] = (int16_t)(acc>>15);
+	}
+}
+
+
+/**
+ * Allocate a block FIR filter
+ *
+ * @param fbp  Pointer to allocated block FIR filter
+ * @param ch   Number of channels
+ * @param tapv Filter taps
+ * @param tapc Number of taps
+ *
+ * @return 0 for success, otherwise error code
+ */
+int fir_block_alloc(struct fir_block **fbp, unsigned ch,
+		    const int16_t *tapv, size_t tapc)
+{
+	struct fir_block *fb;
+	size_t i;
+	int err = 0;
+
+	if (!fbp || !ch || !tapv || !tapc)
+		return EINVAL;
+
+	fb = mem_zalloc(sizeof(*fb), destructor);
+	if (!fb)
+		return ENOMEM;
+
+	fb->tapc = tapc;
+	fb->ch   = ch;
+	fb->dot  = fir_dot_kernel();
+
+	fb->tapv = mem_alloc(tapc * sizeof(*fb->tapv), NULL);
+	if (!fb->tapv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i=0; i<tapc; i++) {
+
+		fb->tapv[tapc - 1 - i] = tapv[i];
+
+		/* the vector kernels need all pairwise sums in 32 bits */
+		if (tapv[i] == INT16_MIN)
+			fb->dot = fir_dot_scalar;
+	}
+
+ out:
+	if (err)
+		mem_deref(fb);
+	else
+		*fbp = fb;
+
+	return err;
+}
+
+
+/**
+ * Reset the history of a block FIR filter
+ *
+ * @param fb Block FIR filter
+ */
+void fir_block_reset(struct fir_block *fb)
+{
+	size_t i;
+
+	if (!fb || !fb->buf)
+		return;
+
+	memset(fb->buf, 0,
+	       fb->ch * (fb->tapc - 1 + fb->frames) * sizeof(*fb->buf));
+
+	for (i=0; i<fb->fftc; i++)
+		fir_fft_invalidate(fb->fftv[i]);
+}
+
+
+/**
+ * Process a block of samples with the block FIR filter
+ *
+ * @param fb   Block FIR filter
+ * @param outv Output samples, may be the same as the input samples
+ * @param inv  Input samples, interleaved
+ * @param inc  Number of samples, must be a multiple of the channels
+ *
+ * @return 0 for success, otherwise error code
+ */
+int fir_block_filter(struct fir_block *fb, int16_t *outv, const int16_t *inv,
+		     size_t inc)
+{
+	size_t hlen, stride, n, k;
+	bool fft;
+	unsigned c;
+	int err;
+
+	if (!fb || !outv || !inv || inc % fb->ch)
+		return EINVAL;
+
+	n = inc / fb->ch;
+	if (!n)
+		return 0;
+
+	err = scratch_ensure(fb, n);
+	if (err)
+		return err;
+
+	hlen   = fb->tapc - 1;
+	stride = hlen + fb->frames;
+	fft    = fb->fftc && !(n % fir_fft_hop(fb->fftv[0]));
+
+	/* stage all input first, the output may overwrite it */
+	for (c=0; c<fb->ch; c++) {
+
+		int16_t *s = &fb->buf[c * stride];
+
+		if (fb->ch == 1) {
+			memcpy(&s[hlen], inv, n * sizeof(*s));
+		}
+		else {
+			for (k=0; k<n; k++)
+				s[hlen + k] = inv[k * fb->ch + c];
+		}
+	}
+
+	for (c=0; c<fb->ch; c++) {
+
+		const int16_t *s = &fb->buf[c * stride];
+		struct fir_fft *ff;
+
+		if (!fft) {
+			filter_direct(fb, &outv[c], s, n);
+			continue;
+		}
+
+		ff = fb->fftv[c / 2];
+
+		if (c + 1 < fb->ch) {
+			fir_fft_filter(ff, &outv[c], s, &outv[c + 1],
+				       s + stride, n, fb->ch);
+			++c;
+		}
+		else {
+			fir_fft_filter(ff, &outv[c], s, NULL, NULL, n, fb->ch);
+		}
+	}
+
+	if (!fft) {
+		for (k=0; k<fb->fftc; k++)
+			fir_fft_invalidate(fb->fftv[k]);
+	}
+
+	for (c=0; c<fb->ch; c++) {
+
+		int16_t *s = &fb->buf[c * stride];
+
+		memmove(s, &s[n], hlen * sizeof(*s));
+	}
+
+	return 0;
+}
@@ -0,0 +1,187 @@
+/**
+ * @file dot.c  FIR -- dot product kernels
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+#include <re.h>
+#include "fir.h"
+
+
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__)
+#define USE_X86 1
+#include <immintrin.h>
+#endif
+
+#ifdef HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+
+/*
+ * Scalar reference kernel, all other kernels must be bit-exact with it.
+ *
+ * The vector kernels multiply-add pairs of samples into 32-bit lanes,
+ * which cannot overflow as long as no tap is -32768, and then widen the
+ * lanes into 64-bit accumulators.
+ */
+
+int64_t fir_dot_scalar(const int16_t *x, const int16_t *h, size_t n)
+{
+	int64_t acc = 0;
+	size_t i;
+
+	for (i=0; i<n; i++)
+		acc += (int32_t)x[i] * h[i];
+
+	return acc;
+}
+
+
+#ifdef USE_X86
+
+__attribute__((target("sse4.1")))
+static int64_t dot_sse41(const int16_t *x, const int16_t *h, size_t n)
+{
+	__m128i acc = _mm_setzero_si128();
+	int64_t v[2];
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+
+		const __m128i a = _mm_loadu_si128((const __m128i *)&x[i]);
+		const __m128i b = _mm_loadu_si128((const __m128i *)&h[i]);
+		const __m128i p = _mm_madd_epi16(a, b);
+
+		acc = _mm_add_epi64(acc, _mm_cvtepi32_epi64(p));
+		acc = _mm_add_epi64(acc,
+				    _mm_cvtepi32_epi64(_mm_srli_si128(p, 8)));
+	}
+
+	_mm_storeu_si128((__m128i *)v, acc);
+
+	return v[0] + v[1] + fir_dot_scalar(&x[i], &h[i], n - i);
+}
+
+
+__attribute__((target("avx2")))
+static int64_t dot_avx2(const int16_t *x, const int16_t *h, size_t n)
+{
+	__m256i acc = _mm256_setzero_si256();
+	int64_t v[4];
+	size_t i;
+
+	for (i=0; i+16<=n; i+=16) {
+
+		const __m256i a = _mm256_loadu_si256((const __m256i *)&x[i]);
+		const __m256i b = _mm256_loadu_si256((const __m256i *)&h[i]);
+		const __m256i p = _mm256_madd_epi16(a, b);
+
+		const __m128i lo = _mm256_castsi256_si128(p);
+		const __m128i hi = _mm256_extracti128_si256(p, 1);
+
+		acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(lo));
+		acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(hi));
+	}
+
+	_mm256_storeu_si256((__m256i *)v, acc);
+
+	return v[0] + v[1] + v[2] + v[3] +
+		fir_dot_scalar(&x[i], &h[i], n - i);
+}
+
+#endif
+
+
+#ifdef HAVE_NEON
+
+static int64_t dot_neon(const int16_t *x, const int16_t *h, size_t n)
+{
+	int64x2_t acc = vdupq_n_s64(0);
+	size_t i;
+
+	for (i=0; i+8<=n; i+=8) {
+
+		const int16x8_t a = vld1q_s16(&x[i]);
+		const int16x8_t b = vld1q_s16(&h[i]);
+
+		acc = vpadalq_s32(acc, vmull_s16(vget_low_s16(a),
+						 vget_low_s16(b)));
+		acc = vpadalq_s32(acc, vmull_s16(vget_high_s16(a),
+						 vget_high_s16(b)));
+	}
+
+	return vgetq_lane_s64(acc, 0) + vgetq_lane_s64(acc, 1) +
+		fir_dot_scalar(&x[i], &h[i], n - i);
+}
+
+#endif
+
+
+/**
+ * Get a dot product kernel supported by the running CPU
+ *
+ * @param i Index of the kernel, 0 is the fastest
+ *
+ * @return Dot product kernel, or NULL if there are no more kernels. The
+ *         last kernel is fir_dot_scalar().
+ */
+fir_dot_h *fir_dot_get(unsigned i)
+{
+	fir_dot_h *kv[4];
+	unsigned n = 0;
+
+#ifdef USE_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		kv[n++] = dot_avx2;
+
+	if (__builtin_cpu_supports("sse4.1"))
+		kv[n++] = dot_sse41;
+#endif
+
+#ifdef HAVE_NEON
+	kv[n++] = dot_neon;
+#endif
+
+	kv[n++] = fir_dot_scalar;
+
+	return i < n ? kv[i] : NULL;
+}
+
+
+/**
+ * Select the fastest dot product kernel supported by the running CPU
+ *
+ * @return Dot product kernel
+ */
+fir_dot_h *fir_dot_select(void)
+{
+	return fir_dot_get(0);
+}
+
+
+/**
+ * Get the dot product kernel, selecting it on first use
+ *
+ * @return Dot product kernel
+ */
+fir_dot_h *fir_dot_kernel(void)
+{
+	static fir_dot_h *dot;
+	fir_dot_h *k;
+
+#ifdef __GNUC__
+	k = __atomic_load_n(&dot, __ATOMIC_RELAXED);
+	if (!k) {
+		k = fir_dot_select();
+		__atomic_store_n(&dot, k, __ATOMIC_RELAXED);
+	}
+#else
+	k = dot;
+	if (!k)
+		dot = k = fir_dot_select();
+#endif
+
+	return k;
+}
@@ -0,0 +1,361 @@
+/**
+ * @file fft.c FIR -- FFT overlap-save convolution
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <string.h>
+#include <math.h>
+#include <re.h>
+#include "fir.h"
+
+
+#if !defined (M_PI)
+#define M_PI 3.14159265358979323846264338327
+#endif
+
+
+/*
+ * Uniformly partitioned overlap-save, with a radix-2 complex FFT in
+ * double precision.
+ *
+ * The input is processed in blocks of hop samples, and the filter is
+ * split into partc partitions of hop taps. Each block is transformed
+ * once, together with the hop samples before it, and the spectra of the
+ * last partc blocks are kept in a delay line. The output of a block is
+ * the inverse transform of the sum of the delayed input spectra times
+ * the partition spectra, so the FFT size only depends on the block size
+ * and not on the number of taps.
+ *
+ * The filter is real, so two channels are filtered at once as the real
+ * and imaginary parts of one complex signal.
+ *
+ * The delay line is a cache of the time domain history, which is kept
+ * by the caller. It is rebuilt from the history after it has been
+ * invalidated, for instance after samples were filtered in direct form.
+ *
+ * The result is rounded to the nearest integer before the usual Q15
+ * scaling. The rounding error of the FFT is far below one half, so the
+ * output matches the direct form.
+ */
+
+
+/** Defines an FFT convolver */
+struct fir_fft {
+	double *re;        /**< Work buffer, real part          */
+	double *im;        /**< Work buffer, imaginary part     */
+	double *hre;       /**< Partition spectra, real part    */
+	double *him;       /**< Partition spectra, imag part    */
+	double *xre;       /**< Input spectra delay line, real  */
+	double *xim;       /**< Input spectra delay line, imag  */
+	double *twr;       /**< Twiddle factors, real part      */
+	double *twi;       /**< Twiddle factors, imag part      */
+	unsigned *revv;    /**< Bit reversed indices            */
+	size_t n;          /**< FFT size                        */
+	size_t hop;        /**< Block size                      */
+	size_t partc;      /**< Number of partitions            */
+	size_t pos;        /**< Newest block in the delay line  */
+	size_t tapc;       /**< Number of taps                  */
+	bool valid;        /**< Delay line matches the history  */
+};
+
+
+static void destructor(void *arg)
+{
+	struct fir_fft *ff = arg;
+
+	mem_deref(ff->re);
+	mem_deref(ff->revv);
+}
+
+
+/*
+ * Forward FFT in place. The twiddle factors of each stage are stored
+ * contiguously, so that the butterfly loop can be vectorized. The
+ * inverse FFT is done by conjugating the input and the output.
+ */
+static void fft(const struct fir_fft *ff, double *re, double *im)
+{
+	const size_t n = ff->n;
+	size_t i, half;
+
+	for (i=0; i<n; i++) {
+
+		const size_t j = ff->revv[i];
+		double t;
+
+		if (j <= i)
+			continue;
+
+		t = re[i]; re[i] = re[j]; re[j] = t;
+		t = im[i]; im[i] = im[j]; im[j] = t;
+	}
+
+	for (half=1; half<n; half<<=1) {
+
+		const double *twr = &ff->twr[half - 1];
+		const double *twi = &ff->twi[half - 1];
+
+		for (i=0; i<n; i+=2*half) {
+
+			double *ar = &re[i], *ai = &im[i];
+			double *br = &re[i + half], *bi = &im[i + half];
+			size_t k;
+
+			for (k=0; k<half; k++) {
+
+				const double tr = br[k]*twr[k] - bi[k]*twi[k];
+				const double ti = br[k]*twi[k] + bi[k]*twr[k];
+
+				br[k] = ar[k] - tr;
+				bi[k] = ai[k] - ti;
+				ar[k] += tr;
+				ai[k] += ti;
+			}
+		}
+	}
+}
+
+
+static inline int16_t saturate(double y)
+{
+	const double r = floor(y + 0.5);
+	int64_t acc;
+
+	if (r > 0x3fffffff)
+		acc = 0x3fffffff;
+	else if (r < -0x40000000)
+		acc = -0x40000000;
+	else
+		acc = (int64_t)r;
+
+	return (int16_t)(acc>>15);
+}
+
+
+/* Transform the n samples ending at end into delay line slot */
+static void transform(struct fir_fft *ff, size_t slot,
+		      const int16_t *sa, const int16_t *sb, ptrdiff_t end)
+{
+	double *xre = &ff->xre[slot * ff->n];
+	double *xim = &ff->xim[slot * ff->n];
+	const ptrdiff_t start = end - (ptrdiff_t)ff->n;
+	size_t i;
+
+	/* samples before the history do not reach the valid outputs */
+	for (i=0; i<ff->n; i++) {
+
+		const ptrdiff_t j = start + (ptrdiff_t)i;
+
+		xre[i] = j >= 0 ? sa[j] : 0;
+		xim[i] = j >= 0 && sb ? sb[j] : 0;
+	}
+
+	fft(ff, xre, xim);
+}
+
+
+/**
+ * Allocate an FFT convolver
+ *
+ * @param ffp  Pointer to allocated FFT convolver
+ * @param tapv Filter taps, reversed
+ * @param tapc Number of taps
+ * @param hop  Block size
+ *
+ * @return 0 for success, otherwise error code
+ */
+int fir_fft_alloc(struct fir_fft **ffp, const int16_t *tapv, size_t tapc,
+		  size_t hop)
+{
+	struct fir_fft *ff;
+	size_t n = 2, i, p, half, bits = 1;
+	int err = 0;
+
+	if (!ffp || !tapv || !tapc || !hop)
+		return EINVAL;
+
+	while (n < 2 * hop) {
+		n <<= 1;
+		++bits;
+	}
+
+	ff = mem_zalloc(sizeof(*ff), destructor);
+	if (!ff)
+		return ENOMEM;
+
+	ff->n     = n;
+	ff->hop   = hop;
+	ff->partc = (tapc + hop - 1) / hop;
+	ff->tapc  = tapc;
+
+	ff->re   = mem_zalloc((2 + 4 * ff->partc) * n * sizeof(double) +
+			      2 * (n - 1) * sizeof(double), NULL);
+	ff->revv = mem_alloc(n * sizeof(*ff->revv), NULL);
+	if (!ff->re || !ff->revv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	ff->im  = ff->re  + n;
+	ff->hre = ff->im  + n;
+	ff->him = ff->hre + ff->partc * n;
+	ff->xre = ff->him + ff->partc * n;
+	ff->xim = ff->xre + ff->partc * n;
+	ff->twr = ff->xim + ff->partc * n;
+	ff->twi = ff->twr + n - 1;
+
+	for (i=0; i<n; i++) {
+
+		size_t b, r = 0;
+
+		for (b=0; b<bits; b++)
+			r |= ((i >> b) & 1) << (bits - 1 - b);
+
+		ff->revv[i] = (unsigned)r;
+	}
+
+	for (half=1; half<n; half<<=1) {
+
+		for (i=0; i<half; i++) {
+
+			const double w = -M_PI * (double)i / (double)half;
+
+			ff->twr[half - 1 + i] = cos(w);
+			ff->twi[half - 1 + i] = sin(w);
+		}
+	}
+
+	/* the inverse FFT scaling is folded into the partition spectra */
+	for (p=0; p<ff->partc; p++) {
+
+		double *hre = &ff->hre[p * n];
+		double *him = &ff->him[p * n];
+
+		for (i=0; i<hop && p * hop + i < tapc; i++)
+			hre[i] = tapv[tapc - 1 - (p * hop + i)] / (double)n;
+
+		fft(ff, hre, him);
+	}
+
+	/* the history is all zero */
+	ff->valid = true;
+
+ out:
+	if (err)
+		mem_deref(ff);
+	else
+		*ffp = ff;
+
+	return err;
+}
+
+
+/**
+ * Get the block size of an FFT convolver
+ *
+ * @param ff FFT convolver
+ *
+ * @return Block size in samples
+ */
+size_t fir_fft_hop(const struct fir_fft *ff)
+{
+	return ff ? ff->hop : 0;
+}
+
+
+/**
+ * Invalidate the input spectra of an FFT convolver, after the history
+ * was changed without it
+ *
+ * @param ff FFT convolver
+ */
+void fir_fft_invalidate(struct fir_fft *ff)
+{
+	if (!ff)
+		return;
+
+	ff->valid = false;
+}
+
+
+/**
+ * Filter two sample streams with the FFT convolver
+ *
+ * Each stream is tapc - 1 samples of history followed by the input, and
+ * its output samples are stride apart.
+ *
+ * @param ff     FFT convolver
+ * @param outa   Output samples of the first stream
+ * @param sa     History and input samples of the first stream
+ * @param outb   Output samples of the second stream, or NULL
+ * @param sb     History and input samples of the second stream, or NULL
+ * @param n      Number of new samples, a multiple of the block size
+ * @param stride Distance between output samples
+ */
+void fir_fft_filter(struct fir_fft *ff, int16_t *outa, const int16_t *sa,
+		    int16_t *outb, const int16_t *sb, size_t n, size_t stride)
+{
+	const ptrdiff_t hlen = (ptrdiff_t)ff->tapc - 1;
+	const size_t nsz = ff->n;
+	size_t off, i, p;
+
+	if (!ff->valid) {
+
+		/* block p - 1 before this call is delayed by p */
+		for (p=1; p<ff->partc; p++) {
+
+			const size_t slot = (ff->pos + 1 + ff->partc - p) %
+				ff->partc;
+
+			transform(ff, slot, sa, sb,
+				  hlen - (ptrdiff_t)((p - 1) * ff->hop));
+		}
+
+		ff->valid = true;
+	}
+
+	for (off=0; off<n; off+=ff->hop) {
+
+		const ptrdiff_t end = hlen + (ptrdiff_t)(off + ff->hop);
+
+		ff->pos = (ff->pos + 1) % ff->partc;
+
+		transform(ff, ff->pos, sa, sb, end);
+
+		memset(ff->re, 0, nsz * sizeof(double));
+		memset(ff->im, 0, nsz * sizeof(double));
+
+		for (p=0; p<ff->partc; p++) {
+
+			const size_t slot = (ff->pos + ff->partc - p) %
+				ff->partc;
+			const double *xre = &ff->xre[slot * nsz];
+			const double *xim = &ff->xim[slot * nsz];
+			const double *hre = &ff->hre[p * nsz];
+			const double *him = &ff->him[p * nsz];
+
+			for (i=0; i<nsz; i++) {
+				ff->re[i] += xre[i] * hre[i] - xim[i] * him[i];
+				ff->im[i] += xre[i] * him[i] + xim[i] * hre[i];
+			}
+		}
+
+		/* conjugate for the inverse FFT */
+		for (i=0; i<nsz; i++)
+			ff->im[i] = -ff->im[i];
+
+		fft(ff, ff->re, ff->im);
+
+		for (i=0; i<ff->hop; i++) {
+
+			const size_t j = nsz - ff->hop + i;
+			const size_t k = (off + i) * stride;
+
+			outa[k] = saturate(ff->re[j]);
+
+			if (outb)
+				outb[k] = saturate(-ff->im[j]);
+		}
+	}
+}
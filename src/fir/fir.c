@@ -7,6 +7,33 @@
 #include <string.h>
 #include <re.h>
 #include <rem_fir.h>
+#include "fir.h"
+
+
+/*
+ * The history is a ring of the last tapc samples of each channel,
+ * interleaved as the input, and the index is the ring position of the
+ * next sample. For each call, the history and the input of one channel
+ * at a time are staged in a linear buffer, oldest first, so that each
+ * output is one dot product against the reversed taps. The newest
+ * tapc - 1 samples of the channel are then put back in the ring.
+ */
+
+enum {
+	FIR_CHUNK = 256,  /* input samples per channel staged at a time */
+};
+
+
+/*
+ * Ring position of the oldest of the last tapc - 1 samples of channel c,
+ * when the next sample goes to ring position pos. The next sample of the
+ * channel replaces the oldest of its tapc samples in the ring, so this
+ * is the sample after that one. Not yet taken modulo the ring length.
+ */
+static inline unsigned ring_first(unsigned pos, unsigned c, unsigned ch)
+{
+	return pos + (c + ch - pos % ch) % ch + ch;
+}
 
 
 /**
@@ -26,7 +53,8 @@ void fir_reset(struct fir *fir)
 /**
  * Process samples with the FIR filter
  *
- * @note product of channel and tap-count must be power of two
+ * @note product of channel and tap-count must be at most FIR_HIST_MAX,
+ *       longer filters can use fir_block_filter()
  *
  * @param fir  FIR filter
  * @param outv Output samples
@@ -39,29 +67,167 @@ void fir_reset(struct fir *fir)
 void fir_filter(struct fir *fir, int16_t *outv, const int16_t *inv, size_t inc,
 		unsigned ch, const int16_t *tapv, size_t tapc)
 {
-	const unsigned hmask = (ch * (unsigned)tapc) - 1;
+	const unsigned n = (unsigned)tapc;
+	int16_t tapr[FIR_HIST_MAX], buf[FIR_HIST_MAX + FIR_CHUNK];
+	unsigned hlen, pos, end, first, i, c;
+	fir_dot_h *dot;
+
+	if (!fir || !outv || !inv || !ch || !tapv || !tapc)
+		return;
+
+	if (tapc > FIR_HIST_MAX / ch)
+		return;
+
+	dot = fir_dot_kernel();
+
+	for (i=0; i<n; i++) {
+
+		tapr[n - 1 - i] = tapv[i];
+
+		/* the vector kernels need all pairwise sums in 32 bits */
+		if (tapv[i] == INT16_MIN)
+			dot = fir_dot_scalar;
+	}
+
+	hlen = ch * n;
+	pos  = fir->index % hlen;
+	end  = (unsigned)((pos + inc % hlen) % hlen);
+
+	for (c=0; c<ch; c++) {
+
+		size_t j = (c + ch - pos % ch) % ch;
+
+		first = ring_first(pos, c, ch);
+		for (i=0; i+1<n; i++)
+			buf[i] = fir->history[(first + i * ch) % hlen];
+
+		while (j < inc) {
+
+			const size_t j0 = j;
+			size_t k, m = 0;
+
+			for (; j < inc && m < FIR_CHUNK; j += ch)
+				buf[n - 1 + m++] = inv[j];
+
+			for (k=0; k<m; k++) {
+
+				int64_t acc = dot(&buf[k], tapr, n);
+
+				if (acc > 0x3fffffff)
+					acc = 0x3fffffff;
+				else if (acc < -0x40000000)
+					acc = -0x40000000;
+
+				outv[j0 + k * ch] = (int16_t)(acc>>15);
+			}
+
+			memmove(buf, &buf[m], (n - 1) * sizeof(*buf));
+		}
+
+		first = ring_first(end, c, ch);
+		for (i=0; i+1<n; i++)
+			fir->history[(first + i * ch) % hlen] = buf[i];
+	}
+
+	fir->index = end;
+}
+
+
+/**
+ * Reset the float FIR-filter
+ *
+ * @param fir Float FIR-filter state
+ */
+void fir_float_reset(struct fir_float *fir)
+{
+	if (!fir)
+		return;
+
+	memset(fir, 0, sizeof(*fir));
+}
+
+
+static float dot_float(const float *x, const float *h, size_t n)
+{
+	float a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+	size_t i;
+
+	/* independent sums, so that the loop can be vectorized */
+	for (i=0; i+4<=n; i+=4) {
+		a0 += x[i]   * h[i];
+		a1 += x[i+1] * h[i+1];
+		a2 += x[i+2] * h[i+2];
+		a3 += x[i+3] * h[i+3];
+	}
+
+	for (; i<n; i++)
+		a0 += x[i] * h[i];
+
+	return (a0 + a1) + (a2 + a3);
+}
+
+
+/**
+ * Process float samples with the FIR filter
+ *
+ * The taps are linear, 1.0 is unity gain. The output is not clipped.
+ *
+ * @note product of channel and tap-count must be at most FIR_HIST_MAX
+ *
+ * @param fir  Float FIR filter
+ * @param outv Output samples
+ * @param inv  Input samples
+ * @param inc  Number of samples
+ * @param ch   Number of channels
+ * @param tapv Filter taps
+ * @param tapc Number of taps
+ */
+void fir_float_filter(struct fir_float *fir, float *outv, const float *inv,
+		      size_t inc, unsigned ch, const float *tapv, size_t tapc)
+{
+	const unsigned n = (unsigned)tapc;
+	float tapr[FIR_HIST_MAX], buf[FIR_HIST_MAX + FIR_CHUNK];
+	unsigned hlen, pos, end, first, i, c;
 
 	if (!fir || !outv || !inv || !ch || !tapv || !tapc)
 		return;
 
-	if (hmask >= ARRAY_SIZE(fir->history) || hmask & (hmask+1))
+	if (tapc > FIR_HIST_MAX / ch)
 		return;
 
-	while (inc--) {
+	for (i=0; i<n; i++)
+		tapr[n - 1 - i] = tapv[i];
+
+	hlen = ch * n;
+	pos  = fir->index % hlen;
+	end  = (unsigned)((pos + inc % hlen) % hlen);
+
+	for (c=0; c<ch; c++) {
 
-		int64_t acc = 0;
-		unsigned i, j;
+		size_t j = (c + ch - pos % ch) % ch;
 
-		fir->history[fir->index & hmask] = *inv++;
+		first = ring_first(pos, c, ch);
+		for (i=0; i+1<n; i++)
+			buf[i] = fir->history[(first + i * ch) % hlen];
 
-		for (i=0, j=fir->index++; i<tapc; ++i, j-=ch)
-			acc += (int64_t)fir->history[j & hmask] * tapv[i];
+		while (j < inc) {
 
-		if (acc > 0x3fffffff)
-			acc = 0x3fffffff;
-		else if (acc < -0x40000000)
-			acc = -0x40000000;
+			const size_t j0 = j;
+			size_t k, m = 0;
 
-		*outv++ = (int16_t)(acc>>15);
+			for (; j < inc && m < FIR_CHUNK; j += ch)
+				buf[n - 1 + m++] = inv[j];
+
+			for (k=0; k<m; k++)
+				outv[j0 + k*ch] = dot_float(&buf[k], tapr, n);
+
+			memmove(buf, &buf[m], (n - 1) * sizeof(*buf));
+		}
+
+		first = ring_first(end, c, ch);
+		for (i=0; i+1<n; i++)
+			fir->history[(first + i * ch) % hlen] = buf[i];
 	}
+
+	fir->index = end;
 }
@@ -0,0 +1,38 @@
+/**
+ * @file fir.h  FIR -- internal API
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+
+/**
+ * Dot product of samples and taps, exact in 64-bit
+ *
+ * @param x Samples
+ * @param h Taps, none of them -32768
+ * @param n Number of samples and taps
+ *
+ * @return Sum of x[i] * h[i]
+ */
+typedef int64_t (fir_dot_h)(const int16_t *x, const int16_t *h, size_t n);
+
+extern fir_dot_h fir_dot_scalar;
+
+fir_dot_h *fir_dot_get(unsigned i);
+fir_dot_h *fir_dot_select(void);
+fir_dot_h *fir_dot_kernel(void);
+
+
+/*
+ * FFT convolver
+ */
+
+struct fir_fft;
+
+int    fir_fft_alloc(struct fir_fft **ffp, const int16_t *tapv, size_t tapc,
+		     size_t hop);
+size_t fir_fft_hop(const struct fir_fft *ff);
+void   fir_fft_invalidate(struct fir_fft *ff);
+void   fir_fft_filter(struct fir_fft *ff, int16_t *outa, const int16_t *sa,
+		      int16_t *outb, const int16_t *sb, size_t n,
+		      size_t stride);
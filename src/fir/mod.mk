@@ -5,3 +5,6 @@
 #
 
 SRCS	+= fir/fir.c
+SRCS	+= fir/block.c
+SRCS	+= fir/dot.c
+SRCS	+= fir/fft.c
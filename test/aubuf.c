@@ -0,0 +1,861 @@
+/**
+ * @file test/aubuf.c  Selftest -- audio buffer
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <re.h>
+#include <rem.h>
+#include "aubuf/aubuf.h"
+#include "test.h"
+
+
+enum {
+	STRETCH_SRATE = 8000,
+	STRETCH_FRAME = 160,
+	STRETCH_PRIME = 6,
+	STRETCH_READS = 60,
+	BATCH_N       = 5,
+	BATCH_FRAME   = 160,
+	BATCH_ROUNDS  = 20,
+	TS_FRAME      = 160,
+	POOL_FRAMES   = 4,
+	ADAPT_FRAME   = 160,
+	ADAPT_WRITES  = 40,
+	PLC_SRATE     = 8000,
+	PLC_FRAME     = 160,
+	PLC_PERIOD    = 40,
+	PEEK_FRAME    = 120,
+	PEEK_ROUNDS   = 60,
+};
+
+
+static int put_frame(struct aubuf *ab, uint32_t ts)
+{
+	struct mbuf *mb;
+	unsigned i;
+	int err = 0;
+
+	mb = mbuf_alloc(STRETCH_FRAME * 2);
+	if (!mb)
+		return ENOMEM;
+
+	/* periodic signal, which can be concealed */
+	for (i=0; i<STRETCH_FRAME && !err; i++) {
+		const int16_t s = ((ts + i) / 20) & 1 ? 8000 : -8000;
+
+		err = mbuf_write_u16(mb, (uint16_t)s);
+	}
+
+	mb->pos = 0;
+
+	if (!err)
+		err = aubuf_put_ts(ab, ts, mb);
+
+	mem_deref(mb);
+
+	return err;
+}
+
+
+static bool is_silent(const int16_t *sampv, size_t sampc)
+{
+	size_t i;
+
+	for (i=0; i<sampc; i++) {
+		if (sampv[i])
+			return false;
+	}
+
+	return true;
+}
+
+
+static int put_samp(struct aubuf *ab, uint32_t ts, const int16_t *sampv,
+		    size_t sampc)
+{
+	struct mbuf *mb;
+	int err;
+
+	mb = mbuf_alloc(sampc * 2);
+	if (!mb)
+		return ENOMEM;
+
+	err = mbuf_write_mem(mb, (const uint8_t *)sampv, sampc * 2);
+	mb->pos = 0;
+
+	if (!err)
+		err = aubuf_put_ts(ab, ts, mb);
+
+	mem_deref(mb);
+
+	return err;
+}
+
+
+/* Longest run of zero samples */
+static size_t silent_run(const int16_t *sampv, size_t sampc)
+{
+	size_t i, run = 0, longest = 0;
+
+	for (i=0; i<sampc; i++) {
+		run = sampv[i] ? 0 : run + 1;
+		longest = max(longest, run);
+	}
+
+	return longest;
+}
+
+
+/*
+ * A timestamp gap read while the buffer is being stretched must be
+ * concealed, and not stretched as silence
+ */
+int test_aubuf_stretch_gap(void)
+{
+	const size_t d = aubuf_stretch_delta(STRETCH_FRAME);
+	const size_t rsz = (STRETCH_FRAME - d) * 2;
+	int16_t sampv[STRETCH_FRAME];
+	struct aubuf *ab = NULL;
+	bool gap = false;
+	uint32_t ts = 0;
+	unsigned i;
+	int err;
+
+	err = aubuf_alloc(&ab, STRETCH_PRIME * sizeof(sampv), 0);
+	TEST_ERR(err);
+
+	aubuf_set_stretch(ab, 1);
+
+	err = aubuf_set_plc(ab, STRETCH_SRATE, 1);
+	TEST_ERR(err);
+
+	for (i=0; i<STRETCH_PRIME; i++) {
+		err = put_frame(ab, ts);
+		TEST_ERR(err);
+		ts += STRETCH_FRAME;
+	}
+
+	/* drain below the wish size, so that the reads are expanded */
+	for (i=0; i<STRETCH_PRIME / 2; i++)
+		aubuf_read_samp(ab, sampv, ARRAY_SIZE(sampv));
+
+	for (i=0; i<STRETCH_READS; i++) {
+
+		/* lose some packets, right where an expanded read starts */
+		if (!gap && i >= STRETCH_READS / 4 &&
+		    aubuf_cur_size(ab) % rsz == 0) {
+			ts += 3 * STRETCH_FRAME;
+			gap = true;
+		}
+
+		err = put_frame(ab, ts);
+		TEST_ERR(err);
+		ts += STRETCH_FRAME;
+
+		aubuf_read_samp(ab, sampv, ARRAY_SIZE(sampv));
+
+		TEST_ASSERT(!is_silent(sampv, ARRAY_SIZE(sampv)));
+	}
+
+	TEST_ASSERT(gap);
+
+ out:
+	mem_deref(ab);
+
+	return err;
+}
+
+
+/*
+ * A batch read gives the same samples as one aubuf_read() per buffer,
+ * with buffers that fill up, run empty and overrun at different rates
+ */
+int test_aubuf_read_batch(void)
+{
+	struct aubuf *abv[BATCH_N], *refv[BATCH_N];
+	int16_t sampv[BATCH_FRAME];
+	int16_t outv[BATCH_N][BATCH_FRAME], ref[BATCH_FRAME];
+	int16_t *outp[BATCH_N];
+	struct aubuf *ab = NULL;
+	unsigned i, r, k;
+	int err = 0;
+
+	memset(abv, 0, sizeof(abv));
+	memset(refv, 0, sizeof(refv));
+
+	for (i=0; i<BATCH_N; i++) {
+
+		err = aubuf_alloc_ring(&abv[i], 2 * sizeof(sampv),
+				       4 * sizeof(sampv));
+		TEST_ERR(err);
+
+		err = aubuf_alloc_ring(&refv[i], 2 * sizeof(sampv),
+				       4 * sizeof(sampv));
+		TEST_ERR(err);
+
+		outp[i] = outv[i];
+	}
+
+	for (r=0; r<BATCH_ROUNDS; r++) {
+
+		/* buffer i gets i frames every other round */
+		for (i=0; i<BATCH_N; i++) {
+
+			if (r % 2)
+				continue;
+
+			for (k=0; k<i; k++) {
+
+				unsigned j;
+
+				for (j=0; j<BATCH_FRAME; j++)
+					sampv[j] = test_rand_s16();
+
+				err = aubuf_write_samp(abv[i], sampv,
+						       BATCH_FRAME);
+				TEST_ERR(err);
+
+				err = aubuf_write_samp(refv[i], sampv,
+						       BATCH_FRAME);
+				TEST_ERR(err);
+			}
+		}
+
+		err = aubuf_read_batch(abv, outp, BATCH_N, sizeof(sampv));
+		TEST_ERR(err);
+
+		for (i=0; i<BATCH_N; i++) {
+
+			aubuf_read_samp(refv[i], ref, BATCH_FRAME);
+
+			TEST_MEMCMP(ref, outv[i], sizeof(ref));
+		}
+	}
+
+	/* locked buffers are not batched */
+	err = aubuf_alloc(&ab, sizeof(sampv), 0);
+	TEST_ERR(err);
+
+	TEST_EQUALS(ENOTSUP, aubuf_read_batch(&ab, outp, 1, sizeof(sampv)));
+
+ out:
+	for (i=0; i<BATCH_N; i++) {
+		mem_deref(abv[i]);
+		mem_deref(refv[i]);
+	}
+	mem_deref(ab);
+
+	return err;
+}
+
+
+/*
+ * Frames written with aubuf_write() or aubuf_put_ts() are reused once
+ * they are read or flushed, so only the first writes and a write of a
+ * larger frame allocate memory
+ */
+int test_aubuf_pool(void)
+{
+	int16_t frame[POOL_FRAMES][TS_FRAME], sampv[TS_FRAME];
+	int16_t big[2 * TS_FRAME];
+	struct aubuf_stats stats;
+	struct aubuf *ab = NULL;
+	size_t i, j, round;
+	int err;
+
+	for (i=0; i<POOL_FRAMES; i++) {
+		for (j=0; j<TS_FRAME; j++)
+			frame[i][j] = (int16_t)(1000 * i + j + 1);
+	}
+
+	memset(big, 0, sizeof(big));
+
+	err = aubuf_alloc(&ab, sizeof(sampv), 0);
+	TEST_ERR(err);
+
+	for (round=0; round<3; round++) {
+
+		for (i=0; i<POOL_FRAMES; i++) {
+			err = aubuf_write_samp(ab, frame[i], TS_FRAME);
+			TEST_ERR(err);
+		}
+
+		aubuf_stats_get(ab, &stats);
+		TEST_EQUALS(POOL_FRAMES, stats.pool_miss);
+
+		/* the last round is flushed instead of read */
+		if (round == 2) {
+			aubuf_flush(ab);
+			TEST_EQUALS(0, aubuf_cur_size(ab));
+			continue;
+		}
+
+		for (i=0; i<POOL_FRAMES; i++) {
+			aubuf_read_samp(ab, sampv, TS_FRAME);
+			TEST_MEMCMP(frame[i], sampv, sizeof(sampv));
+		}
+	}
+
+	for (i=0; i<POOL_FRAMES; i++) {
+		err = aubuf_write_samp(ab, frame[i], TS_FRAME);
+		TEST_ERR(err);
+	}
+
+	err = aubuf_write_samp(ab, big, ARRAY_SIZE(big));
+	TEST_ERR(err);
+
+	aubuf_stats_get(ab, &stats);
+	TEST_EQUALS(POOL_FRAMES + 1, stats.pool_miss);
+
+	for (i=0; i<POOL_FRAMES; i++) {
+		aubuf_read_samp(ab, sampv, TS_FRAME);
+		TEST_MEMCMP(frame[i], sampv, sizeof(sampv));
+	}
+
+	/* packets put by timestamp reuse the pool as well */
+	aubuf_flush(ab);
+
+	for (i=0; i<2 * POOL_FRAMES; i++) {
+		err = put_samp(ab, (uint32_t)i * TS_FRAME,
+			       frame[i % POOL_FRAMES], TS_FRAME);
+		TEST_ERR(err);
+
+		/* the pool has the flushed frames and the large one */
+		aubuf_stats_get(ab, &stats);
+		TEST_EQUALS(POOL_FRAMES + 1 + (i > POOL_FRAMES ?
+					       i - POOL_FRAMES : 0),
+			    stats.pool_miss);
+	}
+
+	for (i=0; i<2 * POOL_FRAMES; i++) {
+		aubuf_read_samp(ab, sampv, TS_FRAME);
+		TEST_MEMCMP(frame[i % POOL_FRAMES], sampv, sizeof(sampv));
+	}
+
+ out:
+	mem_deref(ab);
+
+	return err;
+}
+
+
+/*
+ * Packets are played in timestamp order. A duplicate and a packet that
+ * arrives after its playout time are dropped, and counted apart.
+ */
+int test_aubuf_put_ts(void)
+{
+	static const uint32_t orderv[] = {0, 2, 1, 3, 2, 5, 4};
+	int16_t frame[6][TS_FRAME], sampv[TS_FRAME];
+	struct aubuf_stats stats;
+	struct aubuf *ab = NULL;
+	size_t i, j;
+	int err;
+
+	for (i=0; i<ARRAY_SIZE(frame); i++) {
+		for (j=0; j<TS_FRAME; j++)
+			frame[i][j] = (int16_t)(1000 * i + j + 1);
+	}
+
+	err = aubuf_alloc(&ab, 2 * sizeof(sampv), 0);
+	TEST_ERR(err);
+
+	for (i=0; i<ARRAY_SIZE(orderv); i++) {
+		err = put_samp(ab, orderv[i] * TS_FRAME, frame[orderv[i]],
+			       TS_FRAME);
+		TEST_ERR(err);
+	}
+
+	aubuf_stats_get(ab, &stats);
+	TEST_EQUALS(1, stats.dup);
+	TEST_EQUALS(0, stats.late);
+
+	for (i=0; i<4; i++) {
+		aubuf_read_samp(ab, sampv, TS_FRAME);
+		TEST_MEMCMP(frame[i], sampv, sizeof(sampv));
+	}
+
+	/* already played out */
+	err = put_samp(ab, 3 * TS_FRAME, frame[3], TS_FRAME);
+	TEST_ERR(err);
+
+	aubuf_stats_get(ab, &stats);
+	TEST_EQUALS(1, stats.dup);
+	TEST_EQUALS(1, stats.late);
+	TEST_EQUALS(0, stats.lost);
+
+	for (i=4; i<6; i++) {
+		aubuf_read_samp(ab, sampv, TS_FRAME);
+		TEST_MEMCMP(frame[i], sampv, sizeof(sampv));
+	}
+
+ out:
+	mem_deref(ab);
+
+	return err;
+}
+
+
+/*
+ * A timestamp jump back, as after a sender restart, starts a new
+ * stream that is played after the frames of the old one. A smaller
+ * jump back is taken while the buffer is filling after an underrun.
+ */
+int test_aubuf_ts_jump(void)
+{
+	int16_t frame[8][TS_FRAME], sampv[TS_FRAME];
+	struct aubuf_stats stats;
+	struct aubuf *ab = NULL;
+	size_t i, j;
+	int err;
+
+	for (i=0; i<ARRAY_SIZE(frame); i++) {
+		for (j=0; j<TS_FRAME; j++)
+			frame[i][j] = (int16_t)(1000 * i + j + 1);
+	}
+
+	err = aubuf_alloc(&ab, 2 * sizeof(sampv), 0);
+	TEST_ERR(err);
+
+	for (i=0; i<4; i++) {
+		err = put_samp(ab, 48000 + i * TS_FRAME, frame[i], TS_FRAME);
+		TEST_ERR(err);
+	}
+
+	for (i=0; i<2; i++) {
+		aubuf_read_samp(ab, sampv, TS_FRAME);
+		TEST_MEMCMP(frame[i], sampv, sizeof(sampv));
+	}
+
+	for (i=4; i<8; i++) {
+		err = put_samp(ab, (i - 4) * TS_FRAME, frame[i], TS_FRAME);
+		TEST_ERR(err);
+	}
+
+	for (i=2; i<8; i++) {
+		aubuf_read_samp(ab, sampv, TS_FRAME);
+		TEST_MEMCMP(frame[i], sampv, sizeof(sampv));
+	}
+
+	/* underrun, the buffer is filling */
+	aubuf_read_samp(ab, sampv, TS_FRAME);
+	TEST_ASSERT(is_silent(sampv, TS_FRAME));
+
+	for (i=0; i<3; i++) {
+		err = put_samp(ab, (i + 1) * TS_FRAME, frame[i], TS_FRAME);
+		TEST_ERR(err);
+	}
+
+	for (i=0; i<3; i++) {
+		aubuf_read_samp(ab, sampv, TS_FRAME);
+		TEST_MEMCMP(frame[i], sampv, sizeof(sampv));
+	}
+
+	aubuf_stats_get(ab, &stats);
+	TEST_EQUALS(0, stats.late);
+	TEST_EQUALS(0, stats.dup);
+	TEST_EQUALS(0, stats.lost);
+
+ out:
+	mem_deref(ab);
+
+	return err;
+}
+
+
+/*
+ * Gaps that are shorter than a read are played as silence, or
+ * concealed with PLC, also when they start after some samples of the
+ * same read. The reads are at 0, 160, 320, .. and the gaps are at 360
+ * (after 40 samples of the third read) and at 640 (the start of the
+ * fifth read), 60 samples each.
+ */
+int test_aubuf_partial_gap(void)
+{
+	static const uint32_t putv[][2] = {
+		{0, 160}, {160, 160}, {320, 40}, {420, 60}, {480, 160},
+		{700, 100}, {800, 160}
+	};
+	static const size_t gapv[] = {0, 0, 60, 0, 60, 0};
+	int16_t frame[TS_FRAME], sampv[TS_FRAME];
+	struct aubuf_stats stats;
+	struct aubuf *ab = NULL;
+	unsigned i, plc;
+	size_t j;
+	int err = 0;
+
+	for (plc=0; plc<2; plc++) {
+
+		err = aubuf_alloc(&ab, 2 * sizeof(sampv), 0);
+		TEST_ERR(err);
+
+		if (plc) {
+			err = aubuf_set_plc(ab, STRETCH_SRATE, 1);
+			TEST_ERR(err);
+		}
+
+		for (i=0; i<ARRAY_SIZE(putv); i++) {
+
+			const uint32_t ts = putv[i][0];
+
+			for (j=0; j<putv[i][1]; j++)
+				frame[j] = ((ts + j) / 20) & 1 ? 8000 : -8000;
+
+			err = put_samp(ab, ts, frame, putv[i][1]);
+			TEST_ERR(err);
+		}
+
+		for (i=0; i<ARRAY_SIZE(gapv); i++) {
+
+			aubuf_read_samp(ab, sampv, TS_FRAME);
+
+			TEST_EQUALS(plc ? 0 : gapv[i],
+				    silent_run(sampv, TS_FRAME));
+		}
+
+		aubuf_stats_get(ab, &stats);
+		TEST_EQUALS(2, stats.lost);
+		TEST_EQUALS(0, aubuf_cur_size(ab));
+
+		ab = mem_deref(ab);
+	}
+
+ out:
+	mem_deref(ab);
+
+	return err;
+}
+
+
+/*
+ * With adaptive sizing the overrun limit is twice the wish size, so
+ * the buffer level shows the wish size. Writes with a jitter of their
+ * whole mean inter-arrival time let the buffer grow, and it is trimmed
+ * down again when the writes become regular.
+ */
+int test_aubuf_adaptive(void)
+{
+	int16_t sampv[ADAPT_FRAME];
+	struct aubuf *ab = NULL;
+	const size_t sz = sizeof(sampv);
+	unsigned i;
+	int err;
+
+	memset(sampv, 0, sizeof(sampv));
+
+	err = aubuf_alloc(&ab, 2 * sz, 20 * sz);
+	TEST_ERR(err);
+
+	aubuf_set_adaptive(ab, true);
+
+	/* 0 and 20 ms apart */
+	for (i=0; i<ADAPT_WRITES; i++) {
+
+		if (i & 1)
+			sys_usleep(20000);
+
+		err = aubuf_write_samp(ab, sampv, ADAPT_FRAME);
+		TEST_ERR(err);
+	}
+
+	TEST_ASSERT(aubuf_cur_size(ab) >= 8 * sz);
+
+	/* 10 ms apart */
+	for (i=0; i<ADAPT_WRITES; i++) {
+
+		sys_usleep(10000);
+
+		err = aubuf_write_samp(ab, sampv, ADAPT_FRAME);
+		TEST_ERR(err);
+	}
+
+	TEST_ASSERT(aubuf_cur_size(ab) <= 6 * sz);
+
+	/* back to the fixed size */
+	aubuf_set_adaptive(ab, false);
+
+	for (i=0; i<20; i++) {
+		err = aubuf_write_samp(ab, sampv, ADAPT_FRAME);
+		TEST_ERR(err);
+	}
+
+	TEST_EQUALS(20 * sz, aubuf_cur_size(ab));
+
+ out:
+	mem_deref(ab);
+
+	return err;
+}
+
+
+/* A triangle wave at 200 Hz, the pitch of the PLC test */
+static int16_t plc_wave(size_t n)
+{
+	const size_t p = n % PLC_PERIOD;
+
+	return (int16_t)((p < PLC_PERIOD/2 ? p : PLC_PERIOD - p) * 800
+			 - 8000);
+}
+
+
+static int plc_write(struct aubuf *ab, size_t *pos, unsigned framec)
+{
+	int16_t sampv[PLC_FRAME];
+	size_t i;
+	int err = 0;
+
+	while (framec-- && !err) {
+
+		for (i=0; i<PLC_FRAME; i++)
+			sampv[i] = plc_wave((*pos)++);
+
+		err = aubuf_write_samp(ab, sampv, PLC_FRAME);
+	}
+
+	return err;
+}
+
+
+static uint64_t energy(const int16_t *sampv, size_t sampc)
+{
+	uint64_t e = 0;
+	size_t i;
+
+	for (i=0; i<sampc; i++)
+		e += (uint64_t)((int32_t)sampv[i] * sampv[i]);
+
+	return e;
+}
+
+
+/*
+ * An underrun is concealed by repeating the last pitch period, fading
+ * out over 60 ms, and the audio resumes as soon as a frame arrives.
+ * Without concealment an underrun is silent.
+ */
+int test_aubuf_plc(void)
+{
+	int16_t sampv[PLC_FRAME];
+	struct aubuf *ab = NULL;
+	uint64_t e, prev;
+	size_t pos = 0, i;
+	unsigned plc, j;
+	int err = 0;
+
+	for (plc=0; plc<2; plc++) {
+
+		pos = 0;
+
+		err = aubuf_alloc(&ab, 2 * sizeof(sampv), 0);
+		TEST_ERR(err);
+
+		if (plc) {
+			err = aubuf_set_plc(ab, PLC_SRATE, 1);
+			TEST_ERR(err);
+		}
+
+		err = plc_write(ab, &pos, 4);
+		TEST_ERR(err);
+
+		for (j=0; j<4; j++) {
+			aubuf_read_samp(ab, sampv, PLC_FRAME);
+
+			for (i=0; i<PLC_FRAME; i++) {
+				TEST_EQUALS(plc_wave(j * PLC_FRAME + i),
+					    sampv[i]);
+			}
+		}
+
+		/* lost frame, the wave continues and fades out */
+		aubuf_read_samp(ab, sampv, PLC_FRAME);
+
+		if (!plc) {
+			TEST_ASSERT(is_silent(sampv, PLC_FRAME));
+			ab = mem_deref(ab);
+			continue;
+		}
+
+		for (i=0; i<PLC_FRAME; i++) {
+
+			const int x = plc_wave(pos + i);
+
+			TEST_ASSERT(abs(sampv[i] - x) <=
+				    abs(x) * (int)(i + 1) / 400 + 1);
+		}
+
+		/* resumes with one frame, after a short cross-fade */
+		pos += PLC_FRAME;
+		err = plc_write(ab, &pos, 1);
+		TEST_ERR(err);
+
+		aubuf_read_samp(ab, sampv, PLC_FRAME);
+
+		for (i=PLC_PERIOD; i<PLC_FRAME; i++) {
+			TEST_EQUALS(plc_wave(pos - PLC_FRAME + i), sampv[i]);
+		}
+
+		/* three frames of fading concealment, then silence */
+		prev = energy(sampv, PLC_FRAME);
+
+		for (j=0; j<3; j++) {
+			aubuf_read_samp(ab, sampv, PLC_FRAME);
+
+			e = energy(sampv, PLC_FRAME);
+			TEST_ASSERT(e > 0 && e < prev);
+			prev = e;
+		}
+
+		aubuf_read_samp(ab, sampv, PLC_FRAME);
+		TEST_ASSERT(is_silent(sampv, PLC_FRAME));
+
+		ab = mem_deref(ab);
+	}
+
+ out:
+	mem_deref(ab);
+
+	return err;
+}
+
+
+static int peek_write(struct aubuf *ab, int16_t *seq, size_t sampc)
+{
+	int16_t sampv[PEEK_FRAME];
+	size_t i;
+
+	for (i=0; i<sampc; i++)
+		sampv[i] = (*seq)++;
+
+	return aubuf_write_samp(ab, sampv, sampc);
+}
+
+
+/* Check the peeked spans against the sequence from seq */
+static bool peek_check(const struct aubuf_span *span, int16_t seq)
+{
+	size_t k, i;
+
+	for (k=0; k<2; k++) {
+
+		const int16_t *v = (const int16_t *)(const void *)span->p[k];
+
+		for (i=0; i<span->sz[k] / 2; i++) {
+			if (v[i] != seq++)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * Peeked samples are the same as read samples, in one or two spans
+ * when they wrap around the end of the ring, and stay in the buffer
+ * until they are consumed. At most the peeked samples are consumed.
+ */
+int test_aubuf_peek(void)
+{
+	const size_t sz = PEEK_FRAME * 2;
+	int16_t sampv[PEEK_FRAME];
+	struct aubuf_stats stats;
+	struct aubuf_span span;
+	struct aubuf *ab = NULL;
+	int16_t wseq = 0, rseq = 0;
+	unsigned i, wraps = 0;
+	int err;
+
+	err = aubuf_alloc(&ab, 2 * sz, 6 * sz);
+	TEST_ERR(err);
+	TEST_EQUALS(ENOTSUP, aubuf_peek(ab, sz, &span));
+	ab = mem_deref(ab);
+
+	err = aubuf_alloc_ring(&ab, 2 * sz, 6 * sz);
+	TEST_ERR(err);
+
+	/* filling up to the minimum size */
+	err = peek_write(ab, &wseq, PEEK_FRAME);
+	TEST_ERR(err);
+	TEST_EQUALS(ENODATA, aubuf_peek(ab, sz, &span));
+
+	err = peek_write(ab, &wseq, PEEK_FRAME);
+	TEST_ERR(err);
+
+	for (i=0; i<PEEK_ROUNDS; i++) {
+
+		err = peek_write(ab, &wseq, PEEK_FRAME);
+		TEST_ERR(err);
+
+		err = aubuf_peek(ab, sz, &span);
+		TEST_ERR(err);
+		TEST_EQUALS(sz, span.sz[0] + span.sz[1]);
+		TEST_ASSERT(peek_check(&span, rseq));
+
+		if (span.sz[1])
+			++wraps;
+
+		/* the same samples until consumed */
+		err = aubuf_peek(ab, sz, &span);
+		TEST_ERR(err);
+		TEST_ASSERT(peek_check(&span, rseq));
+
+		/* half a frame, then a read of the other half */
+		aubuf_consume(ab, sz / 2);
+		rseq += PEEK_FRAME / 2;
+
+		aubuf_read_samp(ab, sampv, PEEK_FRAME / 2);
+		span.p[0]  = (const uint8_t *)sampv;
+		span.sz[0] = sz / 2;
+		span.sz[1] = 0;
+		TEST_ASSERT(peek_check(&span, rseq));
+		rseq += PEEK_FRAME / 2;
+	}
+
+	TEST_ASSERT(wraps > 0);
+
+	/* nothing is consumed without a peek, or beyond the peek */
+	aubuf_consume(ab, sz);
+
+	err = aubuf_peek(ab, sz / 2, &span);
+	TEST_ERR(err);
+	TEST_ASSERT(peek_check(&span, rseq));
+
+	aubuf_consume(ab, 4 * sz);
+	aubuf_consume(ab, sz);
+	rseq += PEEK_FRAME / 2;
+
+	aubuf_read_samp(ab, sampv, PEEK_FRAME);
+	span.p[0]  = (const uint8_t *)sampv;
+	span.sz[0] = sz;
+	span.sz[1] = 0;
+	TEST_ASSERT(peek_check(&span, rseq));
+	rseq += PEEK_FRAME;
+
+	/* half a frame is left, a consume after ENODATA does nothing */
+	TEST_EQUALS(ENODATA, aubuf_peek(ab, sz, &span));
+	aubuf_consume(ab, sz);
+
+	err = peek_write(ab, &wseq, PEEK_FRAME);
+	TEST_ERR(err);
+	err = peek_write(ab, &wseq, PEEK_FRAME);
+	TEST_ERR(err);
+
+	aubuf_read_samp(ab, sampv, PEEK_FRAME);
+	TEST_ASSERT(peek_check(&span, rseq));
+
+	aubuf_stats_get(ab, &stats);
+	TEST_EQUALS(0, stats.overrun);
+
+	/* concealment is not applied to peeked samples */
+	err = aubuf_set_plc(ab, 8000, 1);
+	TEST_ERR(err);
+	TEST_EQUALS(ENOTSUP, aubuf_peek(ab, sz, &span));
+
+ out:
+	mem_deref(ab);
+
+	return err;
+}
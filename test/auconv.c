@@ -0,0 +1,483 @@
+/**
+ * @file test/auconv.c  Selftest -- audio sample format conversion
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <math.h>
+#include <string.h>
+#include <re.h>
+#include <rem.h>
+#include "auconv/auconv.h"
+#include "test.h"
+
+
+enum {
+	CONV_MAX     = 100,
+	BENCH_SAMPC  = 1920,
+	BENCH_ROUNDS = 20000,
+	REMIX_FRAMES = 4800,
+	REMIX_MAX    = 1024,
+};
+
+
+/*
+ * Random samples, samples next to a rounding boundary and ties that
+ * must round to even, full scale and just beyond it, NaN that must give
+ * silence, and values far out of range that must saturate
+ */
+static void fill(int16_t *v, float *fv, uint8_t *bv, size_t n,
+		 unsigned pattern)
+{
+	static const float edgev[] = {
+		1.0f, -1.0f, 0.99998474f, -0.99998474f, 1.0000001f,
+		-1.0000001f, 0.0f, -0.0f, 1.5258789e-05f, -1.5258789e-05f,
+		NAN, -NAN
+	};
+	static const float deltav[] = {-0.5f, -0.25f, 0.25f, 0.5f};
+	size_t i;
+
+	for (i=0; i<n; i++) {
+
+		v[i] = test_rand_s16();
+
+		switch (pattern) {
+
+		case 0:
+			fv[i] = (float)(int32_t)test_rand() / 1073741824.0f;
+			break;
+
+		case 1:
+			/* x * 2^31 within half an LSB of an int16 step */
+			fv[i] = ((v[i] >> 9) * 65536.0f +
+				 deltav[test_rand() % ARRAY_SIZE(deltav)]) /
+				2147483648.0f;
+			break;
+
+		case 2:
+			v[i]  = (test_rand() & 0x100) ? INT16_MAX : INT16_MIN;
+			fv[i] = edgev[test_rand() % ARRAY_SIZE(edgev)];
+			break;
+
+		default:
+			fv[i] = (test_rand() & 0x100) ? 1e9f : -65536.0f;
+			break;
+		}
+
+		bv[3*i]   = (uint8_t)test_rand();
+		bv[3*i+1] = (uint8_t)(v[i] & 0xff);
+		bv[3*i+2] = (uint8_t)(v[i] >> 8);
+	}
+}
+
+
+static int test_kernel(const struct auconv_kernel *kern, size_t n,
+		       unsigned pattern, size_t off)
+{
+	const struct auconv_kernel *ref = &auconv_kernel_scalar;
+	int16_t sampv[CONV_MAX + 1], out[CONV_MAX], rout[CONV_MAX];
+	float fsampv[CONV_MAX + 1], fout[CONV_MAX], rfout[CONV_MAX];
+	uint8_t bsampv[3 * (CONV_MAX + 1)];
+	uint8_t bout[3 * CONV_MAX], rbout[3 * CONV_MAX];
+	int err = 0;
+
+	fill(sampv, fsampv, bsampv, n + off, pattern);
+
+	ref->s16_to_float(rfout, sampv + off, n);
+	kern->s16_to_float(fout, sampv + off, n);
+	TEST_MEMCMP(rfout, fout, n * sizeof(fout[0]));
+
+	ref->float_to_s16(rout, fsampv + off, n);
+	kern->float_to_s16(out, fsampv + off, n);
+	TEST_MEMCMP(rout, out, n * sizeof(out[0]));
+
+	ref->s16_to_s24(rbout, sampv + off, n);
+	kern->s16_to_s24(bout, sampv + off, n);
+	TEST_MEMCMP(rbout, bout, 3 * n);
+
+	ref->s24_to_s16(rout, bsampv + 3 * off, n);
+	kern->s24_to_s16(out, bsampv + 3 * off, n);
+	TEST_MEMCMP(rout, out, n * sizeof(out[0]));
+
+ out:
+	return err;
+}
+
+
+int test_auconv_kernel(void)
+{
+	const struct auconv_kernel *kern;
+	unsigned k, pattern;
+	size_t n, off;
+	int err = 0;
+
+	for (k=0; (kern = auconv_kernel_get(k)); k++) {
+
+		for (n=0; n<=CONV_MAX; n++) {
+			for (pattern=0; pattern<4; pattern++) {
+				for (off=0; off<2; off++) {
+
+					err = test_kernel(kern, n, pattern,
+							  off);
+					if (err) {
+						(void)re_fprintf(stderr,
+							"kernel %s, %zu\n",
+							kern->name, n);
+						return err;
+					}
+				}
+			}
+		}
+	}
+
+	return err;
+}
+
+
+static size_t sample_size(enum aufmt fmt)
+{
+	switch (fmt) {
+
+	case AUFMT_FLOAT:   return sizeof(float);
+	case AUFMT_S24_3LE: return 3;
+	default:            return sizeof(int16_t);
+	}
+}
+
+
+/* Sample of channel k in frame i, as float, with the scalar kernels */
+static float sample_get(const void * const *v,
+			const struct auconv_layout *l, size_t i, unsigned k)
+{
+	const struct auconv_kernel *ref = &auconv_kernel_scalar;
+	const size_t idx = l->planar ? i : i * l->ch + k;
+	const void *p = v[l->planar ? k : 0];
+	int16_t s;
+	float f;
+
+	switch (l->fmt) {
+
+	case AUFMT_FLOAT:
+		return ((const float *)p)[idx];
+
+	case AUFMT_S24_3LE:
+		ref->s24_to_s16(&s, (const uint8_t *)p + 3 * idx, 1);
+		break;
+
+	default:
+		s = ((const int16_t *)p)[idx];
+		break;
+	}
+
+	ref->s16_to_float(&f, &s, 1);
+
+	return f;
+}
+
+
+/*
+ * Gain of input channel k in output channel d, as documented for
+ * auconv_remix()
+ */
+static float remix_gain(unsigned och, unsigned ich, unsigned d, unsigned k)
+{
+	const float c = 0.70710678f;
+	const float g = 1.0f / (1.0f + 2*c);
+
+	if (och == ich)
+		return d == k ? 1.0f : 0.0f;
+
+	if (ich == 6 && och <= 2) {
+
+		const float gv[2][6] = {
+			{g, 0, c * g, 0, c * g, 0},
+			{0, g, c * g, 0, 0, c * g}
+		};
+
+		return och == 1 ? (gv[0][k] + gv[1][k]) / 2 : gv[d][k];
+	}
+
+	if (och == 1)
+		return 1.0f / ich;
+
+	if (ich == 1 && och == 6)
+		return d == 2 ? 1.0f : 0.0f;
+
+	if (ich == 1)
+		return d < 2 ? 1.0f : 0.0f;
+
+	return d == k ? 1.0f : 0.0f;
+}
+
+
+static int test_remix(const struct auconv_layout *dl,
+		      const struct auconv_layout *sl, size_t frames)
+{
+	const size_t ssz = sample_size(sl->fmt);
+	const size_t dsz = sample_size(dl->fmt);
+	const float tol = dl->fmt == AUFMT_FLOAT ? 1e-6f : 1.5f / 32768;
+	void *srcv[AUCONV_CH_MAX], *dstv[AUCONV_CH_MAX];
+	uint8_t *src, *dst;
+	unsigned d, k;
+	size_t i;
+	int err = 0;
+
+	src = mem_alloc(AUCONV_CH_MAX * REMIX_MAX * ssz, NULL);
+	dst = mem_alloc(AUCONV_CH_MAX * REMIX_MAX * dsz, NULL);
+	if (!src || !dst) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (k=0; k<AUCONV_CH_MAX; k++) {
+		srcv[k] = src + k * REMIX_MAX * ssz;
+		dstv[k] = dst + k * REMIX_MAX * dsz;
+	}
+
+	for (i=0; i<AUCONV_CH_MAX * REMIX_MAX; i++) {
+
+		if (sl->fmt == AUFMT_FLOAT) {
+			((float *)(void *)src)[i] =
+				(float)(int32_t)test_rand() / 2147483648.0f;
+		}
+		else if (sl->fmt == AUFMT_S24_3LE) {
+			src[3*i]   = (uint8_t)test_rand();
+			src[3*i+1] = (uint8_t)test_rand();
+			src[3*i+2] = (uint8_t)test_rand();
+		}
+		else {
+			((int16_t *)(void *)src)[i] = test_rand_s16();
+		}
+	}
+
+	err = auconv_remix(dstv, dl, (const void * const *)srcv, sl,
+			   frames);
+	TEST_ERR(err);
+
+	for (i=0; i<frames; i++) {
+
+		for (d=0; d<dl->ch; d++) {
+
+			float acc = 0.0f, v, e;
+
+			for (k=0; k<sl->ch; k++) {
+				acc += remix_gain(dl->ch, sl->ch, d, k) *
+					sample_get((const void * const *)srcv,
+						   sl, i, k);
+			}
+
+			v = sample_get((const void * const *)dstv, dl, i, d);
+			e = v > acc ? v - acc : acc - v;
+
+			if (e > tol) {
+				(void)re_fprintf(stderr, "frame %zu ch %u:"
+						 " %f != %f\n", i, d,
+						 (double)v, (double)acc);
+				err = EBADMSG;
+				goto out;
+			}
+		}
+	}
+
+ out:
+	mem_deref(dst);
+	mem_deref(src);
+
+	return err;
+}
+
+
+/*
+ * Channel remixing against a scalar reference, with every format and
+ * layout on both sides, and frame counts around the block size of each
+ * conversion and not a multiple of the kernel vector
+ */
+int test_auconv_remix(void)
+{
+	static const unsigned chv[][2] = {
+		{6, 2}, {6, 1}, {2, 1}, {1, 2}, {1, 6}, {2, 2}
+	};
+	static const enum aufmt fmtv[] = {
+		AUFMT_S16LE, AUFMT_FLOAT, AUFMT_S24_3LE
+	};
+	static const size_t framev[] = {
+		1, 15, 17, 79, 80, 81, 255, 256, 257, 1001
+	};
+	const size_t fmtc = ARRAY_SIZE(fmtv);
+	struct auconv_layout sl, dl;
+	size_t c, f, i;
+	int err = 0;
+
+	for (c=0; c<ARRAY_SIZE(chv); c++) {
+
+		/* input and output format, planar input and output */
+		for (i=0; i<fmtc * fmtc * 4; i++) {
+
+			sl.fmt    = fmtv[i % fmtc];
+			sl.ch     = chv[c][0];
+			sl.planar = (i / (fmtc * fmtc)) & 1;
+			dl.fmt    = fmtv[i / fmtc % fmtc];
+			dl.ch     = chv[c][1];
+			dl.planar = (i / (fmtc * fmtc)) & 2;
+
+			for (f=0; f<ARRAY_SIZE(framev); f++) {
+
+				err = test_remix(&dl, &sl, framev[f]);
+				if (err)
+					goto out;
+			}
+		}
+	}
+
+ out:
+	if (err) {
+		(void)re_fprintf(stderr, "remix %u %s%s to %u %s%s,"
+				 " %zu frames\n",
+				 sl.ch, aufmt_name(sl.fmt),
+				 sl.planar ? " planar" : "",
+				 dl.ch, aufmt_name(dl.fmt),
+				 dl.planar ? " planar" : "", framev[f]);
+	}
+
+	return err;
+}
+
+
+/* Each kernel set, in [us] per 20 ms of 48 kHz stereo */
+int perf_auconv_kernel(void)
+{
+	const struct auconv_kernel *kern;
+	int16_t *sampv;
+	float *fsampv;
+	uint8_t *bsampv;
+	unsigned k, r;
+	uint64_t t[4];
+	int err = 0;
+
+	sampv  = mem_alloc(BENCH_SAMPC * sizeof(*sampv), NULL);
+	fsampv = mem_alloc(BENCH_SAMPC * sizeof(*fsampv), NULL);
+	bsampv = mem_alloc(BENCH_SAMPC * 3, NULL);
+	if (!sampv || !fsampv || !bsampv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	fill(sampv, fsampv, bsampv, BENCH_SAMPC, 0);
+
+	(void)re_fprintf(stderr, "\n%-8s %9s %9s %9s %9s\n", "kernel",
+			 "s16>flt", "flt>s16", "s16>s24", "s24>s16");
+
+	for (k=0; (kern = auconv_kernel_get(k)); k++) {
+
+		t[0] = test_ns();
+		for (r=0; r<BENCH_ROUNDS; r++)
+			kern->s16_to_float(fsampv, sampv, BENCH_SAMPC);
+
+		t[1] = test_ns();
+		for (r=0; r<BENCH_ROUNDS; r++)
+			kern->float_to_s16(sampv, fsampv, BENCH_SAMPC);
+
+		t[2] = test_ns();
+		for (r=0; r<BENCH_ROUNDS; r++)
+			kern->s16_to_s24(bsampv, sampv, BENCH_SAMPC);
+
+		t[3] = test_ns();
+		for (r=0; r<BENCH_ROUNDS; r++)
+			kern->s24_to_s16(sampv, bsampv, BENCH_SAMPC);
+
+		(void)re_fprintf(stderr, "%-8s %9.2f %9.2f %9.2f %9.2f\n",
+				 kern->name,
+				 (t[1] - t[0]) / (BENCH_ROUNDS * 1000.0),
+				 (t[2] - t[1]) / (BENCH_ROUNDS * 1000.0),
+				 (t[3] - t[2]) / (BENCH_ROUNDS * 1000.0),
+				 (test_ns() - t[3]) / (BENCH_ROUNDS * 1000.0));
+	}
+
+ out:
+	mem_deref(bsampv);
+	mem_deref(fsampv);
+	mem_deref(sampv);
+
+	return err;
+}
+
+
+/*
+ * 5.1 to stereo S16 in one pass, against converting to float, remixing
+ * and converting back in three passes over the whole buffer, in [ns]
+ * per frame
+ */
+int perf_auconv_remix(void)
+{
+	static const size_t framev[] = {160, 480, 960, 4800};
+	const float c = 0.70710678f;
+	const float g = 1.0f / (1.0f + 2*c);
+	struct auconv_layout sl = {AUFMT_S16LE, 6, false};
+	struct auconv_layout dl = {AUFMT_S16LE, 2, false};
+	int16_t *sampv, *outv;
+	float *fsampv, *fmixv;
+	unsigned r, rounds;
+	uint64_t t[3];
+	size_t f, i, n;
+	int err = 0;
+
+	sampv  = mem_alloc(6 * REMIX_FRAMES * sizeof(*sampv), NULL);
+	outv   = mem_alloc(2 * REMIX_FRAMES * sizeof(*outv), NULL);
+	fsampv = mem_alloc(6 * REMIX_FRAMES * sizeof(*fsampv), NULL);
+	fmixv  = mem_alloc(2 * REMIX_FRAMES * sizeof(*fmixv), NULL);
+	if (!sampv || !outv || !fsampv || !fmixv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	for (i=0; i<6 * REMIX_FRAMES; i++)
+		sampv[i] = test_rand_s16();
+
+	(void)re_fprintf(stderr, "\n%6s %9s %9s\n", "frames", "remix",
+			 "3-pass");
+
+	for (f=0; f<ARRAY_SIZE(framev); f++) {
+
+		const void *srcv[1] = {sampv};
+		void *dstv[1] = {outv};
+
+		n = framev[f];
+		rounds = (unsigned)(REMIX_FRAMES * 100 / n);
+
+		t[0] = test_ns();
+		for (r=0; r<rounds; r++) {
+			err = auconv_remix(dstv, &dl, srcv, &sl, n);
+			TEST_ERR(err);
+		}
+
+		t[1] = test_ns();
+		for (r=0; r<rounds; r++) {
+
+			auconv_from_s16(AUFMT_FLOAT, fsampv, sampv, 6 * n);
+
+			for (i=0; i<n; i++) {
+
+				const float *x = &fsampv[6*i];
+
+				fmixv[2*i]   = g * (x[0] + c*x[2] + c*x[4]);
+				fmixv[2*i+1] = g * (x[1] + c*x[2] + c*x[5]);
+			}
+
+			auconv_to_s16(outv, AUFMT_FLOAT, fmixv, 2 * n);
+		}
+
+		t[2] = test_ns();
+
+		(void)re_fprintf(stderr, "%6zu %9.2f %9.2f\n", n,
+				 (t[1] - t[0]) / ((double)rounds * n),
+				 (t[2] - t[1]) / ((double)rounds * n));
+	}
+
+ out:
+	mem_deref(fmixv);
+	mem_deref(fsampv);
+	mem_deref(outv);
+	mem_deref(sampv);
+
+	return err;
+}
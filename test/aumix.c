@@ -0,0 +1,1528 @@
+/**
+ * @file test/aumix.c  Selftest -- audio mixer
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <re.h>
+#include <rem.h>
+#include "aumix/aumix.h"
+#include "test.h"
+
+
+enum {
+	KERN_MAX = 100,
+	KERN_SRC = 4,
+	PROMPT_SRATE = 8000,
+	PROMPT_PTIME = 20,
+	PROMPT_FRAME = PROMPT_SRATE * PROMPT_PTIME / 1000,
+	TICK_SRATE   = 8000,
+	TICK_PTIME   = 10,
+	TICK_FRAME   = TICK_SRATE * TICK_PTIME / 1000,
+	TICK_MAX     = 960,
+	TICK_FILL    = 6,
+	DEADLINE_PTIME = 40,
+};
+
+
+#define PROMPT_FILE "remtest_prompt.wav"
+
+
+struct prompt_test {
+	pthread_mutex_t mutex;
+	int16_t frame[2][PROMPT_FRAME];
+	float ffv[2][PROMPT_FRAME];
+	unsigned framec;
+};
+
+/*
+ * Mixers that are run by the test, one frame at a time. They are on an
+ * engine whose only worker is held in the frame handler of another
+ * mixer, so that the worker does not run them.
+ */
+struct tick_env {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct aumix_engine *eng;
+	struct aumix *hold;
+	struct aumix_source *hold_src;
+	struct aumix_scratch sc;
+	uint64_t now;
+	bool held;
+	bool release;
+};
+
+/* A source of a mixer run by the test, with its last output frame */
+struct tick_src {
+	struct aumix_source *src;
+	int16_t frame[TICK_MAX];
+	float ffv[TICK_MAX];
+	size_t sampc;
+	unsigned framec;
+};
+
+struct engine_test {
+	pthread_mutex_t mutex;
+	struct aumix_engine *eng;
+	struct aumix *mix_b;
+	struct aumix_source *src_b;
+	unsigned framec_a;
+	unsigned framec_b;
+	bool released;
+	int err;
+};
+
+
+/*
+ * Sources at full scale, so that the accumulator goes beyond 16 bits
+ * and the mix-minus output saturates
+ */
+static void fill(int16_t *v, float *fv, size_t n, unsigned pattern)
+{
+	size_t i;
+
+	for (i=0; i<n; i++) {
+
+		switch (pattern) {
+
+		case 0:
+			v[i] = test_rand_s16();
+			break;
+
+		case 1:
+			v[i] = INT16_MIN;
+			break;
+
+		case 2:
+			v[i] = INT16_MAX;
+			break;
+
+		default:
+			v[i] = (test_rand() & 0x100) ? INT16_MAX : INT16_MIN;
+			break;
+		}
+
+		fv[i] = v[i] / 16384.0f;
+	}
+}
+
+
+static int test_kernel(const struct aumix_kernel *kern, size_t n,
+		       unsigned pattern, size_t off)
+{
+	const struct aumix_kernel *ref = &aumix_kernel_scalar;
+	int16_t sampv[KERN_SRC][KERN_MAX + 1];
+	float fsampv[KERN_SRC][KERN_MAX + 1];
+	int32_t acc[KERN_MAX + 1], racc[KERN_MAX + 1];
+	float facc[KERN_MAX + 1], rfacc[KERN_MAX + 1];
+	int16_t out[KERN_MAX + 1], rout[KERN_MAX + 1];
+	float fout[KERN_MAX + 1], rfout[KERN_MAX + 1];
+	unsigned s;
+	int err = 0;
+
+	for (s=0; s<KERN_SRC; s++)
+		fill(sampv[s], fsampv[s], n + off, pattern);
+
+	ref->load(racc, sampv[0] + off, n);
+	kern->load(acc, sampv[0] + off, n);
+	TEST_MEMCMP(racc, acc, n * sizeof(acc[0]));
+
+	memcpy(rfacc, fsampv[0] + off, n * sizeof(float));
+	memcpy(facc, fsampv[0] + off, n * sizeof(float));
+
+	for (s=1; s<KERN_SRC; s++) {
+
+		ref->accum(racc, sampv[s] + off, n);
+		kern->accum(acc, sampv[s] + off, n);
+		TEST_MEMCMP(racc, acc, n * sizeof(acc[0]));
+
+		ref->accumf(rfacc, fsampv[s] + off, n);
+		kern->accumf(facc, fsampv[s] + off, n);
+		TEST_MEMCMP(rfacc, facc, n * sizeof(facc[0]));
+	}
+
+	for (s=0; s<KERN_SRC; s++) {
+
+		ref->minus(rout, racc, sampv[s] + off, n);
+		kern->minus(out, acc, sampv[s] + off, n);
+		TEST_MEMCMP(rout, out, n * sizeof(out[0]));
+
+		ref->minusf(rfout, rfacc, fsampv[s] + off, n);
+		kern->minusf(fout, facc, fsampv[s] + off, n);
+		TEST_MEMCMP(rfout, fout, n * sizeof(fout[0]));
+	}
+
+ out:
+	return err;
+}
+
+
+/*
+ * A NaN in the float mix is passed through by all kernels, as they must
+ * give the same output, and infinities are clipped
+ */
+static int test_kernel_nan(const struct aumix_kernel *kern)
+{
+	float accv[KERN_MAX], sampv[KERN_MAX], outv[KERN_MAX];
+	size_t i;
+	int err = 0;
+
+	for (i=0; i<KERN_MAX; i++) {
+
+		sampv[i] = 0.25f;
+
+		switch (i % 5) {
+
+		case 0:  accv[i] = NAN;       break;
+		case 1:  accv[i] = INFINITY;  break;
+		case 2:  accv[i] = -INFINITY; break;
+		default: accv[i] = 0.5f;      break;
+		}
+	}
+
+	sampv[KERN_MAX - 1] = NAN;
+
+	kern->minusf(outv, accv, sampv, KERN_MAX);
+
+	for (i=0; i<KERN_MAX; i++) {
+
+		if (i % 5 == 0 || i == KERN_MAX - 1) {
+			TEST_ASSERT(isnan(outv[i]));
+		}
+		else if (i % 5 == 1) {
+			TEST_ASSERT(outv[i] == 1.0f);
+		}
+		else if (i % 5 == 2) {
+			TEST_ASSERT(outv[i] == -1.0f);
+		}
+		else {
+			TEST_ASSERT(outv[i] == 0.25f);
+		}
+	}
+
+	kern->accumf(accv, sampv, KERN_MAX);
+
+	for (i=0; i<KERN_MAX; i++)
+		TEST_EQUALS(i % 5 == 0 || i == KERN_MAX - 1,
+			    isnan(accv[i]) != 0);
+
+ out:
+	return err;
+}
+
+
+int test_aumix_kernel(void)
+{
+	const struct aumix_kernel *kern;
+	unsigned k, pattern;
+	size_t n, off;
+	int err = 0;
+
+	for (k=0; (kern = aumix_kernel_get(k)); k++) {
+
+		err = test_kernel_nan(kern);
+		if (err) {
+			(void)re_fprintf(stderr, "kernel %s, NaN\n",
+					 kern->name);
+			return err;
+		}
+
+		for (n=0; n<=KERN_MAX; n++) {
+			for (pattern=0; pattern<4; pattern++) {
+				for (off=0; off<2; off++) {
+
+					err = test_kernel(kern, n, pattern,
+							  off);
+					if (err) {
+						(void)re_fprintf(stderr,
+							"kernel %s, %zu samples\n",
+							kern->name, n);
+						return err;
+					}
+				}
+			}
+		}
+	}
+
+	return err;
+}
+
+
+/* The frames of the mixer and of its sources hold whole samples */
+int test_aumix_ptime(void)
+{
+	struct aumix_source *src = NULL;
+	struct aumix *mix = NULL;
+	int err;
+
+	TEST_EQUALS(EINVAL, aumix_alloc(&mix, 11025, 1, 20));
+	TEST_EQUALS(EINVAL, aumix_alloc(&mix, 44100, 2, 5));
+	TEST_ASSERT(mix == NULL);
+
+	err = aumix_alloc(&mix, 11025, 1, 40);
+	TEST_ERR(err);
+	mix = mem_deref(mix);
+
+	err = aumix_alloc(&mix, 8000, 1, 20);
+	TEST_ERR(err);
+
+	TEST_EQUALS(EINVAL, aumix_source_alloc_fmt(&src, mix, 11025, 1,
+						   NULL, NULL));
+	TEST_ASSERT(src == NULL);
+
+	err = aumix_source_alloc_fmt(&src, mix, 44100, 2, NULL, NULL);
+	TEST_ERR(err);
+
+ out:
+	mem_deref(src);
+	mem_deref(mix);
+
+	return err;
+}
+
+
+static void prompt_frame_handler(const int16_t *sampv, size_t sampc,
+				 void *arg)
+{
+	struct prompt_test *pt = arg;
+
+	pthread_mutex_lock(&pt->mutex);
+
+	if (pt->framec < 2 && sampc == PROMPT_FRAME)
+		memcpy(pt->frame[pt->framec], sampv, sizeof(pt->frame[0]));
+
+	++pt->framec;
+
+	pthread_mutex_unlock(&pt->mutex);
+}
+
+
+static void prompt_float_handler(const float *sampv, size_t sampc,
+				 void *arg)
+{
+	struct prompt_test *pt = arg;
+
+	pthread_mutex_lock(&pt->mutex);
+
+	if (pt->framec < 2 && sampc == PROMPT_FRAME)
+		memcpy(pt->ffv[pt->framec], sampv, sizeof(pt->ffv[0]));
+
+	++pt->framec;
+
+	pthread_mutex_unlock(&pt->mutex);
+}
+
+
+static int write_prompt(const int16_t *sampv, size_t sampc)
+{
+	struct aufile_prm prm;
+	struct aufile *af;
+	int err;
+
+	prm.srate    = PROMPT_SRATE;
+	prm.channels = 1;
+	prm.fmt      = AUFMT_S16LE;
+
+	err = aufile_open(&af, &prm, PROMPT_FILE, AUFILE_WRITE);
+	if (err)
+		return err;
+
+	err = aufile_write(af, (const uint8_t *)sampv, sampc * 2);
+
+	mem_deref(af);
+
+	return err;
+}
+
+
+/*
+ * The cache is flushed while the prompt is playing, so that the mixer
+ * holds the last reference to it when the prompt ends
+ */
+static int test_prompt(size_t sampc, enum aufmt fmt)
+{
+	struct aumix_source *src = NULL;
+	struct aumix *mix = NULL;
+	struct prompt_test pt;
+	int16_t sampv[PROMPT_FRAME], ref[2][PROMPT_FRAME];
+	float fref[2][PROMPT_FRAME];
+	unsigned framec, i;
+	int err;
+
+	memset(&pt, 0, sizeof(pt));
+	memset(ref, 0, sizeof(ref));
+	pthread_mutex_init(&pt.mutex, NULL);
+
+	for (i=0; i<sampc; i++)
+		sampv[i] = test_rand_s16();
+
+	memcpy(ref[0], sampv, sampc * sizeof(sampv[0]));
+	auconv_from_s16(AUFMT_FLOAT, fref, ref[0], 2 * PROMPT_FRAME);
+
+	err = write_prompt(sampv, sampc);
+	TEST_ERR(err);
+
+	err = aumix_alloc_fmt(&mix, NULL, PROMPT_SRATE, 1, PROMPT_PTIME,
+			      fmt);
+	TEST_ERR(err);
+
+	if (fmt == AUFMT_FLOAT)
+		err = aumix_source_alloc_float(&src, mix, PROMPT_SRATE, 1,
+					       prompt_float_handler, &pt);
+	else
+		err = aumix_source_alloc(&src, mix, prompt_frame_handler,
+					 &pt);
+	TEST_ERR(err);
+
+	err = aumix_playfile(mix, PROMPT_FILE);
+	TEST_ERR(err);
+
+	aumix_prompt_flush();
+
+	aumix_source_enable(src, true);
+
+	for (i=0; i<200; i++) {
+
+		pthread_mutex_lock(&pt.mutex);
+		framec = pt.framec;
+		pthread_mutex_unlock(&pt.mutex);
+
+		if (framec >= 2)
+			break;
+
+		sys_usleep(10000);
+	}
+
+	aumix_source_enable(src, false);
+
+	TEST_ASSERT(pt.framec >= 2);
+
+	if (fmt == AUFMT_FLOAT) {
+		TEST_MEMCMP(fref, pt.ffv, sizeof(fref));
+	}
+	else {
+		TEST_MEMCMP(ref, pt.frame, sizeof(ref));
+	}
+
+ out:
+	mem_deref(src);
+	mem_deref(mix);
+	(void)remove(PROMPT_FILE);
+	pthread_mutex_destroy(&pt.mutex);
+
+	return err;
+}
+
+
+/*
+ * A cached prompt is loaded again when its file changes, and the end
+ * of a resampled prompt is flushed out of the resampler filter
+ */
+int test_aumix_prompt_cache(void)
+{
+	struct aumix_prompt *p1 = NULL, *p2 = NULL, *p3 = NULL;
+	int16_t sampv[2 * PROMPT_FRAME];
+	int peak = 0;
+	size_t i;
+	int err;
+
+	memset(sampv, 0, sizeof(sampv));
+	sampv[PROMPT_FRAME - 1] = 16384;
+
+	err = write_prompt(sampv, PROMPT_FRAME);
+	TEST_ERR(err);
+
+	err = aumix_prompt_get(&p1, PROMPT_FILE, 2 * PROMPT_SRATE, 1);
+	TEST_ERR(err);
+
+	err = aumix_prompt_get(&p2, PROMPT_FILE, 2 * PROMPT_SRATE, 1);
+	TEST_ERR(err);
+
+	TEST_ASSERT(p1 == p2);
+
+	/* the impulse at the last input sample must not be lost */
+	TEST_ASSERT(p1->sampc > 2 * PROMPT_FRAME);
+
+	for (i=0; i<p1->sampc; i++)
+		peak = max(peak, abs(p1->sampv[i]));
+
+	TEST_ASSERT(peak > 4096);
+
+	err = write_prompt(sampv, ARRAY_SIZE(sampv));
+	TEST_ERR(err);
+
+	err = aumix_prompt_get(&p3, PROMPT_FILE, 2 * PROMPT_SRATE, 1);
+	TEST_ERR(err);
+
+	TEST_ASSERT(p3 != p1);
+	TEST_ASSERT(p3->sampc > 4 * PROMPT_FRAME);
+
+ out:
+	aumix_prompt_put(p3);
+	aumix_prompt_put(p2);
+	aumix_prompt_put(p1);
+	aumix_prompt_flush();
+	(void)remove(PROMPT_FILE);
+
+	return err;
+}
+
+
+int test_aumix_prompt_flush(void)
+{
+	int err;
+
+	/* the last frame of the prompt is full, or padded with silence */
+	err = test_prompt(PROMPT_FRAME, AUFMT_S16LE);
+	if (err)
+		return err;
+
+	err = test_prompt(PROMPT_FRAME / 2 + 3, AUFMT_S16LE);
+	if (err)
+		return err;
+
+	return test_prompt(PROMPT_FRAME / 2 + 3, AUFMT_FLOAT);
+}
+
+
+/*
+ * The frame handler of one mixer enables a source of another mixer on
+ * the same worker, and allocates and releases a third one
+ */
+static void engine_a_handler(const int16_t *sampv, size_t sampc, void *arg)
+{
+	struct engine_test *et = arg;
+	struct aumix *mix = NULL;
+	bool first;
+	int err;
+
+	(void)sampv;
+	(void)sampc;
+
+	pthread_mutex_lock(&et->mutex);
+	first = !et->framec_a++;
+	pthread_mutex_unlock(&et->mutex);
+
+	if (!first)
+		return;
+
+	aumix_source_enable(et->src_b, true);
+
+	err = aumix_alloc_shared(&mix, et->eng, PROMPT_SRATE, 1,
+				 PROMPT_PTIME);
+	mem_deref(mix);
+
+	pthread_mutex_lock(&et->mutex);
+	et->err = err;
+	pthread_mutex_unlock(&et->mutex);
+}
+
+
+static void engine_b_handler(const int16_t *sampv, size_t sampc, void *arg)
+{
+	struct engine_test *et = arg;
+
+	(void)sampv;
+	(void)sampc;
+
+	pthread_mutex_lock(&et->mutex);
+	++et->framec_b;
+	pthread_mutex_unlock(&et->mutex);
+}
+
+
+int test_aumix_engine_reentrant(void)
+{
+	struct aumix_source *src_a = NULL;
+	struct aumix *mix_a = NULL, *mix_b = NULL;
+	struct engine_test et;
+	unsigned framec = 0, i;
+	int err;
+
+	memset(&et, 0, sizeof(et));
+	pthread_mutex_init(&et.mutex, NULL);
+
+	err = aumix_engine_alloc(&et.eng, 1);
+	TEST_ERR(err);
+
+	err = aumix_alloc_shared(&mix_a, et.eng, PROMPT_SRATE, 1,
+				 PROMPT_PTIME);
+	TEST_ERR(err);
+
+	err = aumix_alloc_shared(&mix_b, et.eng, PROMPT_SRATE, 1,
+				 PROMPT_PTIME);
+	TEST_ERR(err);
+
+	err = aumix_source_alloc(&src_a, mix_a, engine_a_handler, &et);
+	TEST_ERR(err);
+
+	err = aumix_source_alloc(&et.src_b, mix_b, engine_b_handler, &et);
+	TEST_ERR(err);
+
+	aumix_source_enable(src_a, true);
+
+	for (i=0; i<200; i++) {
+
+		pthread_mutex_lock(&et.mutex);
+		framec = et.framec_b;
+		pthread_mutex_unlock(&et.mutex);
+
+		if (framec >= 2)
+			break;
+
+		sys_usleep(10000);
+	}
+
+	/* a deadlocked worker cannot be joined, leave it */
+	if (framec < 2) {
+		test_fail(__FILE__, __LINE__, "worker deadlock");
+		return ETIMEDOUT;
+	}
+
+	TEST_ERR(et.err);
+
+ out:
+	aumix_source_enable(src_a, false);
+	aumix_source_enable(et.src_b, false);
+	mem_deref(src_a);
+	mem_deref(et.src_b);
+	mem_deref(mix_a);
+	mem_deref(mix_b);
+	mem_deref(et.eng);
+	pthread_mutex_destroy(&et.mutex);
+
+	return err;
+}
+
+
+/*
+ * The frame handler releases another mixer and the last reference of
+ * the application to the engine
+ */
+static void engine_release_handler(const int16_t *sampv, size_t sampc,
+				   void *arg)
+{
+	struct engine_test *et = arg;
+	struct aumix_engine *eng;
+	struct aumix *mix;
+
+	(void)sampv;
+	(void)sampc;
+
+	pthread_mutex_lock(&et->mutex);
+	++et->framec_a;
+	eng = et->eng;
+	mix = et->mix_b;
+	et->eng   = NULL;
+	et->mix_b = NULL;
+	pthread_mutex_unlock(&et->mutex);
+
+	mem_deref(mix);
+	mem_deref(eng);
+
+	pthread_mutex_lock(&et->mutex);
+	et->released = true;
+	pthread_mutex_unlock(&et->mutex);
+}
+
+
+int test_aumix_engine_release(void)
+{
+	struct aumix_source *src_a = NULL;
+	struct aumix *mix_a = NULL;
+	struct engine_test et;
+	unsigned framec = 0, i;
+	bool released = false;
+	int err;
+
+	memset(&et, 0, sizeof(et));
+	pthread_mutex_init(&et.mutex, NULL);
+
+	err = aumix_engine_alloc(&et.eng, 1);
+	TEST_ERR(err);
+
+	err = aumix_alloc_shared(&mix_a, et.eng, PROMPT_SRATE, 1,
+				 PROMPT_PTIME);
+	TEST_ERR(err);
+
+	err = aumix_alloc_shared(&et.mix_b, et.eng, PROMPT_SRATE, 1,
+				 PROMPT_PTIME);
+	TEST_ERR(err);
+
+	err = aumix_source_alloc(&src_a, mix_a, engine_release_handler, &et);
+	TEST_ERR(err);
+
+	aumix_source_enable(src_a, true);
+
+	for (i=0; i<200 && !released; i++) {
+
+		sys_usleep(10000);
+
+		pthread_mutex_lock(&et.mutex);
+		released = et.released;
+		pthread_mutex_unlock(&et.mutex);
+	}
+
+	if (!released) {
+		test_fail(__FILE__, __LINE__, "engine not released");
+		return ETIMEDOUT;
+	}
+
+	/* the mixer keeps running on the engine it holds */
+	for (i=0; i<200; i++) {
+
+		pthread_mutex_lock(&et.mutex);
+		framec = et.framec_a;
+		pthread_mutex_unlock(&et.mutex);
+
+		if (framec >= 3)
+			break;
+
+		sys_usleep(10000);
+	}
+
+	TEST_ASSERT(framec >= 3);
+
+ out:
+	/* the last engine reference goes with the mixer */
+	aumix_source_enable(src_a, false);
+	mem_deref(src_a);
+	mem_deref(mix_a);
+	mem_deref(et.mix_b);
+	mem_deref(et.eng);
+	pthread_mutex_destroy(&et.mutex);
+
+	return err;
+}
+
+
+static void hold_handler(const int16_t *sampv, size_t sampc, void *arg)
+{
+	struct tick_env *te = arg;
+
+	(void)sampv;
+	(void)sampc;
+
+	pthread_mutex_lock(&te->mutex);
+
+	te->held = true;
+	pthread_cond_broadcast(&te->cond);
+
+	while (!te->release)
+		pthread_cond_wait(&te->cond, &te->mutex);
+
+	pthread_mutex_unlock(&te->mutex);
+}
+
+
+static int tick_env_init(struct tick_env *te)
+{
+	bool held = false;
+	unsigned i;
+	int err;
+
+	memset(te, 0, sizeof(*te));
+	pthread_mutex_init(&te->mutex, NULL);
+	pthread_cond_init(&te->cond, NULL);
+
+	err = aumix_engine_alloc(&te->eng, 1);
+	if (err)
+		return err;
+
+	err = aumix_alloc_shared(&te->hold, te->eng, TICK_SRATE, 1,
+				 TICK_PTIME);
+	if (err)
+		return err;
+
+	err = aumix_source_alloc(&te->hold_src, te->hold, hold_handler, te);
+	if (err)
+		return err;
+
+	aumix_source_enable(te->hold_src, true);
+
+	for (i=0; i<200 && !held; i++) {
+
+		sys_usleep(10000);
+
+		pthread_mutex_lock(&te->mutex);
+		held = te->held;
+		pthread_mutex_unlock(&te->mutex);
+	}
+
+	te->now = aumix_mono_ns();
+
+	return held ? 0 : ETIMEDOUT;
+}
+
+
+static void tick_env_close(struct tick_env *te)
+{
+	pthread_mutex_lock(&te->mutex);
+	te->release = true;
+	pthread_cond_broadcast(&te->cond);
+	pthread_mutex_unlock(&te->mutex);
+
+	aumix_source_enable(te->hold_src, false);
+	mem_deref(te->hold_src);
+	mem_deref(te->hold);
+	mem_deref(te->eng);
+	aumix_scratch_reset(&te->sc);
+
+	pthread_cond_destroy(&te->cond);
+	pthread_mutex_destroy(&te->mutex);
+}
+
+
+/* Run one frame of the mixer, at its deadline */
+static void tick(struct tick_env *te, struct aumix *mix)
+{
+	te->now = aumix_process(mix, &te->sc, te->now);
+}
+
+
+static void tick_handler(const int16_t *sampv, size_t sampc, void *arg)
+{
+	struct tick_src *ts = arg;
+
+	memcpy(ts->frame, sampv, min(sampc, TICK_MAX) * sizeof(*sampv));
+	ts->sampc = sampc;
+	++ts->framec;
+}
+
+
+/* Write frames of sampc samples v + step * i to a source */
+static int tick_put(struct aumix_source *src, size_t sampc, int v,
+		    int step, unsigned framec)
+{
+	int16_t sampv[TICK_MAX];
+	size_t i;
+	int err = 0;
+
+	for (i=0; i<sampc; i++)
+		sampv[i] = (int16_t)(v + step * (int)i);
+
+	while (framec-- && !err)
+		err = aumix_source_put(src, sampv, sampc);
+
+	return err;
+}
+
+
+static void tick_float_handler(const float *sampv, size_t sampc, void *arg)
+{
+	struct tick_src *ts = arg;
+
+	memcpy(ts->ffv, sampv, min(sampc, TICK_MAX) * sizeof(*sampv));
+	ts->sampc = sampc;
+	++ts->framec;
+}
+
+
+/* Write float frames of sampc samples v + step * i to a source */
+static int tick_fput(struct aumix_source *src, size_t sampc, float v,
+		     float step, unsigned framec)
+{
+	float sampv[TICK_MAX];
+	size_t i;
+	int err = 0;
+
+	for (i=0; i<sampc; i++)
+		sampv[i] = v + step * (float)i;
+
+	while (framec-- && !err)
+		err = aumix_source_put_float(src, sampv, sampc);
+
+	return err;
+}
+
+
+/*
+ * Each source gets the sum of all other sources, saturated to 16 bits,
+ * also when the sum of all sources is beyond 16 bits
+ */
+int test_aumix_minus(void)
+{
+	static const struct {
+		int v[3];
+		int step[3];
+	} phasev[] = {
+		{{ 1000, -2000,   3000}, {1, 2, 3}},
+		{{30000,  30000, -30000}, {0, 0, 0}},
+		{{-30000, -30000,     5}, {0, 0, 1}},
+	};
+	struct tick_src tsv[3];
+	struct aumix *mix = NULL;
+	struct tick_env te;
+	size_t p, k, m, i;
+	int err;
+
+	memset(tsv, 0, sizeof(tsv));
+
+	err = tick_env_init(&te);
+	TEST_ERR(err);
+
+	err = aumix_alloc_shared(&mix, te.eng, TICK_SRATE, 1, TICK_PTIME);
+	TEST_ERR(err);
+
+	for (k=0; k<ARRAY_SIZE(tsv); k++) {
+		err = aumix_source_alloc(&tsv[k].src, mix, tick_handler,
+					 &tsv[k]);
+		TEST_ERR(err);
+
+		aumix_source_enable(tsv[k].src, true);
+	}
+
+	for (p=0; p<ARRAY_SIZE(phasev); p++) {
+
+		for (k=0; k<ARRAY_SIZE(tsv); k++) {
+
+			aumix_source_flush(tsv[k].src);
+
+			err = tick_put(tsv[k].src, TICK_FRAME, phasev[p].v[k],
+				       phasev[p].step[k], TICK_FILL);
+			TEST_ERR(err);
+		}
+
+		tick(&te, mix);
+		tick(&te, mix);
+
+		for (k=0; k<ARRAY_SIZE(tsv); k++) {
+
+			TEST_EQUALS(2 * (p + 1), tsv[k].framec);
+			TEST_EQUALS(TICK_FRAME, tsv[k].sampc);
+
+			for (i=0; i<TICK_FRAME; i++) {
+
+				int32_t sum = 0;
+
+				for (m=0; m<ARRAY_SIZE(tsv); m++) {
+					if (m != k) {
+						sum += phasev[p].v[m] +
+						  phasev[p].step[m] * (int)i;
+					}
+				}
+
+				TEST_EQUALS(saturate_s16(sum),
+					    tsv[k].frame[i]);
+			}
+		}
+	}
+
+ out:
+	for (k=0; k<ARRAY_SIZE(tsv); k++)
+		mem_deref(tsv[k].src);
+	mem_deref(mix);
+	tick_env_close(&te);
+
+	return err;
+}
+
+
+/*
+ * A mixer runs one frame per deadline. A frame that starts one period
+ * or more after its deadline is counted as late, and the next deadline
+ * stays on the grid, so that the mixer catches up.
+ */
+int test_aumix_deadline(void)
+{
+	const uint64_t period = DEADLINE_PTIME * 1000000ULL;
+	struct aumix_stats stats;
+	struct aumix *mix = NULL;
+	struct tick_src ts;
+	struct tick_env te;
+	uint64_t t0, now, next;
+	int err;
+
+	memset(&ts, 0, sizeof(ts));
+
+	err = tick_env_init(&te);
+	TEST_ERR(err);
+
+	err = aumix_alloc_shared(&mix, te.eng, TICK_SRATE, 1,
+				 DEADLINE_PTIME);
+	TEST_ERR(err);
+
+	err = aumix_source_alloc(&ts.src, mix, tick_handler, &ts);
+	TEST_ERR(err);
+
+	aumix_source_enable(ts.src, true);
+
+	t0 = aumix_mono_ns();
+	next = aumix_process(mix, &te.sc, t0);
+	TEST_EQUALS(t0 + period, next);
+
+	/* before the deadline */
+	TEST_EQUALS(next, aumix_process(mix, &te.sc, t0 + period / 2));
+	TEST_EQUALS(1, ts.framec);
+
+	aumix_sleep_until(next);
+	now = aumix_mono_ns();
+	TEST_ASSERT(now >= next);
+
+	next = aumix_process(mix, &te.sc, now);
+	TEST_EQUALS(t0 + 2 * period, next);
+
+	err = aumix_stats_get(mix, &stats);
+	TEST_ERR(err);
+	TEST_EQUALS(2, stats.ticks);
+	TEST_EQUALS(0, stats.late);
+
+	/* more than one period late */
+	aumix_sleep_until(next + period + period / 4);
+	now = aumix_mono_ns();
+
+	next = aumix_process(mix, &te.sc, now);
+	TEST_EQUALS(t0 + 3 * period, next);
+	TEST_ASSERT(next < now);
+
+	next = aumix_process(mix, &te.sc, now);
+	TEST_EQUALS(t0 + 4 * period, next);
+
+	err = aumix_stats_get(mix, &stats);
+	TEST_ERR(err);
+	TEST_EQUALS(4, stats.ticks);
+	TEST_EQUALS(1, stats.late);
+	TEST_EQUALS(4, ts.framec);
+
+	/* idle without sources */
+	aumix_source_enable(ts.src, false);
+	TEST_EQUALS(0, aumix_process(mix, &te.sc, aumix_mono_ns()));
+
+ out:
+	mem_deref(ts.src);
+	mem_deref(mix);
+	tick_env_close(&te);
+
+	return err;
+}
+
+
+/*
+ * The two loudest sources are mixed. A source that is a little louder
+ * than an active speaker does not replace it, a much louder one does.
+ */
+int test_aumix_speakers(void)
+{
+	static const struct {
+		int v[4];
+		int mix;
+	} phasev[] = {
+		{{8000, 6000,  4000, 100}, 14000},
+		{{8000, 6000,  7000, 100}, 14000},
+		{{8000, 6000, 12000, 100}, 20000},
+	};
+	struct tick_src tsv[4];
+	struct aumix_stats stats;
+	struct aumix *mix = NULL;
+	struct tick_env te;
+	size_t p, k, j;
+	int err;
+
+	memset(tsv, 0, sizeof(tsv));
+
+	err = tick_env_init(&te);
+	TEST_ERR(err);
+
+	err = aumix_alloc_shared(&mix, te.eng, TICK_SRATE, 1, TICK_PTIME);
+	TEST_ERR(err);
+
+	aumix_set_speakers(mix, 2);
+
+	for (k=0; k<ARRAY_SIZE(tsv); k++) {
+		err = aumix_source_alloc(&tsv[k].src, mix, tick_handler,
+					 &tsv[k]);
+		TEST_ERR(err);
+
+		aumix_source_enable(tsv[k].src, true);
+	}
+
+	for (p=0; p<ARRAY_SIZE(phasev); p++) {
+
+		for (k=0; k<ARRAY_SIZE(tsv); k++) {
+
+			aumix_source_flush(tsv[k].src);
+
+			err = tick_put(tsv[k].src, TICK_FRAME, phasev[p].v[k],
+				       0, 2 * TICK_FILL);
+			TEST_ERR(err);
+		}
+
+		for (j=0; j<2 * TICK_FILL; j++) {
+
+			tick(&te, mix);
+
+			/* the active speakers do not change in a phase */
+			if (p < 2) {
+				TEST_EQUALS(phasev[p].mix, tsv[3].frame[0]);
+			}
+		}
+
+		err = aumix_stats_get(mix, &stats);
+		TEST_ERR(err);
+		TEST_EQUALS(2, stats.mixed);
+
+		/* the inactive sources get the mix of the active ones */
+		TEST_EQUALS(phasev[p].mix, tsv[3].frame[0]);
+		TEST_EQUALS(phasev[p].mix, tsv[3].frame[TICK_FRAME - 1]);
+		TEST_EQUALS(phasev[p].mix - 8000, tsv[0].frame[0]);
+	}
+
+	TEST_EQUALS(20000, tsv[1].frame[0]);
+	TEST_EQUALS(8000, tsv[2].frame[0]);
+
+ out:
+	for (k=0; k<ARRAY_SIZE(tsv); k++)
+		mem_deref(tsv[k].src);
+	mem_deref(mix);
+	tick_env_close(&te);
+
+	return err;
+}
+
+
+/* Run n frames, with source 0 at 300 and source 1 at v */
+static int gain_run(struct tick_env *te, struct aumix *mix,
+		    struct tick_src *tsv, int v, unsigned n)
+{
+	int err;
+
+	aumix_source_flush(tsv[0].src);
+	aumix_source_flush(tsv[1].src);
+
+	err = tick_put(tsv[0].src, TICK_FRAME, 300, 0, TICK_FILL);
+	if (err)
+		return err;
+
+	err = tick_put(tsv[1].src, TICK_FRAME, v, 0, TICK_FILL);
+	if (err)
+		return err;
+
+	while (n-- && !err) {
+
+		tick(te, mix);
+
+		err = tick_put(tsv[0].src, TICK_FRAME, 300, 0, 1);
+		if (!err)
+			err = tick_put(tsv[1].src, TICK_FRAME, v, 0, 1);
+	}
+
+	return err;
+}
+
+
+/*
+ * The gain of a source applies to what the other sources get from it,
+ * a muted source still gets the mix, and the AGC brings a quiet and a
+ * loud source to the same level, but leaves noise alone
+ */
+int test_aumix_gain(void)
+{
+	struct tick_src tsv[2];
+	struct aumix *mix = NULL;
+	struct tick_env te;
+	int16_t prev = 0;
+	size_t k, j;
+	int err;
+
+	memset(tsv, 0, sizeof(tsv));
+
+	err = tick_env_init(&te);
+	TEST_ERR(err);
+
+	err = aumix_alloc_shared(&mix, te.eng, TICK_SRATE, 1, TICK_PTIME);
+	TEST_ERR(err);
+
+	for (k=0; k<ARRAY_SIZE(tsv); k++) {
+		err = aumix_source_alloc(&tsv[k].src, mix, tick_handler,
+					 &tsv[k]);
+		TEST_ERR(err);
+
+		aumix_source_enable(tsv[k].src, true);
+	}
+
+	aumix_source_set_gain(tsv[1].src, 0.5f);
+	err = gain_run(&te, mix, tsv, 1000, 1);
+	TEST_ERR(err);
+	TEST_EQUALS(500, tsv[0].frame[0]);
+	TEST_EQUALS(300, tsv[1].frame[0]);
+
+	aumix_source_set_gain(tsv[1].src, 2.0f);
+	err = gain_run(&te, mix, tsv, 1000, 1);
+	TEST_ERR(err);
+	TEST_EQUALS(2000, tsv[0].frame[0]);
+
+	/* the gain is limited to 16 */
+	aumix_source_set_gain(tsv[1].src, 100.0f);
+	err = gain_run(&te, mix, tsv, 1000, 1);
+	TEST_ERR(err);
+	TEST_EQUALS(16000, tsv[0].frame[TICK_FRAME - 1]);
+
+	aumix_source_set_gain(tsv[1].src, 1.0f);
+	aumix_source_mute(tsv[1].src, true);
+	err = gain_run(&te, mix, tsv, 1000, 1);
+	TEST_ERR(err);
+	TEST_EQUALS(0, tsv[0].frame[0]);
+	TEST_EQUALS(300, tsv[1].frame[0]);
+
+	aumix_source_mute(tsv[1].src, false);
+	aumix_source_set_agc(tsv[1].src, true);
+
+	/* a quiet source is raised slowly, towards about -18 dBFS */
+	for (j=0; j<60; j++) {
+		err = gain_run(&te, mix, tsv, 1000, 1);
+		TEST_ERR(err);
+		TEST_ASSERT(tsv[0].frame[0] >= prev);
+		prev = tsv[0].frame[0];
+	}
+
+	TEST_ASSERT(prev > 3900 && prev < 4200);
+
+	/* a loud source is lowered quickly */
+	err = gain_run(&te, mix, tsv, 16000, 20);
+	TEST_ERR(err);
+	TEST_ASSERT(tsv[0].frame[0] > 3900 && tsv[0].frame[0] < 4200);
+
+	/* noise is not raised */
+	aumix_source_set_agc(tsv[1].src, false);
+	aumix_source_set_agc(tsv[1].src, true);
+	err = gain_run(&te, mix, tsv, 50, 20);
+	TEST_ERR(err);
+	TEST_EQUALS(50, tsv[0].frame[0]);
+
+ out:
+	for (k=0; k<ARRAY_SIZE(tsv); k++)
+		mem_deref(tsv[k].src);
+	mem_deref(mix);
+	tick_env_close(&te);
+
+	return err;
+}
+
+
+/*
+ * Sources at another sample rate and channel count than the mixer are
+ * resampled on the way in and out. Each source must get the same as
+ * resampling the other sources to the mixer format, mixing them, and
+ * resampling the mix to its own format, with resamplers of its own.
+ */
+int test_aumix_resamp(void)
+{
+	static const struct {
+		uint32_t srate;
+		uint8_t ch;
+		int v;
+		int step;
+	} fmtv[] = {
+		{ 8000, 1, 4000, -7},
+		{16000, 1, 2000,  3},
+		{48000, 2, 1000,  1},
+	};
+	struct auresamp rinv[3], routv[3];
+	int16_t inv[3][TICK_MAX], mixv[TICK_MAX], ref[TICK_MAX];
+	int16_t sampv[TICK_MAX];
+	const size_t mixc = 16000 * TICK_PTIME / 1000;
+	struct tick_src tsv[3];
+	struct aumix *mix = NULL;
+	struct tick_env te;
+	size_t k, m, i, j, n, sampc;
+	int err;
+
+	memset(tsv, 0, sizeof(tsv));
+
+	for (k=0; k<ARRAY_SIZE(tsv); k++) {
+		auresamp_init(&rinv[k]);
+		auresamp_init(&routv[k]);
+	}
+
+	err = tick_env_init(&te);
+	TEST_ERR(err);
+
+	err = aumix_alloc_shared(&mix, te.eng, 16000, 1, TICK_PTIME);
+	TEST_ERR(err);
+
+	for (k=0; k<ARRAY_SIZE(tsv); k++) {
+
+		sampc = fmtv[k].srate * fmtv[k].ch * TICK_PTIME / 1000;
+
+		err = aumix_source_alloc_fmt(&tsv[k].src, mix, fmtv[k].srate,
+					     fmtv[k].ch, tick_handler,
+					     &tsv[k]);
+		TEST_ERR(err);
+
+		err = tick_put(tsv[k].src, sampc, fmtv[k].v, fmtv[k].step,
+			       TICK_FILL);
+		TEST_ERR(err);
+
+		aumix_source_enable(tsv[k].src, true);
+
+		err = auresamp_setup(&rinv[k], fmtv[k].srate, fmtv[k].ch,
+				     16000, 1);
+		TEST_ERR(err);
+
+		err = auresamp_setup(&routv[k], 16000, 1, fmtv[k].srate,
+				     fmtv[k].ch);
+		TEST_ERR(err);
+	}
+
+	for (j=0; j<10; j++) {
+
+		tick(&te, mix);
+
+		for (k=0; k<ARRAY_SIZE(tsv); k++) {
+
+			sampc = fmtv[k].srate * fmtv[k].ch * TICK_PTIME / 1000;
+
+			err = tick_put(tsv[k].src, sampc, fmtv[k].v,
+				       fmtv[k].step, 1);
+			TEST_ERR(err);
+
+			for (i=0; i<sampc; i++) {
+				sampv[i] = (int16_t)(fmtv[k].v +
+						     fmtv[k].step * (int)i);
+			}
+
+			n = TICK_MAX;
+
+			if (fmtv[k].srate == 16000) {
+				memcpy(inv[k], sampv, mixc * sizeof(sampv[0]));
+				continue;
+			}
+
+			err = auresamp(&rinv[k], inv[k], &n, sampv, sampc);
+			TEST_ERR(err);
+			TEST_EQUALS(mixc, n);
+		}
+
+		for (k=0; k<ARRAY_SIZE(tsv); k++) {
+
+			sampc = fmtv[k].srate * fmtv[k].ch * TICK_PTIME / 1000;
+
+			for (i=0; i<mixc; i++) {
+
+				int32_t sum = 0;
+
+				for (m=0; m<ARRAY_SIZE(tsv); m++) {
+					if (m != k)
+						sum += inv[m][i];
+				}
+
+				mixv[i] = saturate_s16(sum);
+			}
+
+			if (fmtv[k].srate == 16000) {
+				memcpy(ref, mixv, mixc * sizeof(mixv[0]));
+			}
+			else {
+				n = TICK_MAX;
+				err = auresamp(&routv[k], ref, &n, mixv, mixc);
+				TEST_ERR(err);
+				TEST_EQUALS(sampc, n);
+			}
+
+			TEST_EQUALS(j + 1, tsv[k].framec);
+			TEST_EQUALS(sampc, tsv[k].sampc);
+			TEST_MEMCMP(ref, tsv[k].frame, sampc * sizeof(ref[0]));
+		}
+	}
+
+ out:
+	for (k=0; k<ARRAY_SIZE(tsv); k++) {
+		mem_deref(tsv[k].src);
+		auresamp_reset(&rinv[k]);
+		auresamp_reset(&routv[k]);
+	}
+	mem_deref(mix);
+	tick_env_close(&te);
+
+	return err;
+}
+
+
+static void slow_handler(const int16_t *sampv, size_t sampc, void *arg)
+{
+	struct tick_src *ts = arg;
+
+	tick_handler(sampv, sampc, arg);
+
+	/* the third frame takes two periods */
+	if (ts->framec == 3)
+		sys_usleep(2 * TICK_PTIME * 1000);
+}
+
+
+/*
+ * Statistics of a mixer run in real time, and of the buffer of one of
+ * its sources
+ */
+int test_aumix_stats(void)
+{
+	struct aumix_stats stats;
+	struct aubuf_stats bstats;
+	struct aumix *mix = NULL;
+	struct tick_src tsv[2];
+	struct tick_env te;
+	uint64_t next, sum = 0;
+	size_t k, j;
+	int err;
+
+	memset(tsv, 0, sizeof(tsv));
+
+	err = tick_env_init(&te);
+	TEST_ERR(err);
+
+	err = aumix_alloc_shared(&mix, te.eng, TICK_SRATE, 1, TICK_PTIME);
+	TEST_ERR(err);
+
+	err = aumix_source_alloc(&tsv[0].src, mix, slow_handler, &tsv[0]);
+	TEST_ERR(err);
+
+	err = aumix_source_alloc(&tsv[1].src, mix, tick_handler, &tsv[1]);
+	TEST_ERR(err);
+
+	aumix_source_mute(tsv[1].src, true);
+
+	/* two frames more than the buffer holds */
+	err = tick_put(tsv[0].src, TICK_FRAME, 1000, 0, 2 * TICK_FILL + 2);
+	TEST_ERR(err);
+
+	err = aumix_source_stats_get(tsv[0].src, &bstats);
+	TEST_ERR(err);
+	TEST_EQUALS(2, bstats.overrun);
+	TEST_EQUALS(0, bstats.underrun);
+
+	for (k=0; k<ARRAY_SIZE(tsv); k++)
+		aumix_source_enable(tsv[k].src, true);
+
+	/* the buffer runs dry after 12 frames */
+	next = aumix_mono_ns();
+	for (j=0; j<2 * TICK_FILL + 2; j++) {
+		aumix_sleep_until(next);
+		next = aumix_process(mix, &te.sc, aumix_mono_ns());
+	}
+
+	err = aumix_source_stats_get(tsv[0].src, &bstats);
+	TEST_ERR(err);
+	TEST_EQUALS(2, bstats.overrun);
+	TEST_EQUALS(1, bstats.underrun);
+
+	err = aumix_stats_get(mix, &stats);
+	TEST_ERR(err);
+	TEST_EQUALS(2 * TICK_FILL + 2, stats.ticks);
+	TEST_EQUALS(1, stats.mixed);
+	TEST_EQUALS(1, stats.overrun);
+
+	for (k=0; k<AUMIX_STATS_HIST; k++)
+		sum += stats.hist[k];
+
+	TEST_EQUALS(stats.ticks, sum);
+
+	/* the slow frame is in the buckets from 16 ms */
+	TEST_EQUALS(1, stats.hist[14] + stats.hist[15]);
+
+ out:
+	for (k=0; k<ARRAY_SIZE(tsv); k++)
+		mem_deref(tsv[k].src);
+	mem_deref(mix);
+	tick_env_close(&te);
+
+	return err;
+}
+
+
+/*
+ * A float mixer gives each source the sum of all other sources, clipped
+ * to [-1.0, 1.0], and only takes float sources
+ */
+int test_aumix_float(void)
+{
+	static const struct {
+		float v[3];
+		float step[3];
+	} phasev[] = {
+		{{ 0.25f, -0.5f,  0.125f}, {1e-3f, -1e-3f, 2e-3f}},
+		{{ 0.75f,  0.75f, -0.75f}, {0, 0, 0}},
+		{{-0.75f, -0.75f,  0.5f},  {0, 0, 1e-3f}},
+	};
+	struct tick_src tsv[3];
+	struct aumix_source *isrc = NULL;
+	struct aumix *mix = NULL;
+	struct tick_env te;
+	size_t p, k, m, i;
+	int err;
+
+	memset(tsv, 0, sizeof(tsv));
+
+	err = tick_env_init(&te);
+	TEST_ERR(err);
+
+	err = aumix_alloc_fmt(&mix, te.eng, TICK_SRATE, 1, TICK_PTIME,
+			      AUFMT_FLOAT);
+	TEST_ERR(err);
+
+	err = aumix_source_alloc(&isrc, mix, tick_handler, NULL);
+	TEST_ASSERT(err != 0);
+	err = 0;
+
+	for (k=0; k<ARRAY_SIZE(tsv); k++) {
+		err = aumix_source_alloc_float(&tsv[k].src, mix, TICK_SRATE,
+					       1, tick_float_handler,
+					       &tsv[k]);
+		TEST_ERR(err);
+
+		aumix_source_enable(tsv[k].src, true);
+	}
+
+	for (p=0; p<ARRAY_SIZE(phasev); p++) {
+
+		for (k=0; k<ARRAY_SIZE(tsv); k++) {
+
+			aumix_source_flush(tsv[k].src);
+
+			err = tick_fput(tsv[k].src, TICK_FRAME,
+					phasev[p].v[k], phasev[p].step[k],
+					TICK_FILL);
+			TEST_ERR(err);
+		}
+
+		tick(&te, mix);
+		tick(&te, mix);
+
+		for (k=0; k<ARRAY_SIZE(tsv); k++) {
+
+			TEST_EQUALS(2 * (p + 1), tsv[k].framec);
+			TEST_EQUALS(TICK_FRAME, tsv[k].sampc);
+
+			for (i=0; i<TICK_FRAME; i++) {
+
+				float sum = 0;
+
+				for (m=0; m<ARRAY_SIZE(tsv); m++) {
+					if (m != k) {
+						sum += phasev[p].v[m] +
+						  phasev[p].step[m] * (float)i;
+					}
+				}
+
+				sum = sum > 1.0f ? 1.0f : sum;
+				sum = sum < -1.0f ? -1.0f : sum;
+
+				TEST_ASSERT(fabsf(sum - tsv[k].ffv[i])
+					    < 1e-6f);
+			}
+		}
+	}
+
+ out:
+	for (k=0; k<ARRAY_SIZE(tsv); k++)
+		mem_deref(tsv[k].src);
+	mem_deref(isrc);
+	mem_deref(mix);
+	tick_env_close(&te);
+
+	return err;
+}
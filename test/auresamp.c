@@ -0,0 +1,397 @@
+/**
+ * @file test/auresamp.c  Selftest -- audio resampler
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <re.h>
+#include <rem.h>
+#include "test.h"
+
+
+#if !defined (M_PI)
+#define M_PI 3.14159265358979323846264338327
+#endif
+
+
+/*
+ * The resample handler is set whenever a conversion is configured, as
+ * applications test it to see if the resampler is in use
+ */
+int test_auresamp_handler(void)
+{
+	static const uint32_t ratev[][4] = {
+		{16000, 1, 48000, 1},
+		{48000, 2,  8000, 1},
+		{44100, 1, 48000, 2},
+		{48000, 2, 32000, 2},
+		{16000, 1, 16000, 2},
+		{16000, 2, 16000, 1},
+	};
+	struct auresamp rs;
+	size_t i;
+	int err = 0;
+
+	auresamp_init(&rs);
+	TEST_ASSERT(rs.resample == NULL);
+
+	for (i=0; i<ARRAY_SIZE(ratev); i++) {
+
+		err = auresamp_setup(&rs, ratev[i][0], ratev[i][1],
+				     ratev[i][2], ratev[i][3]);
+		TEST_ERR(err);
+
+		TEST_ASSERT(rs.resample != NULL);
+	}
+
+	/* no conversion */
+	err = auresamp_setup(&rs, 48000, 2, 48000, 2);
+	TEST_ERR(err);
+	TEST_ASSERT(rs.resample == NULL);
+
+ out:
+	auresamp_reset(&rs);
+
+	return err;
+}
+
+
+/*
+ * Setting up a resampler again with the same parameters keeps its
+ * state, so that the output is the same as without the second setup
+ */
+int test_auresamp_setup_again(void)
+{
+	static const uint32_t ratev[][4] = {
+		{44100, 1, 48000, 1},
+		{48000, 2, 16000, 2},
+	};
+	int16_t inv[2 * 480], out[2 * 490], ref[2 * 490];
+	struct auresamp rs, rr;
+	size_t i, j, k, outc, refc;
+	int err = 0;
+
+	auresamp_init(&rs);
+	auresamp_init(&rr);
+
+	for (i=0; i<ARRAY_SIZE(ratev); i++) {
+
+		const uint32_t irate = ratev[i][0], ich = ratev[i][1];
+		const uint32_t orate = ratev[i][2], och = ratev[i][3];
+		const size_t inc = irate / 100 * ich;
+
+		err = auresamp_setup(&rs, irate, ich, orate, och);
+		TEST_ERR(err);
+
+		err = auresamp_setup(&rr, irate, ich, orate, och);
+		TEST_ERR(err);
+
+		for (k=0; k<4; k++) {
+
+			const struct auresamp_bank *bank = rs.bank;
+
+			for (j=0; j<inc; j++)
+				inv[j] = test_rand_s16();
+
+			err = auresamp_setup(&rs, irate, ich, orate, och);
+			TEST_ERR(err);
+			TEST_ASSERT(rs.bank == bank);
+
+			outc = ARRAY_SIZE(out);
+			refc = ARRAY_SIZE(ref);
+
+			err = auresamp(&rs, out, &outc, inv, inc);
+			TEST_ERR(err);
+
+			err = auresamp(&rr, ref, &refc, inv, inc);
+			TEST_ERR(err);
+
+			TEST_EQUALS(refc, outc);
+			TEST_MEMCMP(ref, out, outc * sizeof(out[0]));
+		}
+
+		auresamp_reset(&rs);
+		auresamp_reset(&rr);
+	}
+
+ out:
+	auresamp_reset(&rs);
+	auresamp_reset(&rr);
+
+	return err;
+}
+
+
+enum {
+	RATIO_CALLS = 200,
+	TONE_FREQ   = 1000,
+	TONE_AMPL   = 16000,
+	TONE_CALLS  = 60,
+	TONE_SKIP   = 5,
+};
+
+
+static const uint32_t rationalv[][4] = {
+	{44100, 1, 48000, 1},
+	{48000, 1, 44100, 1},
+	{16000, 1, 44100, 1},
+	{44100, 2, 32000, 2},
+	{48000, 2, 44100, 1},
+	{8000,  1, 44100, 2},
+};
+
+
+/*
+ * A rational ratio returns exactly inc*L/M frames for each call when
+ * that is an integer, and in total the same within one frame for input
+ * in chunks of any size
+ */
+int test_auresamp_ratio(void)
+{
+	int16_t inv[2 * 480], outv[2 * 1100];
+	struct auresamp rs;
+	size_t i, j, outc;
+	int err = 0;
+
+	auresamp_init(&rs);
+
+	for (i=0; i<ARRAY_SIZE(rationalv); i++) {
+
+		const uint32_t irate = rationalv[i][0], ich = rationalv[i][1];
+		const uint32_t orate = rationalv[i][2], och = rationalv[i][3];
+		uint64_t inframes = 0, outframes = 0, expect;
+
+		memset(inv, 0, sizeof(inv));
+
+		err = auresamp_setup(&rs, irate, ich, orate, och);
+		TEST_ERR(err);
+		TEST_ASSERT(rs.bank != NULL);
+
+		for (j=0; j<10; j++) {
+
+			outc = ARRAY_SIZE(outv);
+
+			err = auresamp(&rs, outv, &outc, inv,
+				       irate / 100 * ich);
+			TEST_ERR(err);
+			TEST_EQUALS(orate / 100 * och, outc);
+		}
+
+		for (j=0; j<RATIO_CALLS; j++) {
+
+			const size_t incc = 1 + test_rand() % (irate / 100);
+
+			outc = ARRAY_SIZE(outv);
+
+			err = auresamp(&rs, outv, &outc, inv, incc * ich);
+			TEST_ERR(err);
+			TEST_EQUALS(0, outc % och);
+
+			inframes  += incc;
+			outframes += outc / och;
+		}
+
+		expect = inframes * orate / irate;
+		TEST_ASSERT(outframes + 1 >= expect);
+		TEST_ASSERT(outframes <= expect + 1);
+
+		auresamp_reset(&rs);
+	}
+
+ out:
+	auresamp_reset(&rs);
+
+	return err;
+}
+
+
+/*
+ * A rational ratio passes DC and a tone in the passband at unity gain,
+ * and keeps the frequency of the tone
+ */
+int test_auresamp_tone(void)
+{
+	int16_t inv[2 * 480], outv[2 * 480];
+	struct auresamp rs;
+	size_t i, j, k, outc;
+	int err = 0;
+
+	auresamp_init(&rs);
+
+	for (i=0; i<ARRAY_SIZE(rationalv); i++) {
+
+		const uint32_t irate = rationalv[i][0], ich = rationalv[i][1];
+		const uint32_t orate = rationalv[i][2], och = rationalv[i][3];
+		const size_t incc = irate / 100;
+		int16_t peak = 0, dcmin = INT16_MAX, dcmax = INT16_MIN;
+		unsigned crossings = 0, expect;
+		size_t pos = 0;
+		int16_t prev = 0;
+
+		err = auresamp_setup(&rs, irate, ich, orate, och);
+		TEST_ERR(err);
+
+		/* DC */
+		for (k=0; k<incc * ich; k++)
+			inv[k] = TONE_AMPL;
+
+		for (j=0; j<TONE_CALLS; j++) {
+
+			outc = ARRAY_SIZE(outv);
+
+			err = auresamp(&rs, outv, &outc, inv, incc * ich);
+			TEST_ERR(err);
+
+			for (k=0; j>=TONE_SKIP && k<outc; k++) {
+				dcmin = min(dcmin, outv[k]);
+				dcmax = max(dcmax, outv[k]);
+			}
+		}
+
+		TEST_ASSERT(dcmin >= TONE_AMPL - 16);
+		TEST_ASSERT(dcmax <= TONE_AMPL + 16);
+
+		/* tone, in antiphase on the right channel */
+		for (j=0; j<TONE_CALLS; j++) {
+
+			for (k=0; k<incc; k++, pos++) {
+
+				const double w = 2 * M_PI * TONE_FREQ / irate;
+				const double v = TONE_AMPL * sin(w * pos);
+
+				inv[k * ich] = (int16_t)lrint(v);
+				if (ich == 2)
+					inv[k * ich + 1] = -inv[k * ich];
+			}
+
+			outc = ARRAY_SIZE(outv);
+
+			err = auresamp(&rs, outv, &outc, inv, incc * ich);
+			TEST_ERR(err);
+
+			if (j < TONE_SKIP)
+				continue;
+
+			for (k=0; k<outc; k+=och) {
+
+				const int16_t v = outv[k];
+
+				if (ich == 2 && och == 1) {
+					TEST_ASSERT(abs(v) <= 2);
+					continue;
+				}
+
+				if (ich == 2 && och == 2) {
+					TEST_ASSERT(abs(v + outv[k+1]) <= 2);
+				}
+				else if (och == 2) {
+					TEST_EQUALS(v, outv[k+1]);
+				}
+
+				peak = max(peak, (int16_t)abs(v));
+
+				if ((prev < 0) != (v < 0))
+					++crossings;
+
+				prev = v;
+			}
+		}
+
+		if (ich == 2 && och == 1)
+			goto next;
+
+		expect = 2 * TONE_FREQ * (TONE_CALLS - TONE_SKIP) / 100;
+
+		TEST_ASSERT(peak >= TONE_AMPL * 97 / 100 &&
+			    peak <= TONE_AMPL * 103 / 100);
+		TEST_ASSERT(crossings + 2 >= expect);
+		TEST_ASSERT(crossings <= expect + 2);
+
+	next:
+		auresamp_reset(&rs);
+	}
+
+ out:
+	auresamp_reset(&rs);
+
+	return err;
+}
+
+
+/*
+ * The float path gives the same output as the int16 path, within the
+ * rounding of the int16 filter taps and output
+ */
+int test_auresamp_float(void)
+{
+	static const uint32_t ratev[][4] = {
+		{ 8000, 1, 16000, 1},
+		{16000, 1, 48000, 2},
+		{48000, 2,  8000, 1},
+		{32000, 1, 16000, 1},
+		{16000, 2, 16000, 1},
+		{44100, 1, 48000, 1},
+		{48000, 2, 44100, 2},
+	};
+	int16_t inv[2 * 480], outv[2 * 480];
+	float finv[2 * 480], foutv[2 * 480];
+	struct auresamp rs, rf;
+	size_t i, j, k, outc, foutc;
+	int err = 0;
+
+	auresamp_init(&rs);
+	auresamp_init(&rf);
+
+	for (i=0; i<ARRAY_SIZE(ratev); i++) {
+
+		const uint32_t irate = ratev[i][0], ich = ratev[i][1];
+		const uint32_t orate = ratev[i][2], och = ratev[i][3];
+		const size_t inc = irate / 100 * ich;
+		size_t pos = 0;
+
+		err = auresamp_setup(&rs, irate, ich, orate, och);
+		TEST_ERR(err);
+
+		err = auresamp_setup(&rf, irate, ich, orate, och);
+		TEST_ERR(err);
+
+		for (j=0; j<TONE_CALLS; j++) {
+
+			for (k=0; k<inc; k++, pos++) {
+
+				const double w = 2 * M_PI * TONE_FREQ / irate;
+
+				inv[k]  = (int16_t)lrint(TONE_AMPL *
+							 sin(w * (pos / ich)));
+				finv[k] = inv[k] / 32768.0f;
+			}
+
+			outc  = ARRAY_SIZE(outv);
+			foutc = ARRAY_SIZE(foutv);
+
+			err = auresamp(&rs, outv, &outc, inv, inc);
+			TEST_ERR(err);
+
+			err = auresamp_float(&rf, foutv, &foutc, finv, inc);
+			TEST_ERR(err);
+
+			TEST_EQUALS(outc, foutc);
+
+			for (k=0; k<outc; k++)
+				TEST_ASSERT(fabs(foutv[k] * 32768.0 - outv[k])
+					    <= 3.0);
+		}
+
+		auresamp_reset(&rs);
+		auresamp_reset(&rf);
+	}
+
+ out:
+	auresamp_reset(&rs);
+	auresamp_reset(&rf);
+
+	return err;
+}
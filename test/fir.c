@@ -0,0 +1,691 @@
+/**
+ * @file test/fir.c  Selftest -- FIR filter
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#include <string.h>
+#include <math.h>
+#include <re.h>
+#include <rem.h>
+#include "fir/fir.h"
+#include "test.h"
+
+
+enum {
+	DOT_MAX      = 300,
+	FILT_SAMPC   = 960,
+	BENCH_TAPS   = 4096,
+	BENCH_FRAMES = 960,
+	BENCH_MACS   = 10000000,
+	BENCH_RUNS   = 5,
+	FFT_CALLS    = 4,
+	BLOCK_CH     = 3,
+};
+
+
+/*
+ * The FIR filter as it was before the vector kernels, with the ring
+ * index taken modulo ch * tapc, so that any tap count can be checked
+ */
+struct fir_ref {
+	int16_t history[FIR_HIST_MAX];
+	unsigned index;
+};
+
+
+static void fir_ref_filter(struct fir_ref *fir, int16_t *outv,
+			   const int16_t *inv, size_t inc,
+			   unsigned ch, const int16_t *tapv, size_t tapc)
+{
+	const unsigned hlen = ch * (unsigned)tapc;
+
+	if (hlen > ARRAY_SIZE(fir->history))
+		return;
+
+	while (inc--) {
+
+		const unsigned k = fir->index++ % hlen;
+		int64_t acc = 0;
+		unsigned i;
+
+		fir->history[k] = *inv++;
+
+		for (i=0; i<tapc; ++i) {
+			const unsigned j = (k + hlen - i*ch) % hlen;
+
+			acc += (int64_t)fir->history[j] * tapv[i];
+		}
+
+		if (acc > 0x3fffffff)
+			acc = 0x3fffffff;
+		else if (acc < -0x40000000)
+			acc = -0x40000000;
+
+		*outv++ = (int16_t)(acc>>15);
+	}
+}
+
+
+/*
+ * Random samples, or runs of full scale samples. A full scale run
+ * against full scale taps of the same sign gives the largest sums of
+ * each pair of products, which must not wrap in the 32-bit lanes.
+ */
+static void fill(int16_t *v, size_t n, unsigned pattern, bool taps)
+{
+	const int16_t lo = taps ? -32767 : INT16_MIN;
+	size_t i;
+
+	for (i=0; i<n; i++) {
+
+		switch (pattern) {
+
+		case 0:
+			v[i] = test_rand_s16();
+			if (taps && v[i] == INT16_MIN)
+				v[i] = lo;
+			break;
+
+		case 1:
+			v[i] = lo;
+			break;
+
+		case 2:
+			v[i] = INT16_MAX;
+			break;
+
+		default:
+			v[i] = (test_rand() & 0x100) ? INT16_MAX : lo;
+			break;
+		}
+	}
+}
+
+
+int test_fir_dot(void)
+{
+	int16_t x[DOT_MAX + 1], h[DOT_MAX + 1];
+	fir_dot_h *dot;
+	unsigned k, px, ph;
+	size_t n;
+	int err = 0;
+
+	for (k=0; (dot = fir_dot_get(k)); k++) {
+
+		/* all lengths up to a few vectors, and some longer ones */
+		for (n=0; n<=DOT_MAX; n += n < 64 ? 1 : 29) {
+
+			for (px=0; px<4; px++) {
+				for (ph=0; ph<4; ph++) {
+
+					fill(x, n + 1, px, false);
+					fill(h, n + 1, ph, true);
+
+					TEST_EQUALS(fir_dot_scalar(x, h, n),
+						    dot(x, h, n));
+
+					/* unaligned */
+					TEST_EQUALS(fir_dot_scalar(x+1, h+1, n),
+						    dot(x + 1, h + 1, n));
+				}
+			}
+		}
+	}
+
+ out:
+	if (err) {
+		(void)re_fprintf(stderr, "kernel %u, %zu samples\n",
+				 k, n);
+	}
+
+	return err;
+}
+
+
+static int test_filter(unsigned ch, size_t tapc, unsigned pattern,
+		       size_t chunk)
+{
+	int16_t tapv[FIR_HIST_MAX], inv[FILT_SAMPC];
+	int16_t out[FILT_SAMPC], ref[FILT_SAMPC];
+	struct fir_ref fr;
+	struct fir fir;
+	size_t i, n;
+	int err = 0;
+
+	fill(tapv, tapc, pattern, true);
+	fill(inv, FILT_SAMPC, pattern, false);
+
+	fir_reset(&fir);
+	memset(&fr, 0, sizeof(fr));
+
+	for (i=0; i<FILT_SAMPC; i+=n) {
+
+		n = min(chunk, FILT_SAMPC - i);
+
+		fir_filter(&fir, &out[i], &inv[i], n, ch, tapv, tapc);
+	}
+
+	fir_ref_filter(&fr, ref, inv, FILT_SAMPC, ch, tapv, tapc);
+
+	TEST_MEMCMP(ref, out, sizeof(ref));
+
+ out:
+	return err;
+}
+
+
+/*
+ * Mono and stereo, with tap counts that are not a multiple of the
+ * vector width, and input in chunks that split the frames
+ */
+int test_fir_filter(void)
+{
+	static const size_t tapcv[] = {1, 2, 3, 7, 16, 17, 31, 32, 33, 127};
+	static const size_t chunkv[] = {1, 5, 160, 161};
+	unsigned ch, pattern;
+	size_t t;
+	int err;
+
+	for (ch=1; ch<=2; ch++) {
+		for (t=0; t<ARRAY_SIZE(tapcv); t++) {
+			for (pattern=0; pattern<4; pattern++) {
+
+				const size_t chunk =
+					chunkv[(t + pattern) % 4];
+
+				err = test_filter(ch, tapcv[t], pattern,
+						  chunk);
+				if (err) {
+					(void)re_fprintf(stderr,
+						"%u channels, %zu taps\n",
+						ch, tapcv[t]);
+					return err;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * A tap of -32768 does not fit the vector kernels, and the filter must
+ * then fall back to the scalar kernel
+ */
+int test_fir_int16_min(void)
+{
+	static const size_t tapcv[] = {1, 2, 16, 32};
+	int16_t tapv[32], inv[FILT_SAMPC];
+	int16_t out[FILT_SAMPC], ref[FILT_SAMPC];
+	struct fir_ref fr;
+	struct fir fir;
+	size_t i, t;
+	int err = 0;
+
+	for (t=0; t<ARRAY_SIZE(tapcv); t++) {
+
+		const size_t tapc = tapcv[t];
+
+		fill(tapv, tapc, 3, true);
+		tapv[tapc / 2] = INT16_MIN;
+
+		fill(inv, FILT_SAMPC, 3, false);
+		for (i=0; i<FILT_SAMPC; i+=7)
+			inv[i] = INT16_MIN;
+
+		fir_reset(&fir);
+		memset(&fr, 0, sizeof(fr));
+
+		fir_filter(&fir, out, inv, FILT_SAMPC, 1, tapv, tapc);
+		fir_ref_filter(&fr, ref, inv, FILT_SAMPC, 1, tapv, tapc);
+
+		TEST_MEMCMP(ref, out, sizeof(ref));
+	}
+
+ out:
+	return err;
+}
+
+
+/* Direct form of one block, as filter_direct() in fir/block.c */
+static void direct_ref(int16_t *outv, size_t stride, const int16_t *s,
+		       const int16_t *rtapv, size_t tapc, size_t n)
+{
+	size_t k;
+
+	for (k=0; k<n; k++) {
+
+		int64_t acc = fir_dot_scalar(&s[k], rtapv, tapc);
+
+		if (acc > 0x3fffffff)
+			acc = 0x3fffffff;
+		else if (acc < -0x40000000)
+			acc = -0x40000000;
+
+		outv[k * stride] = (int16_t)(acc>>15);
+	}
+}
+
+
+static int test_fft(size_t tapc, size_t hop, unsigned pattern)
+{
+	const size_t n = 2 * hop, len = tapc - 1 + FFT_CALLS * n;
+	int16_t *rtapv, *xa, *xb, *out, *ref;
+	struct fir_fft *ff = NULL;
+	unsigned i;
+	int err = 0;
+
+	rtapv = mem_alloc(tapc * sizeof(*rtapv), NULL);
+	xa    = mem_zalloc(len * sizeof(*xa), NULL);
+	xb    = mem_zalloc(len * sizeof(*xb), NULL);
+	out   = mem_alloc(2 * n * sizeof(*out), NULL);
+	ref   = mem_alloc(2 * n * sizeof(*ref), NULL);
+	if (!rtapv || !xa || !xb || !out || !ref) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	fill(rtapv, tapc, pattern, true);
+	fill(&xa[tapc - 1], FFT_CALLS * n, pattern, false);
+	fill(&xb[tapc - 1], FFT_CALLS * n, 0, false);
+
+	err = fir_fft_alloc(&ff, rtapv, tapc, hop);
+	TEST_ERR(err);
+	TEST_EQUALS(hop, fir_fft_hop(ff));
+
+	for (i=0; i<FFT_CALLS; i++) {
+
+		const int16_t *sa = &xa[i * n], *sb = &xb[i * n];
+
+		/* the third block is skipped, as if filtered elsewhere */
+		if (i == 2) {
+			fir_fft_invalidate(ff);
+			continue;
+		}
+
+		if (i == 1)
+			fir_fft_invalidate(ff);
+
+		fir_fft_filter(ff, out, sa, &out[1], sb, n, 2);
+
+		direct_ref(ref, 2, sa, rtapv, tapc, n);
+		direct_ref(&ref[1], 2, sb, rtapv, tapc, n);
+
+		TEST_MEMCMP(ref, out, 2 * n * sizeof(*out));
+	}
+
+	/* one stream */
+	fir_fft_invalidate(ff);
+	fir_fft_filter(ff, out, xa, NULL, NULL, n, 1);
+	direct_ref(ref, 1, xa, rtapv, tapc, n);
+
+	TEST_MEMCMP(ref, out, n * sizeof(*out));
+
+ out:
+	mem_deref(ff);
+	mem_deref(ref);
+	mem_deref(out);
+	mem_deref(xb);
+	mem_deref(xa);
+	mem_deref(rtapv);
+
+	return err;
+}
+
+
+/*
+ * The FFT convolver gives the same output as the direct form, with one
+ * or two streams, partial and whole partitions, and after the delay
+ * line was rebuilt from the history
+ */
+int test_fir_fft(void)
+{
+	static const size_t tapcv[] = {1, 63, 64, 65, 200, 1000};
+	static const size_t hopv[] = {64, 160};
+	size_t t, h;
+	unsigned pattern;
+	int err = 0;
+
+	for (h=0; h<ARRAY_SIZE(hopv); h++) {
+		for (t=0; t<ARRAY_SIZE(tapcv); t++) {
+			for (pattern=0; pattern<4; pattern++) {
+
+				err = test_fft(tapcv[t], hopv[h], pattern);
+				if (err) {
+					(void)re_fprintf(stderr,
+						"%zu taps, hop %zu\n",
+						tapcv[t], hopv[h]);
+					return err;
+				}
+			}
+		}
+	}
+
+	return err;
+}
+
+
+static int test_block(unsigned ch, size_t tapc, unsigned pattern)
+{
+	static const size_t blockv[] = {480, 480, 7, 473, 480, 960, 960,
+					160, 1, 159};
+	int16_t *tapv, *rtapv, *x, *s, *out, *ref;
+	struct fir_block *fb = NULL;
+	size_t len = 0, i, k, pos;
+	unsigned c;
+	int err = 0;
+
+	for (i=0; i<ARRAY_SIZE(blockv); i++)
+		len += blockv[i];
+
+	tapv  = mem_alloc(tapc * sizeof(*tapv), NULL);
+	rtapv = mem_alloc(tapc * sizeof(*rtapv), NULL);
+	x     = mem_alloc(len * ch * sizeof(*x), NULL);
+	s     = mem_zalloc((tapc - 1 + len) * sizeof(*s), NULL);
+	out   = mem_alloc(len * ch * sizeof(*out), NULL);
+	ref   = mem_alloc(len * ch * sizeof(*ref), NULL);
+	if (!tapv || !rtapv || !x || !s || !out || !ref) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	fill(tapv, tapc, pattern, true);
+	fill(x, len * ch, pattern, false);
+
+	for (i=0; i<tapc; i++)
+		rtapv[tapc - 1 - i] = tapv[i];
+
+	for (c=0; c<ch; c++) {
+
+		for (k=0; k<len; k++)
+			s[tapc - 1 + k] = x[k * ch + c];
+
+		direct_ref(&ref[c], ch, s, rtapv, tapc, len);
+	}
+
+	err = fir_block_alloc(&fb, ch, tapv, tapc);
+	TEST_ERR(err);
+
+	for (i=0, pos=0; i<ARRAY_SIZE(blockv); pos+=blockv[i++]) {
+
+		int16_t *o = &out[pos * ch];
+
+		/* every other block in place */
+		if (i & 1) {
+			memcpy(o, &x[pos * ch], blockv[i] * ch * sizeof(*o));
+			err = fir_block_filter(fb, o, o, blockv[i] * ch);
+		}
+		else {
+			err = fir_block_filter(fb, o, &x[pos * ch],
+					       blockv[i] * ch);
+		}
+		TEST_ERR(err);
+	}
+
+	TEST_MEMCMP(ref, out, len * ch * sizeof(*out));
+
+	/* after a reset, the output starts over */
+	fir_block_reset(fb);
+
+	err = fir_block_filter(fb, out, x, blockv[0] * ch);
+	TEST_ERR(err);
+	TEST_MEMCMP(ref, out, blockv[0] * ch * sizeof(*out));
+
+ out:
+	mem_deref(fb);
+	mem_deref(ref);
+	mem_deref(out);
+	mem_deref(s);
+	mem_deref(x);
+	mem_deref(rtapv);
+	mem_deref(tapv);
+
+	return err;
+}
+
+
+/*
+ * The block filter matches the direct form for any number of taps and
+ * channels, whichever form it picks for each call, with block sizes
+ * that change and input filtered in place
+ */
+int test_fir_block(void)
+{
+	static const size_t tapcv[] = {1, 17, 64, 300, 1000, 2048};
+	size_t t;
+	unsigned ch, pattern;
+	int err = 0;
+
+	for (ch=1; ch<=BLOCK_CH; ch++) {
+		for (t=0; t<ARRAY_SIZE(tapcv); t++) {
+
+			pattern = (unsigned)(ch + t) % 4;
+
+			err = test_block(ch, tapcv[t], pattern);
+			if (err) {
+				(void)re_fprintf(stderr,
+						 "%u channels, %zu taps\n",
+						 ch, tapcv[t]);
+				return err;
+			}
+		}
+	}
+
+	return err;
+}
+
+
+/*
+ * The float filter gives the same output as fir_filter(), within the
+ * truncation of the int16 output, for taps scaled so that it does not
+ * saturate
+ */
+int test_fir_float(void)
+{
+	static const size_t tapcv[] = {1, 3, 7, 16, 17, 33, 127};
+	int16_t tapv[FIR_HIST_MAX], inv[FILT_SAMPC], out[FILT_SAMPC];
+	float ftapv[FIR_HIST_MAX], finv[FILT_SAMPC], fout[FILT_SAMPC];
+	struct fir_float ff;
+	struct fir fir;
+	size_t t, i, n;
+	unsigned ch;
+	int err = 0;
+
+	for (ch=1; ch<=2; ch++) {
+		for (t=0; t<ARRAY_SIZE(tapcv); t++) {
+
+			const size_t tapc = tapcv[t];
+
+			for (i=0; i<tapc; i++) {
+				tapv[i]  = (int16_t)(test_rand_s16() /
+						     (int)tapc);
+				ftapv[i] = tapv[i] / 32768.0f;
+			}
+
+			for (i=0; i<FILT_SAMPC; i++) {
+				inv[i]  = test_rand_s16();
+				finv[i] = inv[i] / 32768.0f;
+			}
+
+			fir_reset(&fir);
+			fir_float_reset(&ff);
+
+			for (i=0; i<FILT_SAMPC; i+=n) {
+
+				n = min(160 + ch, FILT_SAMPC - i);
+
+				fir_filter(&fir, &out[i], &inv[i], n, ch,
+					   tapv, tapc);
+				fir_float_filter(&ff, &fout[i], &finv[i], n,
+						 ch, ftapv, tapc);
+			}
+
+			for (i=0; i<FILT_SAMPC; i++) {
+
+				const double d = fout[i] * 32768.0 - out[i];
+
+				TEST_ASSERT(d > -0.1 && d < 1.1);
+			}
+		}
+	}
+
+ out:
+	if (err) {
+		(void)re_fprintf(stderr, "%u channels, %zu taps\n",
+				 ch, tapcv[t]);
+	}
+
+	return err;
+}
+
+/** Defines one block filter benchmark */
+struct bench {
+	fir_dot_h *dot;        /**< Dot product kernel, direct form  */
+	struct fir_fft *ff;    /**< FFT convolver                    */
+	struct fir_block *fb;  /**< Block filter, picking the form   */
+	const int16_t *tapv;   /**< Reversed taps                    */
+	size_t tapc;           /**< Number of taps                   */
+	const int16_t *s;      /**< History and input                */
+	int16_t *out;          /**< Output                           */
+	size_t n;              /**< Number of frames per block       */
+	unsigned rounds;       /**< Number of blocks per measurement */
+};
+
+enum bench_form {
+	BENCH_DIRECT,
+	BENCH_FFT,
+	BENCH_AUTO,
+};
+
+
+static void bench_run(const struct bench *b, enum bench_form form)
+{
+	unsigned r;
+	size_t k;
+
+	for (r=0; r<b->rounds; r++) {
+
+		switch (form) {
+
+		case BENCH_DIRECT:
+			for (k=0; k<b->n; k++) {
+				const int64_t acc = b->dot(&b->s[k], b->tapv,
+							   b->tapc);
+
+				b->out[k] = (int16_t)(acc >> 15);
+			}
+			break;
+
+		case BENCH_FFT:
+			fir_fft_filter(b->ff, b->out, b->s, NULL, NULL, b->n,
+				       1);
+			break;
+
+		default:
+			(void)fir_block_filter(b->fb, b->out,
+					       &b->s[b->tapc - 1], b->n);
+			break;
+		}
+	}
+}
+
+
+/* Best of a few runs, in [us] per block */
+static double bench_us(const struct bench *b, enum bench_form form)
+{
+	uint64_t best = ~0ULL;
+	unsigned i;
+
+	for (i=0; i<BENCH_RUNS; i++) {
+
+		const uint64_t t0 = test_ns();
+
+		bench_run(b, form);
+
+		best = min(best, test_ns() - t0);
+	}
+
+	return (double)best / b->rounds / 1000.0;
+}
+
+
+/*
+ * Direct form against FFT convolution for one channel, in [us] per
+ * block, and the form that fir_block_filter() picks. The cost model in
+ * fir/block.c should pick the faster one, except near the break-even
+ * point.
+ */
+int perf_fir_block(void)
+{
+	static const size_t framev[] = {80, 160, 480, 960};
+	static const size_t tapcv[] = {64, 256, 1024, 2048, 4096};
+	int16_t *tapv, *s, *out;
+	struct bench b;
+	size_t f, t;
+	int err = 0;
+
+	memset(&b, 0, sizeof(b));
+
+	tapv = mem_alloc(BENCH_TAPS * sizeof(*tapv), NULL);
+	s    = mem_zalloc((BENCH_TAPS + BENCH_FRAMES) * sizeof(*s), NULL);
+	out  = mem_alloc(BENCH_FRAMES * sizeof(*out), NULL);
+	if (!tapv || !s || !out) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	b.dot  = fir_dot_kernel();
+	b.tapv = tapv;
+	b.s    = s;
+	b.out  = out;
+
+	(void)re_fprintf(stderr, "\n%6s %6s %9s %9s %9s\n",
+			 "frames", "taps", "direct", "fft", "auto");
+
+	for (f=0; f<ARRAY_SIZE(framev); f++) {
+		for (t=0; t<ARRAY_SIZE(tapcv); t++) {
+
+			double direct, fft, autom;
+
+			b.n      = framev[f];
+			b.tapc   = tapcv[t];
+			b.rounds = (unsigned)(BENCH_MACS / b.n / b.tapc) + 1;
+
+			fill(tapv, b.tapc, 0, true);
+			fill(s, b.tapc - 1 + b.n, 0, false);
+
+			err = fir_fft_alloc(&b.ff, tapv, b.tapc, b.n);
+			TEST_ERR(err);
+
+			err = fir_block_alloc(&b.fb, 1, tapv, b.tapc);
+			TEST_ERR(err);
+
+			/* the first call sizes the scratch and picks the form */
+			err = fir_block_filter(b.fb, out, &s[b.tapc - 1],
+					       b.n);
+			TEST_ERR(err);
+
+			direct = bench_us(&b, BENCH_DIRECT);
+			fft    = bench_us(&b, BENCH_FFT);
+			autom  = bench_us(&b, BENCH_AUTO);
+
+			(void)re_fprintf(stderr,
+					 "%6zu %6zu %9.1f %9.1f %9.1f\n",
+					 b.n, b.tapc, direct, fft, autom);
+
+			b.ff = mem_deref(b.ff);
+			b.fb = mem_deref(b.fb);
+		}
+	}
+
+ out:
+	mem_deref(b.fb);
+	mem_deref(b.ff);
+	mem_deref(out);
+	mem_deref(s);
+	mem_deref(tapv);
+
+	return err;
+}
@@ -0,0 +1,183 @@
+/**
+ * @file main.c  Selftest for librem
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+#define _DEFAULT_SOURCE 1
+#include <string.h>
+#include <time.h>
+#include <re.h>
+#include <rem.h>
+#include "test.h"
+
+
+#define TEST(a) {#a, a}
+
+typedef int (test_exec_h)(void);
+
+struct test {
+	const char *name;
+	test_exec_h *exec;
+};
+
+
+static const struct test testv[] = {
+	TEST(test_auconv_kernel),
+	TEST(test_auconv_remix),
+	TEST(test_aubuf_adaptive),
+	TEST(test_aubuf_partial_gap),
+	TEST(test_aubuf_peek),
+	TEST(test_aubuf_plc),
+	TEST(test_aubuf_pool),
+	TEST(test_aubuf_put_ts),
+	TEST(test_aubuf_read_batch),
+	TEST(test_aubuf_stretch_gap),
+	TEST(test_aubuf_ts_jump),
+	TEST(test_aumix_deadline),
+	TEST(test_aumix_engine_release),
+	TEST(test_aumix_engine_reentrant),
+	TEST(test_aumix_float),
+	TEST(test_aumix_gain),
+	TEST(test_aumix_kernel),
+	TEST(test_aumix_minus),
+	TEST(test_aumix_ptime),
+	TEST(test_aumix_prompt_cache),
+	TEST(test_aumix_prompt_flush),
+	TEST(test_aumix_resamp),
+	TEST(test_aumix_speakers),
+	TEST(test_aumix_stats),
+	TEST(test_auresamp_float),
+	TEST(test_auresamp_handler),
+	TEST(test_auresamp_ratio),
+	TEST(test_auresamp_setup_again),
+	TEST(test_auresamp_tone),
+	TEST(test_fir_block),
+	TEST(test_fir_dot),
+	TEST(test_fir_fft),
+	TEST(test_fir_filter),
+	TEST(test_fir_float),
+	TEST(test_fir_int16_min),
+};
+
+
+static const struct test perfv[] = {
+	TEST(perf_auconv_kernel),
+	TEST(perf_auconv_remix),
+	TEST(perf_fir_block),
+};
+
+
+static uint32_t rand_state = 1;
+
+
+void test_fail(const char *file, unsigned line, const char *what)
+{
+	(void)re_fprintf(stderr, "\n%s:%u: failed: %s\n", file, line, what);
+}
+
+
+/* Deterministic pseudo-random numbers, so that failures can be rerun */
+uint32_t test_rand(void)
+{
+	rand_state = rand_state * 1103515245 + 12345;
+
+	return rand_state;
+}
+
+
+int16_t test_rand_s16(void)
+{
+	return (int16_t)(test_rand() >> 16);
+}
+
+
+uint64_t test_ns(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static int run(const struct test *tv, size_t n, const char *name)
+{
+	size_t i, runc = 0;
+	int err = 0;
+
+	for (i=0; i<n; i++) {
+
+		int e;
+
+		if (name && !strstr(tv[i].name, name))
+			continue;
+
+		(void)re_fprintf(stderr, "%-32s ", tv[i].name);
+
+		rand_state = 1;
+
+		e = tv[i].exec();
+		if (e) {
+			(void)re_fprintf(stderr, "FAILED (%m)\n", e);
+			err = e;
+		}
+		else {
+			(void)re_fprintf(stderr, "ok\n");
+		}
+
+		++runc;
+	}
+
+	if (name && !runc) {
+		(void)re_fprintf(stderr, "no tests matching '%s'\n", name);
+		return ENOENT;
+	}
+
+	return err;
+}
+
+
+static void usage(void)
+{
+	(void)re_fprintf(stderr,
+			 "usage: remtest [-p] [name]\n"
+			 "\t-p    Run the benchmarks instead of the tests\n"
+			 "\tname  Run only the tests containing name\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char *name = NULL;
+	bool perf = false;
+	int i, err;
+
+	for (i=1; i<argc; i++) {
+
+		if (!strcmp(argv[i], "-p")) {
+			perf = true;
+		}
+		else if (argv[i][0] == '-' || name) {
+			usage();
+			return 2;
+		}
+		else {
+			name = argv[i];
+		}
+	}
+
+	err = libre_init();
+	if (err)
+		return 1;
+
+	if (perf)
+		err = run(perfv, ARRAY_SIZE(perfv), name);
+	else
+		err = run(testv, ARRAY_SIZE(testv), name);
+
+	libre_close();
+
+	return err ? 1 : 0;
+}
@@ -0,0 +1,75 @@
+/**
+ * @file test.h  Selftest for librem -- internal API
+ *
+ * Copyright (C) 2010 Creytiv.com
+ */
+
+
+#define TEST_ASSERT(expr)						\
+	if (!(expr)) {							\
+		test_fail(__FILE__, __LINE__, #expr);			\
+		err = EINVAL;						\
+		goto out;						\
+	}
+
+#define TEST_EQUALS(expected, actual)					\
+	TEST_ASSERT((expected) == (actual))
+
+#define TEST_MEMCMP(expected, actual, n)				\
+	TEST_ASSERT(!memcmp((expected), (actual), (n)))
+
+#define TEST_ERR(e)							\
+	if ((e)) {							\
+		test_fail(__FILE__, __LINE__, "unexpected error");	\
+		goto out;						\
+	}
+
+
+void     test_fail(const char *file, unsigned line, const char *what);
+uint32_t test_rand(void);
+int16_t  test_rand_s16(void);
+uint64_t test_ns(void);
+
+
+/* Tests */
+int test_auconv_kernel(void);
+int test_auconv_remix(void);
+int test_aubuf_adaptive(void);
+int test_aubuf_partial_gap(void);
+int test_aubuf_peek(void);
+int test_aubuf_plc(void);
+int test_aubuf_pool(void);
+int test_aubuf_put_ts(void);
+int test_aubuf_read_batch(void);
+int test_aubuf_stretch_gap(void);
+int test_aubuf_ts_jump(void);
+int test_aumix_deadline(void);
+int test_aumix_engine_release(void);
+int test_aumix_engine_reentrant(void);
+int test_aumix_float(void);
+int test_aumix_gain(void);
+int test_aumix_kernel(void);
+int test_aumix_minus(void);
+int test_aumix_ptime(void);
+int test_aumix_prompt_cache(void);
+int test_aumix_prompt_flush(void);
+int test_aumix_resamp(void);
+int test_aumix_speakers(void);
+int test_aumix_stats(void);
+int test_auresamp_float(void);
+int test_auresamp_handler(void);
+int test_auresamp_ratio(void);
+int test_auresamp_setup_again(void);
+int test_auresamp_tone(void);
+int test_fir_block(void);
+int test_fir_dot(void);
+int test_fir_fft(void);
+int test_fir_filter(void);
+int test_fir_float(void);
+int test_fir_int16_min(void);
+
+
+/* Benchmarks */
+int perf_auconv_kernel(void);
+int perf_auconv_remix(void);
+int perf_fir_block(void);